@@ -25,6 +25,58 @@
 
 using namespace dsp;
 
+//==============================================================================
+/** Hands the latest version of an object from one writer thread to one reader
+    thread without either of them ever waiting.
+
+    There are three copies: the writer fills its own one and swaps it with the
+    spare, and the reader swaps its own one with the spare whenever a newer one
+    has been published. Neither thread ever sees a copy the other is using.
+*/
+template <typename Type>
+class TripleBuffer
+{
+public:
+    TripleBuffer() = default;
+
+    /** The writer's copy, which it can fill in at leisure. */
+    Type& getWriteBuffer() noexcept             { return buffers[(size_t) writeIndex]; }
+
+    /** Makes the writer's copy the latest one. */
+    void publish() noexcept
+    {
+        writeIndex = state.exchange (writeIndex | newDataFlag, std::memory_order_acq_rel) & indexMask;
+    }
+
+    /** Takes the latest published copy, if there's one the reader hasn't seen. */
+    bool update() noexcept
+    {
+        if ((state.load (std::memory_order_relaxed) & newDataFlag) == 0)
+            return false;
+
+        readIndex = state.exchange (readIndex, std::memory_order_acq_rel) & indexMask;
+        return true;
+    }
+
+    /** The reader's copy. The reader can swap things out of it, and they'll be
+        destroyed by the writer when it next reuses the copy.
+    */
+    Type& getReadBuffer() noexcept              { return buffers[(size_t) readIndex]; }
+
+    /** For setting up all three copies before either thread starts using them. */
+    template <typename Function>
+    void forEachBuffer (Function&& fn)          { for (auto& b : buffers) fn (b); }
+
+private:
+    static constexpr int indexMask = 3, newDataFlag = 4;
+
+    std::array<Type, 3> buffers;
+    std::atomic<int> state { 1 };
+    int writeIndex = 0, readIndex = 2;
+
+    JUCE_DECLARE_NON_COPYABLE (TripleBuffer)
+};
+
 //==============================================================================
 struct DSPDemoParameterBase    : public ChangeBroadcaster
 {
@@ -36,8 +88,17 @@ struct DSPDemoParameterBase    : public ChangeBroadcaster
     virtual int getPreferredHeight()  = 0;
     virtual int getPreferredWidth()   = 0;
 
+    /** Reads the control. Called on the message thread, when a snapshot is taken. */
+    virtual double getValueFromComponent() const = 0;
+
+    /** The value from the snapshot the audio thread last picked up. */
+    void setSnapshotValue (double newValue) noexcept    { snapshotValue.store (newValue, std::memory_order_relaxed); }
+
     String name;
 
+protected:
+    std::atomic<double> snapshotValue { 0.0 };
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (DSPDemoParameterBase)
 };
 
@@ -56,6 +117,7 @@ struct SliderParameter final : public DSPDemoParameterBase
             slider.setTextValueSuffix (suffix);
 
         slider.onValueChange = [this] { sendChangeMessage(); };
+        setSnapshotValue (slider.getValue());
     }
 
     Component* getComponent() override    { return &slider; }
@@ -63,7 +125,16 @@ struct SliderParameter final : public DSPDemoParameterBase
     int getPreferredHeight() override     { return 40; }
     int getPreferredWidth()  override     { return 500; }
 
-    double getCurrentValue() const        { return slider.getValue(); }
+    double getValueFromComponent() const override    { return slider.getValue(); }
+
+    /** The slider's value on the message thread, and the value as of the latest
+        snapshot anywhere else, so it's safe to call on the audio thread.
+    */
+    double getCurrentValue() const
+    {
+        return MessageManager::existsAndIsCurrentThread() ? getValueFromComponent()
+                                                          : snapshotValue.load (std::memory_order_relaxed);
+    }
 
 private:
     Slider slider;
@@ -79,6 +150,7 @@ struct ChoiceParameter final : public DSPDemoParameterBase
         parameterBox.onChange = [this] { sendChangeMessage(); };
 
         parameterBox.setSelectedId (initialId);
+        setSnapshotValue (initialId);
     }
 
     Component* getComponent() override    { return &parameterBox; }
@@ -86,7 +158,16 @@ struct ChoiceParameter final : public DSPDemoParameterBase
     int getPreferredHeight() override     { return 25; }
     int getPreferredWidth()  override     { return 250; }
 
-    int getCurrentSelectedID() const      { return parameterBox.getSelectedId(); }
+    double getValueFromComponent() const override    { return parameterBox.getSelectedId(); }
+
+    /** The selection on the message thread, and the selection as of the latest
+        snapshot anywhere else, so it's safe to call on the audio thread.
+    */
+    int getCurrentSelectedID() const
+    {
+        return MessageManager::existsAndIsCurrentThread() ? parameterBox.getSelectedId()
+                                                          : (int) snapshotValue.load (std::memory_order_relaxed);
+    }
 
 private:
     ComboBox parameterBox;
@@ -273,6 +354,30 @@ private:
 };
 
 //==============================================================================
+/** Runs a demo processor on an audio source.
+
+    The audio thread never waits for the UI, and never allocates. When a control
+    changes, the message thread takes a snapshot of every parameter's value, and
+    has the demo build whatever it derives from them, such as filter
+    coefficients or an impulse response, into the same snapshot. That's
+    published through a TripleBuffer. At the start of each block, the audio
+    thread picks up the newest snapshot, if there is one, and hands it to the
+    demo, which only swaps or copies things out of it.
+
+    For that, the DemoType provides:
+    @code
+    struct ParameterState { ... };                            // what it derives from its parameters
+    void buildParameterState (ParameterState&);               // on the message thread, and can allocate
+    void applyParameterState (ParameterState&) noexcept;      // on the audio thread, swapping or copying only
+    @endcode
+
+    Anything swapped out of the snapshot is left in it, to be destroyed on the
+    message thread when that copy is next rebuilt.
+
+    A DemoType without a ParameterState just has its updateParameters() called
+    on the audio thread when a snapshot arrives, as before, so it still works,
+    but may allocate there.
+*/
 template <class DemoType>
 struct DSPDemo final : public AudioSource,
                        public ProcessorWrapper<DemoType>,
@@ -281,8 +386,14 @@ struct DSPDemo final : public AudioSource,
     DSPDemo (AudioSource& input)
         : inputSource (&input)
     {
+        auto numParameters = getParameters().size();
+        snapshots.forEachBuffer ([numParameters] (Snapshot& s) { s.values.resize (numParameters); });
+
         for (auto* p : getParameters())
             p->addChangeListener (this);
+
+        // So the first block is processed with the controls' initial state
+        changeListenerCallback (nullptr);
     }
 
     void prepareToPlay (int blockSize, double sampleRate) override
@@ -309,7 +420,9 @@ struct DSPDemo final : public AudioSource,
         AudioBlock<float> block (*bufferToFill.buffer,
                                  (size_t) bufferToFill.startSample);
 
-        ScopedLock audioLock (audioCallbackLock);
+        if (snapshots.update())
+            applySnapshot (snapshots.getReadBuffer());
+
         this->process (ProcessContextReplacing<float> (block));
     }
 
@@ -320,13 +433,58 @@ struct DSPDemo final : public AudioSource,
 
     void changeListenerCallback (ChangeBroadcaster*) override
     {
-        ScopedLock audioLock (audioCallbackLock);
-        static_cast<DemoType&> (this->processor).updateParameters();
-    }
+        auto& snapshot = snapshots.getWriteBuffer();
+        auto& parameters = getParameters();
 
-    CriticalSection audioCallbackLock;
+        // Same size as when the buffers were set up, so this never allocates
+        for (size_t i = 0; i < parameters.size(); ++i)
+            snapshot.values[i] = parameters[i]->getValueFromComponent();
+
+        if constexpr (hasParameterState)
+            static_cast<DemoType&> (this->processor).buildParameterState (snapshot.state);
+
+        snapshots.publish();
+    }
 
     AudioSource* inputSource;
+
+private:
+    template <typename Type, typename = void>
+    struct ParameterStateOf
+    {
+        struct State {};
+        static constexpr bool exists = false;
+    };
+
+    template <typename Type>
+    struct ParameterStateOf<Type, std::void_t<typename Type::ParameterState>>
+    {
+        using State = typename Type::ParameterState;
+        static constexpr bool exists = true;
+    };
+
+    static constexpr bool hasParameterState = ParameterStateOf<DemoType>::exists;
+
+    struct Snapshot
+    {
+        std::vector<double> values;
+        typename ParameterStateOf<DemoType>::State state;
+    };
+
+    void applySnapshot (Snapshot& snapshot)
+    {
+        auto& parameters = getParameters();
+
+        for (size_t i = 0; i < jmin (parameters.size(), snapshot.values.size()); ++i)
+            parameters[i]->setSnapshotValue (snapshot.values[i]);
+
+        if constexpr (hasParameterState)
+            static_cast<DemoType&> (this->processor).applyParameterState (snapshot.state);
+        else
+            static_cast<DemoType&> (this->processor).updateParameters();
+    }
+
+    TripleBuffer<Snapshot> snapshots;
 };
 
 //==============================================================================
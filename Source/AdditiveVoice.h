@@ -0,0 +1,328 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "SmoothedParameter.h"
+#include <juce_dsp/juce_dsp.h>
+
+//==============================================================================
+/** The sound for the AdditiveVoice: a set of partials, each with a frequency
+    ratio to the note, an amplitude, a decay rate and a starting phase.
+
+    The organ is harmonic, with the octaves and fifths pulled out as a drawbar
+    organ's would be. The bell starts with a church bell's hum, prime, tierce,
+    quint and nominal and carries on with a stretched, slightly uneven series
+    whose higher partials die away sooner. Either is held as a drone for as
+    long as the key is.
+*/
+struct AdditiveSound final : public SynthesiserSound
+{
+    enum class Preset { organ, bell };
+
+    static constexpr int maxPartials = 1024;
+
+    struct Partial
+    {
+        float ratio = 1.0f, amplitude = 0.0f;
+        float decayPerSecond = 0.0f;   // the rate of its exponential decay
+        float phase = 0.0f;
+    };
+
+    AdditiveSound(Preset presetToUse, int numPartials)
+        : preset(presetToUse)
+    {
+        jassert(isPositiveAndNotGreaterThan(numPartials, maxPartials));
+        numPartials = jlimit(1, maxPartials, numPartials);
+
+        Random random(1);   // the same sound every time
+        partials.resize((size_t)numPartials);
+
+        // A bell's lowest partials, relative to its nominal's octave below
+        static constexpr float bellModes[] = { 0.5f, 1.0f, 1.183f, 1.506f, 2.0f, 2.514f,
+                                               2.662f, 3.011f, 4.166f, 5.433f, 6.796f, 8.215f };
+        constexpr int numBellModes = (int)std::size(bellModes);
+
+        for (int i = 0; i < numPartials; ++i)
+        {
+            auto& partial = partials[(size_t)i];
+            auto harmonic = (float)(i + 1);
+
+            if (preset == Preset::organ)
+            {
+                partial.ratio = harmonic;
+                partial.amplitude = std::pow(harmonic, -0.8f) * (isPowerOfTwo(i + 1) ? 2.0f : ((i + 1) % 3 == 0 ? 1.4f : 1.0f));
+            }
+            else
+            {
+                partial.ratio = i < numBellModes ? bellModes[i]
+                                                 : bellModes[numBellModes - 1] * std::pow(harmonic / (float)numBellModes, 1.4f)
+                                                     * (1.0f + 0.01f * (random.nextFloat() - 0.5f));
+                partial.amplitude = 1.0f / partial.ratio;
+                partial.decayPerSecond = 0.05f * partial.ratio;
+            }
+
+            partial.phase = random.nextFloat() * MathConstants<float>::twoPi;
+        }
+
+        // The uneven part of the bell's series can't be allowed to go back on itself
+        std::sort(partials.begin(), partials.end(), [](auto& a, auto& b) { return a.ratio < b.ratio; });
+
+        // Sized for the same loudness whatever the number of partials
+        auto sumOfSquares = 0.0f;
+
+        for (auto& partial : partials)
+            sumOfSquares += partial.amplitude * partial.amplitude;
+
+        for (auto& partial : partials)
+            partial.amplitude /= std::sqrt(sumOfSquares);
+
+        envelope = preset == Preset::organ ? ADSR::Parameters { 0.02f, 0.0f, 1.0f, 0.3f }
+                                           : ADSR::Parameters { 0.005f, 0.0f, 1.0f, 2.0f };
+    }
+
+    bool appliesToNote(int /*midiNoteNumber*/) override    { return true; }
+    bool appliesToChannel(int /*midiChannel*/) override    { return true; }
+
+    static StringArray getPresetNames()    { return { "Organ", "Bell" }; }
+
+    const Preset preset;
+    std::vector<Partial> partials;   // in order of frequency
+    ADSR::Parameters envelope;
+};
+
+//==============================================================================
+/** A voice that plays hundreds of partials by building each frame's spectrum and
+    inverse transforming it, rather than running an oscillator per partial.
+
+    Every hop (a quarter of a frame), each partial adds the spectrum of a Hann-
+    windowed sinusoid at its frequency, amplitude and phase to the frame: the
+    window's transform, read from a table, over the few bins either side of it.
+    One inverse FFT turns the frame into time, where it's overlap-added to the
+    ones before. So a partial costs a handful of bins per hop instead of a
+    sample's work for every sample, and most of a voice's cost is the FFT,
+    which is the same whatever the number of partials.
+
+    Only the main lobe and the first few sidelobes of the window are added,
+    which keeps the error to around 60 dB below the signal. Pitch bend and the
+    mod wheel's vibrato are followed once per hop, which is fine for the slow
+    drones this is for.
+*/
+class AdditiveVoice final : public SynthesiserVoice
+{
+public:
+    static constexpr int fftOrder = 11;
+    static constexpr int frameSize = 1 << fftOrder;
+    static constexpr int hopSize = frameSize / 4;
+
+    AdditiveVoice()
+        : fft(fftOrder)
+    {
+        spectrum.resize((size_t)(2 * frameSize));
+        overlap.resize((size_t)frameSize);
+        partials.resize((size_t)AdditiveSound::maxPartials);
+        chunkBuffer.setSize(1, VoiceControls::maxChunkSize);
+
+        // The transform of a Hann window centred on the frame's start, in bins
+        // either side of the peak, with one spare entry for the interpolation
+        kernel.resize((size_t)(2 * kernelHalfWidth * kernelResolution + 2));
+
+        auto sinc = [](double x) { return x == 0.0 ? 1.0 : std::sin(MathConstants<double>::pi * x) / (MathConstants<double>::pi * x); };
+
+        for (size_t i = 0; i < kernel.size(); ++i)
+        {
+            auto offset = (double)i / kernelResolution - kernelHalfWidth;
+            kernel[i] = (float)(0.5 * sinc(offset) + 0.25 * (sinc(offset - 1.0) + sinc(offset + 1.0)));
+        }
+    }
+
+    bool canPlaySound(SynthesiserSound* sound) override
+    {
+        return dynamic_cast<AdditiveSound*>(sound) != nullptr;
+    }
+
+    void startNote(int midiNoteNumber, float velocity, SynthesiserSound* sound, int currentPitchWheelPosition) override
+    {
+        auto* additiveSound = dynamic_cast<AdditiveSound*>(sound);
+
+        if (additiveSound == nullptr)
+            return;
+
+        // A copy, as the phases and amplitudes move on from here
+        numPartials = (int)additiveSound->partials.size();
+        auto secondsPerHop = (float)(hopSize / getSampleRate());
+
+        for (int i = 0; i < numPartials; ++i)
+        {
+            auto& source = additiveSound->partials[(size_t)i];
+            partials[(size_t)i] = { source.ratio, source.amplitude, std::exp(-source.decayPerSecond * secondsPerHop), source.phase };
+        }
+
+        fundamentalBin = (float)(MidiMessage::getMidiNoteInHertz(midiNoteNumber) * frameSize / getSampleRate());
+        level = velocity * 0.15f;
+
+        std::fill(overlap.begin(), overlap.end(), 0.0f);
+        readPosition = hopSize;
+
+        adsr.setSampleRate(getSampleRate());
+        adsr.setParameters(additiveSound->envelope);
+        adsr.noteOn();
+
+        controls.prepare(getSampleRate());
+        controls.startNote(currentPitchWheelPosition);
+    }
+
+    void stopNote(float /*velocity*/, bool allowTailOff) override
+    {
+        if (allowTailOff)
+        {
+            adsr.noteOff();
+        }
+        else
+        {
+            adsr.reset();
+            clearCurrentNote();
+        }
+    }
+
+    void pitchWheelMoved(int newValue) override                              { controls.pitchWheelMoved(newValue); }
+    void controllerMoved(int controllerNumber, int newValue) override        { controls.controllerMoved(controllerNumber, newValue); }
+
+    void renderNextBlock(AudioBuffer<float>& outputBuffer, int startSample, int numSamples) override
+    {
+        // In chunks, so the controls can hand over their smoothed values in fixed-size arrays
+        while (numSamples > 0 && isVoiceActive())
+        {
+            auto chunk = jmin(numSamples, VoiceControls::maxChunkSize);
+            auto* pitch = controls.getNextPitchMultipliers(chunk);
+            auto* gains = controls.getNextGains(chunk);
+
+            renderChunk(outputBuffer, startSample, chunk, pitch, gains);
+            startSample += chunk;
+            numSamples -= chunk;
+        }
+    }
+
+    using SynthesiserVoice::renderNextBlock;
+
+private:
+    //==============================================================================
+    static constexpr int kernelHalfWidth = 6;       // bins either side of a partial
+    static constexpr int kernelResolution = 64;     // table entries per bin
+
+    struct PartialState
+    {
+        float ratio, amplitude, decayPerHop, phase;
+    };
+
+    void renderChunk(AudioBuffer<float>& outputBuffer, int startSample, int numSamples,
+                     const float* pitch, const float* gains)
+    {
+        auto* mono = chunkBuffer.getWritePointer(0);
+
+        for (int done = 0; done < numSamples;)
+        {
+            if (readPosition == hopSize)
+                synthesiseFrame(pitch[done]);
+
+            auto numToCopy = jmin(numSamples - done, hopSize - readPosition);
+            FloatVectorOperations::copy(mono + done, overlap.data() + readPosition, numToCopy);
+            readPosition += numToCopy;
+            done += numToCopy;
+        }
+
+        FloatVectorOperations::multiply(mono, gains, numSamples);
+        FloatVectorOperations::multiply(mono, level, numSamples);
+        adsr.applyEnvelopeToBuffer(chunkBuffer, 0, numSamples);
+
+        for (auto ch = outputBuffer.getNumChannels(); --ch >= 0;)
+            FloatVectorOperations::add(outputBuffer.getWritePointer(ch, startSample), mono, numSamples);
+
+        if (!adsr.isActive())
+            clearCurrentNote();
+    }
+
+    /** Moves the overlap along by a hop and adds the next frame to it. */
+    void synthesiseFrame(float pitchMultiplier) noexcept
+    {
+        std::copy(overlap.begin() + hopSize, overlap.end(), overlap.begin());
+        std::fill(overlap.end() - hopSize, overlap.end(), 0.0f);
+        std::fill(spectrum.begin(), spectrum.end(), 0.0f);
+
+        // The frame's window is full height at its centre, where the phases are
+        // taken, and the windows of four overlapping frames add up to 2, so each
+        // partial's half of its amplitude at positive frequencies is halved again
+        auto scale = (float)frameSize * 0.25f;
+        auto highestBin = (float)(frameSize / 2 - kernelHalfWidth);
+        auto binStep = fundamentalBin * pitchMultiplier;
+
+        // Over a hop, a partial at bin b goes round b * hopSize / frameSize times
+        constexpr auto radiansPerBin = MathConstants<float>::twoPi * (float)hopSize / (float)frameSize;
+
+        for (int i = 0; i < numPartials; ++i)
+        {
+            auto& partial = partials[(size_t)i];
+            auto bin = binStep * partial.ratio;
+
+            if (bin < highestBin)
+                addPartial(bin, partial.amplitude * scale, partial.phase);
+
+            partial.phase += radiansPerBin * bin;
+            partial.phase -= MathConstants<float>::twoPi * std::floor(partial.phase / MathConstants<float>::twoPi);
+            partial.amplitude *= partial.decayPerHop;
+        }
+
+        fft.performRealOnlyInverseTransform(spectrum.data());
+        FloatVectorOperations::add(overlap.data(), spectrum.data(), frameSize);
+        readPosition = 0;
+    }
+
+    /** Adds the window's transform, at the given bin and phase, to the spectrum.
+        Alternate bins are negated, which moves the window's centre from the start
+        of the frame to the middle. Anything that would land below 0 Hz is folded
+        back, conjugated, as it would be from the partial's negative frequency.
+    */
+    void addPartial(float bin, float amplitude, float phase) noexcept
+    {
+        auto re = amplitude * std::cos(phase), im = amplitude * std::sin(phase);
+        auto* bins = spectrum.data();
+
+        for (auto k = (int)std::ceil(bin - kernelHalfWidth); k <= (int)(bin + kernelHalfWidth); ++k)
+        {
+            auto w = kernelAt((float)k - bin) * ((k & 1) != 0 ? -1.0f : 1.0f);
+
+            if (k > 0)
+            {
+                bins[2 * k]     += re * w;
+                bins[2 * k + 1] += im * w;
+            }
+            else if (k < 0)
+            {
+                bins[-2 * k]     += re * w;
+                bins[-2 * k + 1] -= im * w;
+            }
+            else
+            {
+                bins[0] += 2.0f * re * w;
+            }
+        }
+    }
+
+    float kernelAt(float offset) const noexcept
+    {
+        auto position = jmax(0.0f, (offset + (float)kernelHalfWidth) * (float)kernelResolution);
+        auto index = (size_t)position;
+        auto fraction = position - (float)index;
+
+        return kernel[index] + fraction * (kernel[index + 1] - kernel[index]);
+    }
+
+    dsp::FFT fft;
+    std::vector<float> spectrum, overlap, kernel;
+    std::vector<PartialState> partials;
+    int numPartials = 0, readPosition = hopSize;
+    float fundamentalBin = 0.0f, level = 0.0f;
+    AudioBuffer<float> chunkBuffer;
+    ADSR adsr;
+    VoiceControls controls;
+
+    JUCE_LEAK_DETECTOR(AdditiveVoice)
+};
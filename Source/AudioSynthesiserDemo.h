@@ -2,6 +2,18 @@
 
 #include "DemoUtilities.h"
 #include "AudioLiveScrollingDisplay.h"
+#include "SampledInstrument.h"
+#include "SynthEngine.h"
+#include "FixedBlockAdapter.h"
+#include "MidiInputRouter.h"
+#include "MidiFilePlayer.h"
+#include "MidiSessionLog.h"
+#include "ConvolutionReverb.h"
+#include "FdnReverb.h"
+#include "PolyBlepVoice.h"
+#include "WavetableVoice.h"
+#include "AdditiveVoice.h"
+#include "FmVoice.h"
 #include <juce_dsp/juce_dsp.h>  // Include the DSP module
 
 //==============================================================================
@@ -24,6 +36,43 @@ public:
         setMouseCursor(MouseCursor::CrosshairCursor);
     }
 
+    /** The number of samples measureAliasing() looks at. */
+    static constexpr int getAnalysisSize() noexcept    { return fftSize; }
+
+    /** Analyses getAnalysisSize() samples of a steady periodic tone the same way
+        the display does, and returns how far everything that isn't one of its
+        harmonics sits below the harmonics, in dB. For a synthesised waveform
+        that's the aliasing (plus whatever leaks through the window).
+    */
+    static float measureAliasing(const float* signal, double sampleRate, double fundamentalHz)
+    {
+        juce::dsp::FFT fft(fftOrder);
+        juce::dsp::WindowingFunction<float> hann(fftSize, juce::dsp::WindowingFunction<float>::hann);
+
+        std::vector<float> data((size_t)fftSize * 2, 0.0f);
+        std::copy(signal, signal + fftSize, data.begin());
+        hann.multiplyWithWindowingTable(data.data(), fftSize);
+        fft.performFrequencyOnlyForwardTransform(data.data());
+
+        auto binHz = sampleRate / fftSize;
+        auto harmonicPower = 0.0, otherPower = 0.0;
+
+        for (int bin = 1; bin < fftSize / 2; ++bin)
+        {
+            // A Hann window spreads each harmonic over a few bins either side
+            auto harmonic = bin * binHz / fundamentalHz;
+            auto binsFromHarmonic = std::abs(harmonic - std::round(harmonic)) * fundamentalHz / binHz;
+            auto power = (double)data[(size_t)bin] * (double)data[(size_t)bin];
+
+            if (binsFromHarmonic <= 4.0)
+                harmonicPower += power;
+            else
+                otherPower += power;
+        }
+
+        return (float)(10.0 * std::log10(jmax(otherPower, 1.0e-30) / jmax(harmonicPower, 1.0e-30)));
+    }
+
     void pushNextSample(float sample) noexcept
     {
         if (fifoIndex == fftSize)
@@ -367,7 +416,9 @@ struct SineWaveSound final : public SynthesiserSound
 };
 
 //==============================================================================
-/** Our demo synth voice just plays a sine wave.. */
+/** Our demo synth voice just plays a sine wave, following pitch bend, the mod
+    wheel and channel volume through a VoiceControls.
+*/
 struct SineWaveVoice final : public SynthesiserVoice
 {
     bool canPlaySound(SynthesiserSound* sound) override
@@ -376,7 +427,7 @@ struct SineWaveVoice final : public SynthesiserVoice
     }
 
     void startNote(int midiNoteNumber, float velocity,
-                    SynthesiserSound*, int /*currentPitchWheelPosition*/) override
+                    SynthesiserSound*, int currentPitchWheelPosition) override
     {
         currentAngle = 0.0;
         level = velocity * 0.15;
@@ -386,6 +437,9 @@ struct SineWaveVoice final : public SynthesiserVoice
         auto cyclesPerSample = cyclesPerSecond / getSampleRate();
 
         angleDelta = cyclesPerSample * MathConstants<double>::twoPi;
+
+        controls.prepare(getSampleRate());
+        controls.startNote(currentPitchWheelPosition);
     }
 
     void stopNote(float /*velocity*/, bool allowTailOff) override
@@ -402,135 +456,560 @@ struct SineWaveVoice final : public SynthesiserVoice
         }
     }
 
-    void pitchWheelMoved(int /*newValue*/) override                              {}
-    void controllerMoved(int /*controllerNumber*/, int /*newValue*/) override    {}
+    void pitchWheelMoved(int newValue) override                              { controls.pitchWheelMoved(newValue); }
+    void controllerMoved(int controllerNumber, int newValue) override        { controls.controllerMoved(controllerNumber, newValue); }
 
     void renderNextBlock(AudioBuffer<float>& outputBuffer, int startSample, int numSamples) override
     {
-        if (!approximatelyEqual(angleDelta, 0.0))
+        // In chunks, so the controls can hand over their smoothed values in fixed-size arrays
+        while (numSamples > 0 && !approximatelyEqual(angleDelta, 0.0))
+        {
+            auto chunk = jmin(numSamples, VoiceControls::maxChunkSize);
+            auto* pitch = controls.getNextPitchMultipliers(chunk);
+            auto* gains = controls.getNextGains(chunk);
+
+            renderChunk(outputBuffer, startSample, chunk, pitch, gains);
+            startSample += chunk;
+            numSamples -= chunk;
+        }
+    }
+
+    using SynthesiserVoice::renderNextBlock;
+
+private:
+    void renderChunk(AudioBuffer<float>& outputBuffer, int startSample, int numSamples,
+                     const float* pitch, const float* gains)
+    {
+        if (tailOff > 0.0)
         {
-            if (tailOff > 0.0)
+            for (int i = 0; i < numSamples; ++i)
             {
-                while (--numSamples >= 0)
-                {
-                    auto currentSample = (float)(std::sin(currentAngle) * level * tailOff);
+                auto currentSample = (float)(std::sin(currentAngle) * level * tailOff) * gains[i];
 
-                    for (auto i = outputBuffer.getNumChannels(); --i >= 0;)
-                        outputBuffer.addSample(i, startSample, currentSample);
+                for (auto ch = outputBuffer.getNumChannels(); --ch >= 0;)
+                    outputBuffer.addSample(ch, startSample + i, currentSample);
 
-                    currentAngle += angleDelta;
-                    ++startSample;
+                currentAngle += angleDelta * pitch[i];
 
-                    tailOff *= 0.99;
+                tailOff *= 0.99;
 
-                    if (tailOff <= 0.005)
-                    {
-                        clearCurrentNote();
-                        angleDelta = 0.0;
-                        break;
-                    }
+                if (tailOff <= 0.005)
+                {
+                    clearCurrentNote();
+                    angleDelta = 0.0;
+                    break;
                 }
             }
-            else
+        }
+        else
+        {
+            for (int i = 0; i < numSamples; ++i)
             {
-                while (--numSamples >= 0)
-                {
-                    auto currentSample = (float)(std::sin(currentAngle) * level);
+                auto currentSample = (float)(std::sin(currentAngle) * level) * gains[i];
 
-                    for (auto i = outputBuffer.getNumChannels(); --i >= 0;)
-                        outputBuffer.addSample(i, startSample, currentSample);
+                for (auto ch = outputBuffer.getNumChannels(); --ch >= 0;)
+                    outputBuffer.addSample(ch, startSample + i, currentSample);
 
-                    currentAngle += angleDelta;
-                    ++startSample;
-                }
+                currentAngle += angleDelta * pitch[i];
             }
         }
     }
 
-    using SynthesiserVoice::renderNextBlock;
-
-private:
     double currentAngle = 0.0, angleDelta = 0.0, level = 0.0, tailOff = 0.0;
+    VoiceControls controls;
 };
 
 //==============================================================================
 // This is an audio source that streams the output of our demo synth.
 struct SynthAudioSource final : public AudioSource
 {
+    /** With surround panning on, the synth pans its voices around this many outputs at most. */
+    static constexpr int maxOutputChannels = VoicePanner::maxChannels;
+
     SynthAudioSource(MidiKeyboardState& keyState, FFTAnalyzer& fftAnalyzerIn)
         : keyboardState(keyState), fftAnalyzer(fftAnalyzerIn)
     {
-        for (auto i = 0; i < 4; ++i)
+        midiQueue.setLatencyMonitor(&latencyMonitor);
+        midiInputs.setLatencyMonitor(&latencyMonitor);
+        synth.setLatencyMonitor(&latencyMonitor);
+
+        // Enough for each part to have a voice or two of either kind to itself
+        for (auto i = 0; i < 16; ++i)
         {
             synth.addVoice(new SineWaveVoice());
-            synth.addVoice(new SamplerVoice());
+            synth.addVoice(new ZonedSamplerVoice());
+            synth.addVoice(new PolyBlepVoice());
+            synth.addVoice(new WavetableVoice());
+            synth.addVoice(new AdditiveVoice());
+            synth.addVoice(new FmVoice());
         }
 
         setUsingSineWaveSound();
     }
 
-    void setUsingSineWaveSound()
+    //==============================================================================
+    // The sound setters take a MIDI channel to give that channel's part a sound
+    // of its own, or 0 to change the sound shared by all the other parts.
+
+    void setUsingSineWaveSound(int midiChannel = 0)
     {
-        synth.clearSounds();
-        synth.addSound(new SineWaveSound());
+        setSound(midiChannel, new SineWaveSound(), "sine");
     }
 
-    void setUsingSampledSound()
+    /** A band-limited oscillator, run at 1, 2 or 4 times the sample rate (see PolyBlepVoice). */
+    void setUsingPolyBlepSound(PolyBlepOscillator::Waveform waveform, int oversamplingFactor, int midiChannel = 0)
     {
-        const void* data = BinaryData::sample_wav;
-        int dataSize = BinaryData::sample_wavSize;
-        
-        // Create a new MemoryInputStream each time
-        auto* stream = new juce::MemoryInputStream(data, static_cast<size_t>(dataSize), false);
-        juce::WavAudioFormat wavFormat;
-        std::unique_ptr<juce::AudioFormatReader> audioReader(wavFormat.createReaderFor(stream, true));
-        
-        BigInteger allNotes;
-        allNotes.setRange(0, 128, true);
+        setSound(midiChannel, new PolyBlepSound(waveform, oversamplingFactor),
+                 "polyblep:" + String((int)waveform) + ":" + String(oversamplingFactor));
+    }
+
+    /** One of the FmSound presets, played by the four-operator FmVoice. */
+    void setUsingFmSound(int preset, int midiChannel = 0)
+    {
+        setSound(midiChannel, new FmSound(FmSound::getPreset(preset)), "fm:" + String(preset));
+    }
+
+    /** A drone of up to AdditiveSound::maxPartials partials, synthesised by inverse FFT (see AdditiveVoice). */
+    void setUsingAdditiveSound(AdditiveSound::Preset preset, int numPartials, int midiChannel = 0)
+    {
+        setSound(midiChannel, new AdditiveSound(preset, numPartials),
+                 "additive:" + String((int)preset) + ":" + String(numPartials));
+    }
+
+    /** A wavetable made from cycles of the built-in sample, from its attack through to its tail. */
+    bool setUsingWavetableSound(int midiChannel = 0)
+    {
+        auto table = wavetables.getOrCreate("BinaryData::sample_wav", [this]
+        {
+            auto sample = sampleCache.getEntry("BinaryData::sample_wav",
+                                               BinaryData::sample_wav,
+                                               (size_t)BinaryData::sample_wavSize);
+
+            // Held like a voice would, so the cache can't free it while the cycles are copied out
+            if (!sampleCache.decode(*sample) || !sampleCache.acquire(*sample))
+                return Wavetable::Ptr();
+
+            auto table = Wavetable::extractFromRecording("sample", sample->data.getReadPointer(0), sample->length,
+                                                         sample->sourceSampleRate,
+                                                         MidiMessage::getMidiNoteInHertz(74),   // the sample's root note
+                                                         32);
+            sampleCache.release(*sample);
+            return table;
+        });
+
+        if (table == nullptr)
+            return false;
+
+        setSound(midiChannel, new WavetableSound(table), "wavetable:sample");
+        return true;
+    }
+
+    /** Loads a file of single cycles, 2048 samples each (see Wavetable::createFromCycles()). */
+    bool loadWavetable(const File& file, int midiChannel = 0)
+    {
+        auto table = wavetables.getOrCreate(file.getFullPathName(), [&file]
+        {
+            AudioFormatManager formatManager;
+            formatManager.registerBasicFormats();
+            return Wavetable::loadFromFile(file, formatManager);
+        });
+
+        if (table == nullptr)
+            return false;
+
+        setSound(midiChannel, new WavetableSound(table), "wavetable:" + file.getFullPathName());
+        return true;
+    }
+
+    void setUsingSampledSound(int midiChannel = 0)
+    {
+        if (builtInSampleSound == nullptr)
+        {
+            auto sample = sampleCache.getEntry("BinaryData::sample_wav",
+                                               BinaryData::sample_wav,
+                                               (size_t)BinaryData::sample_wavSize);
+
+            builtInSampleSound = ZonedSamplerSound::createSingleZone("demo sound", sample,
+                                                                     74, // root midi note
+                                                                     zoneLoader);
+            builtInSampleSound->envelope = { 0.1f, 0.0f, 1.0f, 0.1f };
+        }
+
+        // This is a cache hit unless the sample was evicted while another sound was in use
+        sampleCache.decode(*builtInSampleSound->getZone(0)->sample);
+
+        setSound(midiChannel, builtInSampleSound, "sampled");
+    }
+
+    /** Parses an instrument definition and switches to it. The zones themselves
+        are decoded lazily by the zone loader, so this returns almost immediately.
+    */
+    bool loadInstrument(const File& definitionFile, int midiChannel = 0)
+    {
+        // If the folder has been indexed, the zones can take their root notes from it
+        SampleLibraryIndex index;
+        index.loadFrom(SampleLibraryIndex::getIndexFileFor(definitionFile.getParentDirectory()));
 
-        synth.clearSounds();
-        synth.addSound(new SamplerSound("demo sound",
-                                       *audioReader,
-                                       allNotes,
-                                       74,   // root midi note
-                                       0.1,  // attack time
-                                       0.1,  // release time
-                                       10.0  // maximum sample length
-                                       ));
+        auto sound = ZonedSamplerSound::createFromDefinition(definitionFile, zoneLoader, &index);
+
+        if (sound == nullptr)
+            return false;
+
+        instrumentSound = sound;
+        instrumentDescription = "instrument:" + definitionFile.getFullPathName();
+        setUsingInstrument(midiChannel);
+        return true;
     }
 
-    void prepareToPlay(int /*samplesPerBlockExpected*/, double sampleRate) override
+    /** Maps a whole indexed sample folder across the keyboard and switches to it. */
+    bool loadSampleLibrary(const SampleLibraryIndex& index, const File& directory, int midiChannel = 0)
+    {
+        auto sound = ZonedSamplerSound::createFromLibrary(directory.getFileName(), index, zoneLoader);
+
+        if (sound == nullptr)
+            return false;
+
+        instrumentSound = sound;
+        instrumentDescription = "library:" + directory.getFullPathName();
+        setUsingInstrument(midiChannel);
+        return true;
+    }
+
+    bool hasInstrument() const noexcept    { return instrumentSound != nullptr; }
+
+    /** Uses the most recently loaded instrument. */
+    void setUsingInstrument(int midiChannel = 0)
     {
-        midiCollector.reset(sampleRate);
-        synth.setCurrentPlaybackSampleRate(sampleRate);
+        if (instrumentSound != nullptr)
+            setSound(midiChannel, instrumentSound, instrumentDescription);
+    }
+
+    /** Sends a channel back to the shared sound. */
+    void setUsingSharedSound(int midiChannel)
+    {
+        if (isPositiveAndBelow(midiChannel - 1, SynthEngine::numParts))
+            setSound(midiChannel, nullptr, "shared");
+    }
+
+    /** Reserves voices for a channel's part (see SynthEngine::setPartVoiceReservation()). */
+    void setPartVoiceReservation(int midiChannel, int numVoices)
+    {
+        synth.setPartVoiceReservation(midiChannel, numVoices);
+        sessionRecorder.soundChanged("reserve:" + String(midiChannel) + ":" + String(numVoices));
+    }
+
+    /** Spreads notes across the stereo field by pitch (see SynthEngine::setStereoSpread()). */
+    void setStereoSpread(float spread)
+    {
+        synth.setStereoSpread(spread);
+        sessionRecorder.settingMoved("spread:" + String(spread));
+    }
+
+    /** Pans voices around a ring of speakers rather than across a stereo pair
+        (see SynthEngine::setSurroundPanning()).
+    */
+    void setSurroundPanning(bool shouldPanAroundRing)
+    {
+        synth.setSurroundPanning(shouldPanAroundRing);
+        sessionRecorder.soundChanged("surround:" + String(shouldPanAroundRing ? 1 : 0));
+    }
+
+    /** How many outputs the device should open for the current settings: two,
+        unless there are stems to send out or a ring of speakers to pan around.
+        That's never more than maxOutputChannels, which is too few for a stem
+        per MIDI channel.
+    */
+    int getNumOutputChannelsWanted() const noexcept
+    {
+        if (synth.getStemLayout() != SynthEngine::StemLayout::none)
+            return jmin(maxOutputChannels, 2 + synth.getNumStems() * SynthEngine::maxStemChannels);
+
+        return synth.isSurroundPanning() ? maxOutputChannels : 2;
+    }
+
+    /** How many of the stems get outputs of their own, given this many outputs.
+        The rest are only heard in the mix.
+    */
+    int getNumStemsOnOutputs(int numOutputChannels) const noexcept
+    {
+        return jlimit(0, synth.getNumStems(), (numOutputChannels - 2) / SynthEngine::maxStemChannels);
+    }
+
+    /** Sets up the filter on every voice (see VoiceFilter). */
+    void setVoiceFilter(VoiceFilter::Mode mode, float cutoffHz, float resonance)
+    {
+        auto& filter = synth.getVoiceFilter();
+        filter.setMode(mode);
+        filter.setCutoff(cutoffHz);
+        filter.setResonance(resonance);
+        sessionRecorder.settingMoved(getVoiceFilterDescription());
+    }
+
+    /** Splits the synth into stems (see SynthEngine::setStemLayout()). While it's
+        split, the mix goes to the first two outputs and each stem to the next
+        pair, for as many outputs as the device has: see getNumStemsOnOutputs().
+    */
+    void setStemLayout(SynthEngine::StemLayout layout)
+    {
+        synth.setStemLayout(layout);
+        sessionRecorder.soundChanged("stems:" + String((int)layout));
+    }
+
+    /** The impulse responses, then the algorithmic reverb, for setups where convolution is too heavy. */
+    static StringArray getReverbNames()
+    {
+        auto names = ConvolutionReverb::getImpulseResponseNames();
+        names.add("Algorithmic");
+        return names;
+    }
+
+    /** Switches to one of getReverbNames(), or off with 0. */
+    bool setReverb(int reverbNameIndex)
+    {
+        auto useAlgorithmic = reverbNameIndex == ConvolutionReverb::getImpulseResponseNames().size();
+
+        if (!reverb.loadImpulseResponse(useAlgorithmic ? 0 : reverbNameIndex))
+            return false;
+
+        algorithmicReverb.setEnabled(useAlgorithmic);
+        reverbIndex = reverbNameIndex;
+        sessionRecorder.soundChanged("reverb:" + String(reverbNameIndex));
+        return true;
+    }
+
+    void setReverbLevel(float wetLevel)
+    {
+        reverb.setWetLevel(wetLevel);
+        algorithmicReverb.setWetLevel(wetLevel);
+        sessionRecorder.settingMoved("reverblevel:" + String(wetLevel));
+    }
+
+    /** Decodes every zone of the loaded instrument on the calling thread, rather
+        than waiting for the zone loader. Replays use this so that no note falls
+        back to a neighbouring zone just because its own hadn't loaded yet.
+    */
+    bool loadAllInstrumentZones()
+    {
+        if (instrumentSound == nullptr)
+            return false;
+
+        auto allLoaded = true;
+
+        for (int i = 0; i < instrumentSound->getNumZones(); ++i)
+            allLoaded = sampleCache.decode(*instrumentSound->getZone(i)->sample) && allLoaded;
+
+        return allLoaded;
+    }
+
+    /** Identifies the sound a channel is using (0 for the shared one), e.g. "sine",
+        "instrument:<path>", or "shared" for a part without a sound of its own.
+    */
+    String getSoundDescription(int midiChannel = 0) const
+    {
+        if (!isPositiveAndBelow(midiChannel, (int)soundDescriptions.size()))
+            return {};
+
+        return soundDescriptions[(size_t)midiChannel].isEmpty() ? String("shared") : soundDescriptions[(size_t)midiChannel];
+    }
+
+    //==============================================================================
+    /** Starts logging all the MIDI the synth plays, for SessionReplay. */
+    bool startRecordingSession(const File& file)
+    {
+        StringArray sounds { getSoundDescription(), "spread:" + String(synth.getStereoSpread()),
+                             "stems:" + String((int)synth.getStemLayout()), getVoiceFilterDescription(),
+                             "reverb:" + String(reverbIndex), "reverblevel:" + String(reverb.getWetLevel()),
+                             "surround:" + String(synth.isSurroundPanning() ? 1 : 0) };
+
+        for (int channel = 1; channel <= SynthEngine::numParts; ++channel)
+        {
+            if (soundDescriptions[(size_t)channel].isNotEmpty())
+                sounds.add("part:" + String(channel) + ":" + soundDescriptions[(size_t)channel]);
+
+            if (auto reserved = synth.getPartVoiceReservation(channel); reserved > 0)
+                sounds.add("reserve:" + String(channel) + ":" + String(reserved));
+        }
+
+        return sessionRecorder.start(file, currentSampleRate, sounds);
+    }
+
+    void stopRecordingSession()                 { sessionRecorder.stop(); }
+    bool isRecordingSession() const noexcept    { return sessionRecorder.isRecording(); }
+
+    void prepareToPlay(int samplesPerBlockExpected, double sampleRate) override
+    {
+        currentSampleRate = sampleRate;
+        midiQueue.prepare(sampleRate);
+        midiInputs.prepare(sampleRate);
+        midiFilePlayer.prepare(sampleRate);
+        incomingMidi.ensureSize(4096);
+
+        // The synth always runs in fixed quanta, whatever the device block size is
+        synth.prepare(sampleRate, SynthEngine::processingQuantum);
+        blockAdapter.prepare(maxOutputChannels, jmax(samplesPerBlockExpected, 4096), SynthEngine::processingQuantum);
+        reverb.prepare(sampleRate);
+        algorithmicReverb.prepare(sampleRate);
+        reverbSend.setSize(2, SynthEngine::processingQuantum);
+        reverbDry.setSize(2, SynthEngine::processingQuantum);
+        latencyMonitor.prepare(sampleRate, blockAdapter.getLatencyInSamples());
     }
 
     void releaseResources() override {}
 
+    /** The latency the synth adds on top of the device's own. */
+    int getLatencyInSamples() const noexcept    { return blockAdapter.getLatencyInSamples(); }
+
     void getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill) override
     {
-        bufferToFill.clearActiveBufferRegion();
-
-        MidiBuffer incomingMidi;
-        midiCollector.removeNextBlockOfMessages(incomingMidi, bufferToFill.numSamples);
+        auto callbackTime = Time::getMillisecondCounterHiRes() * 0.001;
+        latencyMonitor.beginDeviceBlock(callbackTime, bufferToFill.numSamples);
+        midiQueue.popBlock(incomingMidi, bufferToFill.numSamples, callbackTime);
+        midiInputs.popBlock(incomingMidi, bufferToFill.numSamples, callbackTime);
+        midiFilePlayer.renderNextBlock(incomingMidi, bufferToFill.numSamples);
 
         keyboardState.processNextMidiBuffer(incomingMidi, 0, bufferToFill.numSamples, true);
 
-        synth.renderNextBlock(*bufferToFill.buffer, incomingMidi, 0, bufferToFill.numSamples);
+        // Everything from here on is deterministic, given the MIDI
+        sessionRecorder.recordBlock(bufferToFill.numSamples, incomingMidi);
+        renderBlock(*bufferToFill.buffer, bufferToFill.startSample, bufferToFill.numSamples, incomingMidi);
+    }
+
+    /** Renders a block from MIDI that has already been gathered, which is how a
+        recorded session gets played back.
+    */
+    void renderBlock(AudioBuffer<float>& buffer, int startSample, int numSamples, const MidiBuffer& midi)
+    {
+        blockAdapter.process(buffer, startSample, numSamples, midi,
+                             [this](AudioBuffer<float>& quantum, const MidiBuffer& quantumMidi)
+                             {
+                                 latencyMonitor.beginQuantum(quantum.getNumSamples());
+
+                                 if (synth.getStemLayout() == SynthEngine::StemLayout::none)
+                                 {
+                                     synth.renderNextBlock(quantum, quantumMidi, 0, quantum.getNumSamples());
+                                     applyReverbs(quantum);
+                                 }
+                                 else
+                                 {
+                                     renderWithStems(quantum, quantumMidi);
+                                 }
+                             });
 
         // Feed audio to FFT analyzer (use first channel)
-        auto* channelData = bufferToFill.buffer->getReadPointer(0);
-        for (int i = 0; i < bufferToFill.numSamples; ++i)
+        auto* channelData = buffer.getReadPointer(0, startSample);
+        for (int i = 0; i < numSamples; ++i)
             fftAnalyzer.pushNextSample(channelData[i]);
     }
 
-    MidiMessageCollector midiCollector;
+    LatencyMonitor latencyMonitor;
+    MidiEventQueue midiQueue;     // for messages generated inside the app
+    MidiInputRouter midiInputs;   // for MIDI devices
+    MidiFilePlayer midiFilePlayer;
     MidiKeyboardState& keyboardState;
-    Synthesiser synth;
+    SampleCache sampleCache;
+    ZoneLoader zoneLoader { sampleCache };
+    WavetableCache wavetables;
+    SynthEngine synth;
+    ConvolutionReverb reverb;   // an insert on the synth's mix
+    FdnReverb algorithmicReverb;    // the same, switched on instead of an impulse response
     FFTAnalyzer& fftAnalyzer;
 
 private:
-    std::unique_ptr<juce::MemoryInputStream> inputStream;
+    static_assert(ConvolutionReverb::blockSize == SynthEngine::processingQuantum,
+                  "The reverb's first partition has to match the synth's processing quantum");
+
+    /** Runs the reverbs on the synth's output. A ring of speakers is folded down
+        to a stereo send, alternate speakers to each side, and the wet signal
+        is spread back around the ring the same way.
+    */
+    void applyReverbs(AudioBuffer<float>& quantum) noexcept
+    {
+        auto numChannels = quantum.getNumChannels();
+
+        if (numChannels <= 2 || !synth.isSurroundPanning())
+        {
+            reverb.process(quantum);
+            algorithmicReverb.process(quantum);
+            return;
+        }
+
+        auto numSamples = quantum.getNumSamples();
+        reverbSend.clear();
+
+        for (int ch = 0; ch < numChannels; ++ch)
+            reverbSend.addFrom(ch % 2, 0, quantum, ch, 0, numSamples);
+
+        reverbDry.makeCopyOf(reverbSend, true);
+        reverb.process(reverbSend);
+        algorithmicReverb.process(reverbSend);
+
+        // The reverbs add their wet signal to the send, so taking the send away leaves just that
+        for (int ch = 0; ch < 2; ++ch)
+            reverbSend.addFrom(ch, 0, reverbDry, ch, 0, numSamples, -1.0f);
+
+        // Each side of the send feeds half the speakers, which share its power
+        auto gain = 1.0f / std::sqrt((float)numChannels * 0.5f);
+
+        for (int ch = 0; ch < numChannels; ++ch)
+            quantum.addFrom(ch, 0, reverbSend, ch % 2, 0, numSamples, gain);
+    }
+
+    /** Renders the stereo mix into the first two channels, then copies the stems into the rest. */
+    void renderWithStems(AudioBuffer<float>& quantum, const MidiBuffer& quantumMidi)
+    {
+        auto numSamples = quantum.getNumSamples();
+        AudioBuffer<float> mix(quantum.getArrayOfWritePointers(), jmin(2, quantum.getNumChannels()), numSamples);
+        synth.renderNextBlock(mix, quantumMidi, 0, numSamples);
+        reverb.process(mix);
+        algorithmicReverb.process(mix);
+
+        for (int stem = 0; stem < synth.getNumStems(); ++stem)
+        {
+            for (int ch = 0; ch < SynthEngine::maxStemChannels; ++ch)
+            {
+                auto outputChannel = 2 + stem * SynthEngine::maxStemChannels + ch;
+
+                if (outputChannel >= quantum.getNumChannels())
+                    return;
+
+                if (auto* stemData = synth.getStemReadPointer(stem, ch))
+                    FloatVectorOperations::copy(quantum.getWritePointer(outputChannel), stemData, numSamples);
+            }
+        }
+    }
+
+    String getVoiceFilterDescription()
+    {
+        auto& filter = synth.getVoiceFilter();
+        return "filter:" + String((int)filter.getMode()) + ":" + String(filter.getCutoff()) + ":" + String(filter.getResonance());
+    }
+
+    void setSound(int midiChannel, SynthesiserSound::Ptr sound, const String& description)
+    {
+        if (midiChannel == 0)
+        {
+            synth.clearSounds();
+            synth.addSound(sound);
+            sessionRecorder.soundChanged(description);
+        }
+        else
+        {
+            synth.setPartSound(midiChannel, sound);
+            sessionRecorder.soundChanged("part:" + String(midiChannel) + ":" + description);
+        }
+
+        soundDescriptions[(size_t)midiChannel] = (midiChannel > 0 && sound == nullptr) ? String() : description;
+    }
+
+    ZonedSamplerSound::Ptr builtInSampleSound, instrumentSound;
+    std::array<String, SynthEngine::numParts + 1> soundDescriptions;   // [0] is the shared sound
+    String instrumentDescription;
+    int reverbIndex = 0;
+    FixedBlockAdapter blockAdapter;
+    AudioBuffer<float> reverbSend, reverbDry;   // for folding a speaker ring down to the reverbs
+    MidiBuffer incomingMidi;
+    MidiSessionRecorder sessionRecorder;
+    double currentSampleRate = 44100.0;
 };
 
 //==============================================================================
@@ -591,7 +1070,9 @@ private:
 };
 
 //==============================================================================
-class AudioSynthesiserDemo final : public Component
+class AudioSynthesiserDemo final : public Component,
+                                   private Timer,
+                                   private ListBoxModel
 {
 public:
     AudioSynthesiserDemo()
@@ -604,24 +1085,209 @@ public:
         addAndMakeVisible(sineButton);
         sineButton.setRadioGroupId(321);
         sineButton.setToggleState(true, dontSendNotification);
-        sineButton.onClick = [this] { synthAudioSource.setUsingSineWaveSound(); };
+        sineButton.onClick = [this] { synthAudioSource.setUsingSineWaveSound(getSelectedChannel()); updatePartControls(); };
+
+        // Each waveform at each oversampling factor, so the ids run waveform * 3 + factor index + 1
+        addAndMakeVisible(oscillatorSelector);
+        oscillatorSelector.setTextWhenNothingSelected("Oscillator");
+
+        for (auto& name : PolyBlepSound::getWaveformNames())
+            for (auto* suffix : { "", " 2x", " 4x" })
+                oscillatorSelector.addItem(name + suffix, oscillatorSelector.getNumItems() + 1);
+
+        // The wavetables come after them
+        oscillatorSelector.addSeparator();
+        oscillatorSelector.addItem("Wavetable from sample", wavetableFromSampleId);
+        oscillatorSelector.addItem("Wavetable file...", wavetableFileId);
+
+        oscillatorSelector.addSeparator();
+
+        for (int preset = 0; preset < AdditiveSound::getPresetNames().size(); ++preset)
+            oscillatorSelector.addItem(AdditiveSound::getPresetNames()[preset] + " drone (additive)", additiveFirstId + preset);
+
+        oscillatorSelector.addSeparator();
+
+        for (int preset = 0; preset < FmSound::getPresetNames().size(); ++preset)
+            oscillatorSelector.addItem(FmSound::getPresetNames()[preset] + " (FM)", fmFirstId + preset);
+
+        oscillatorSelector.onChange = [this]
+        {
+            auto id = oscillatorSelector.getSelectedId();
+
+            if (id == wavetableFromSampleId)
+                synthAudioSource.setUsingWavetableSound(getSelectedChannel());
+            else if (id == wavetableFileId)
+                chooseWavetable();
+            else if (id >= fmFirstId)
+                synthAudioSource.setUsingFmSound(id - fmFirstId, getSelectedChannel());
+            else if (id >= additiveFirstId)
+                synthAudioSource.setUsingAdditiveSound((AdditiveSound::Preset)(id - additiveFirstId), additivePartials, getSelectedChannel());
+            else if (id > 0)
+                synthAudioSource.setUsingPolyBlepSound((PolyBlepOscillator::Waveform)((id - 1) / 3), 1 << ((id - 1) % 3), getSelectedChannel());
+
+            updatePartControls();
+        };
+
+        // Moves through the wavetable with CC 74, as a controller would, so it's recorded with the MIDI
+        addAndMakeVisible(wavetablePositionSlider);
+        wavetablePositionSlider.setSliderStyle(Slider::LinearBar);
+        wavetablePositionSlider.setRange(0.0, 127.0, 1.0);
+        wavetablePositionSlider.setTextValueSuffix(" table position (CC 74)");
+        wavetablePositionSlider.onValueChange = [this] { sendWavetablePosition(); };
 
         addAndMakeVisible(sampledButton);
         sampledButton.setRadioGroupId(321);
-        sampledButton.onClick = [this] { synthAudioSource.setUsingSampledSound(); };
+        sampledButton.onClick = [this] { synthAudioSource.setUsingSampledSound(getSelectedChannel()); updatePartControls(); };
+
+        addAndMakeVisible(instrumentButton);
+        instrumentButton.setRadioGroupId(321);
+        instrumentButton.setEnabled(false);
+        instrumentButton.onClick = [this] { synthAudioSource.setUsingInstrument(getSelectedChannel()); updatePartControls(); };
+
+        addAndMakeVisible(loadInstrumentButton);
+        loadInstrumentButton.onClick = [this] { chooseInstrument(); };
+
+        addAndMakeVisible(loadLibraryButton);
+        loadLibraryButton.onClick = [this] { chooseSampleLibrary(); };
+
+        addAndMakeVisible(saveLatencyButton);
+        saveLatencyButton.onClick = [this] { chooseLatencyReportFile(); };
+
+        addAndMakeVisible(parallelButton);
+        parallelButton.onClick = [this] { synthAudioSource.synth.setParallelRenderingEnabled(parallelButton.getToggleState()); };
+
+        addAndMakeVisible(surroundButton);
+        surroundButton.onClick = [this]
+        {
+            synthAudioSource.setSurroundPanning(surroundButton.getToggleState());
+            updateOutputChannels();
+        };
+
+        addAndMakeVisible(loadMidiFileButton);
+        loadMidiFileButton.onClick = [this] { chooseMidiFile(); };
+
+        addAndMakeVisible(playMidiFileButton);
+        playMidiFileButton.setEnabled(false);
+        playMidiFileButton.onClick = [this] { toggleMidiFilePlayback(); };
+
+        addAndMakeVisible(midiFilePosition);
+        midiFilePosition.setSliderStyle(Slider::LinearBar);
+        midiFilePosition.setTextValueSuffix(" s");
+        midiFilePosition.setNumDecimalPlacesToDisplay(1);
+        midiFilePosition.setRange(0.0, 1.0);
+        midiFilePosition.setEnabled(false);
+        // While it's dragged the slider only shows where it'll go, and the jump happens on release
+        midiFilePosition.onDragEnd = [this] { synthAudioSource.midiFilePlayer.seek(midiFilePosition.getValue()); };
+        midiFilePosition.onValueChange = [this]
+        {
+            // A value typed into the box, rather than dragged to
+            if (!midiFilePosition.isMouseButtonDown())
+                synthAudioSource.midiFilePlayer.seek(midiFilePosition.getValue());
+        };
 
         addAndMakeVisible(midiInputListLabel);
-        midiInputListLabel.setText("MIDI Input:", dontSendNotification);
-        midiInputListLabel.attachToComponent(&midiInputList, true);
+        midiInputListLabel.setText("MIDI inputs (click to enable):", dontSendNotification);
+        midiInputListLabel.attachToComponent(&midiInputList, false);
 
         addAndMakeVisible(midiInputList);
-        midiInputList.onChange = [this] { setMidiInput(midiInputList.getSelectedId() - 1); };
+        midiInputList.setModel(this);
+        midiInputList.setRowHeight(20);
+
+        addAndMakeVisible(midiChannelMapping);
+        midiChannelMapping.addItem("Channels as sent", 1);
+
+        for (int channel = 1; channel <= 16; ++channel)
+            midiChannelMapping.addItem("Everything to channel " + String(channel), channel + 1);
+
+        midiChannelMapping.setSelectedId(1, dontSendNotification);
+        midiChannelMapping.setEnabled(false);
+        midiChannelMapping.onChange = [this] { applyChannelMapping(); };
+
+        // The device list arrives asynchronously, and again whenever something is plugged in
+        midiDeviceList.onChange = [this] { midiDevicesChanged(); };
+
+        addAndMakeVisible(recordSessionButton);
+        recordSessionButton.onClick = [this] { toggleSessionRecording(); };
 
-        auto midiInputs = MidiInput::getAvailableDevices();
-        for (auto i = 0; i < midiInputs.size(); ++i)
-            midiInputList.addItem(midiInputs[i].name, i + 1);
+        // The sound buttons apply to whichever part is selected here
+        addAndMakeVisible(partSelector);
+        partSelector.addItem("All channels", 1);
 
-        midiInputList.setSelectedId(1);
+        for (int channel = 1; channel <= SynthEngine::numParts; ++channel)
+            partSelector.addItem("Channel " + String(channel), channel + 1);
+
+        partSelector.setSelectedId(1, dontSendNotification);
+        partSelector.onChange = [this] { updatePartControls(); };
+
+        addAndMakeVisible(reservedVoicesSlider);
+        reservedVoicesSlider.setSliderStyle(Slider::IncDecButtons);
+        reservedVoicesSlider.setTextBoxStyle(Slider::TextBoxLeft, false, 30, 20);
+        reservedVoicesSlider.setRange(0.0, 16.0, 1.0);
+        reservedVoicesSlider.setTooltip("Voices reserved for this channel");
+        reservedVoicesSlider.onValueChange = [this]
+        {
+            synthAudioSource.setPartVoiceReservation(getSelectedChannel(), (int)reservedVoicesSlider.getValue());
+        };
+
+        addAndMakeVisible(reverbSelector);
+        reverbSelector.addItemList(SynthAudioSource::getReverbNames(), 1);
+        reverbSelector.setSelectedId(1, dontSendNotification);
+        reverbSelector.onChange = [this]
+        {
+            if (!synthAudioSource.setReverb(reverbSelector.getSelectedId() - 1))
+                reverbSelector.setSelectedId(1, dontSendNotification);   // the asset wasn't found
+        };
+
+        addAndMakeVisible(reverbLevelSlider);
+        reverbLevelSlider.setSliderStyle(Slider::LinearBar);
+        reverbLevelSlider.setRange(0.0, 1.0, 0.01);
+        reverbLevelSlider.setValue(synthAudioSource.reverb.getWetLevel(), dontSendNotification);
+        reverbLevelSlider.setTextValueSuffix(" wet");
+        reverbLevelSlider.onValueChange = [this] { synthAudioSource.setReverbLevel((float)reverbLevelSlider.getValue()); };
+
+        addAndMakeVisible(filterSelector);
+        filterSelector.addItemList({ "No filter", "Lowpass", "Bandpass", "Highpass" }, 1);
+        filterSelector.setSelectedId(1, dontSendNotification);
+        filterSelector.onChange = [this] { updateVoiceFilter(); };
+
+        addAndMakeVisible(filterCutoffSlider);
+        filterCutoffSlider.setSliderStyle(Slider::LinearBar);
+        filterCutoffSlider.setRange(20.0, 20000.0, 1.0);
+        filterCutoffSlider.setSkewFactorFromMidPoint(1000.0);
+        filterCutoffSlider.setValue(synthAudioSource.synth.getVoiceFilter().getCutoff(), dontSendNotification);
+        filterCutoffSlider.setTextValueSuffix(" Hz");
+        filterCutoffSlider.onValueChange = [this] { updateVoiceFilter(); };
+
+        addAndMakeVisible(filterResonanceSlider);
+        filterResonanceSlider.setSliderStyle(Slider::LinearBar);
+        filterResonanceSlider.setRange(0.5, 10.0, 0.01);
+        filterResonanceSlider.setSkewFactorFromMidPoint(2.0);
+        filterResonanceSlider.setValue(synthAudioSource.synth.getVoiceFilter().getResonance(), dontSendNotification);
+        filterResonanceSlider.setTooltip("Filter resonance (Q)");
+        filterResonanceSlider.onValueChange = [this] { updateVoiceFilter(); };
+
+        addAndMakeVisible(spreadSlider);
+        spreadSlider.setSliderStyle(Slider::LinearBar);
+        spreadSlider.setRange(0.0, 1.0, 0.01);
+        spreadSlider.setTextValueSuffix(" stereo spread");
+        spreadSlider.onValueChange = [this] { synthAudioSource.setStereoSpread((float)spreadSlider.getValue()); };
+
+        addAndMakeVisible(sharedSoundButton);
+        sharedSoundButton.onClick = [this] { synthAudioSource.setUsingSharedSound(getSelectedChannel()); updatePartControls(); };
+
+        // Stems go to the outputs after the first two, so they need a device with more than two
+        addAndMakeVisible(stemSelector);
+        stemSelector.addItem("No stems", 1);
+        stemSelector.addItem("Stems by voice type", 2);
+        stemSelector.addItem("Stems by channel", 3);
+        stemSelector.setSelectedId(1, dontSendNotification);
+        stemSelector.onChange = [this]
+        {
+            synthAudioSource.setStemLayout((SynthEngine::StemLayout)(stemSelector.getSelectedId() - 1));
+            updateOutputChannels();
+        };
+
+        updatePartControls();
 
         // Add both displays
         addAndMakeVisible(liveAudioDisplayComp);
@@ -634,17 +1300,23 @@ public:
        #endif
 
         audioDeviceManager.addAudioCallback(&callback);
-        audioDeviceManager.addMidiInputDeviceCallback({}, &(synthAudioSource.midiCollector));
+
+        addAndMakeVisible(statusLabel);
+        statusLabel.setJustificationType(Justification::topLeft);
+        statusLabel.setFont(Font(12.0f));
+        startTimerHz(4);
 
         setOpaque(true);
-        setSize(640, 600); // Increased height to accommodate both displays
+        setSize(760, 684); // Increased height to accommodate both displays and the controls
     }
 
     ~AudioSynthesiserDemo() override
     {
         // Stop audio processing first
         audioDeviceManager.removeAudioCallback(&callback);
-        audioDeviceManager.removeMidiInputDeviceCallback({}, &(synthAudioSource.midiCollector));
+        synthAudioSource.midiInputs.disableAll(audioDeviceManager);
+        synthAudioSource.stopRecordingSession();
+        midiInputList.setModel(nullptr);
         
         // Then release the audio source
         audioSourcePlayer.setSource(nullptr);
@@ -671,42 +1343,524 @@ public:
         auto bottomArea = area.removeFromBottom(96); // Keyboard area
         keyboardComponent.setBounds(bottomArea);
         
+        // MIDI inputs on the right, under their label
+        auto midiArea = area.removeFromRight(220);
+        midiArea.removeFromTop(20);
+        recordSessionButton.setBounds(midiArea.removeFromBottom(24).reduced(2));
+
+        spreadSlider.setBounds(midiArea.removeFromBottom(24).reduced(2));
+        wavetablePositionSlider.setBounds(midiArea.removeFromBottom(24).reduced(2));
+
+        auto filterRow = midiArea.removeFromBottom(24);
+        filterSelector.setBounds(filterRow.removeFromLeft(90).reduced(2));
+        filterResonanceSlider.setBounds(filterRow.removeFromRight(45).reduced(2));
+        filterCutoffSlider.setBounds(filterRow.reduced(2));
+
+        auto reverbRow = midiArea.removeFromBottom(24);
+        reverbSelector.setBounds(reverbRow.removeFromLeft(110).reduced(2));
+        reverbLevelSlider.setBounds(reverbRow.reduced(2));
+
+        auto partRow = midiArea.removeFromBottom(24);
+        partSelector.setBounds(partRow.removeFromLeft(95).reduced(2));
+        sharedSoundButton.setBounds(partRow.removeFromRight(50).reduced(2));
+        reservedVoicesSlider.setBounds(partRow.reduced(2));
+        midiChannelMapping.setBounds(midiArea.removeFromBottom(24).reduced(2));
+        midiInputList.setBounds(midiArea.reduced(2));
+
         // Adjust control panel area
         auto controlArea = area.removeFromLeft(180);
-        sineButton.setBounds(controlArea.removeFromTop(24).reduced(2));
+        auto sineRow = controlArea.removeFromTop(24);
+        sineButton.setBounds(sineRow.removeFromLeft(100).reduced(2));
+        oscillatorSelector.setBounds(sineRow.reduced(2));
         sampledButton.setBounds(controlArea.removeFromTop(24).reduced(2));
-        midiInputList.setBounds(controlArea.removeFromTop(24).reduced(2));
+        instrumentButton.setBounds(controlArea.removeFromTop(24).reduced(2));
+        loadInstrumentButton.setBounds(controlArea.removeFromTop(24).reduced(2));
+        loadLibraryButton.setBounds(controlArea.removeFromTop(24).reduced(2));
+        parallelButton.setBounds(controlArea.removeFromTop(24).reduced(2));
+        surroundButton.setBounds(controlArea.removeFromTop(24).reduced(2));
+        saveLatencyButton.setBounds(controlArea.removeFromTop(24).reduced(2));
+
+        auto midiFileRow = controlArea.removeFromTop(24);
+        loadMidiFileButton.setBounds(midiFileRow.removeFromLeft(midiFileRow.getWidth() / 2).reduced(2));
+        playMidiFileButton.setBounds(midiFileRow.reduced(2));
+        midiFilePosition.setBounds(controlArea.removeFromTop(24).reduced(2));
+        stemSelector.setBounds(controlArea.removeFromTop(24).reduced(2));
+
+        statusLabel.setBounds(area.reduced(8, 2));
     }
 
 private:
-    // Select your midi device
-    void setMidiInput(int index)
+    /** Opens as many outputs as the synth wants, and no more: two unless it's
+        panning around a ring or sending out stems.
+    */
+    void updateOutputChannels()
+    {
+        auto setup = audioDeviceManager.getAudioDeviceSetup();
+        setup.useDefaultOutputChannels = false;
+        setup.outputChannels.clear();
+        setup.outputChannels.setRange(0, synthAudioSource.getNumOutputChannelsWanted(), true);
+
+        auto error = audioDeviceManager.setAudioDeviceSetup(setup, true);
+        jassert(error.isEmpty());
+        ignoreUnused(error);
+    }
+
+    void updateVoiceFilter()
+    {
+        synthAudioSource.setVoiceFilter((VoiceFilter::Mode)(filterSelector.getSelectedId() - 1),
+                                        (float)filterCutoffSlider.getValue(), (float)filterResonanceSlider.getValue());
+    }
+
+    void timerCallback() override
+    {
+        updateMidiFileControls();
+
+        // Frees impulse responses and wavetables that the audio thread has finished with
+        synthAudioSource.reverb.collectGarbage();
+        synthAudioSource.wavetables.collectGarbage();
+
+        auto stats = synthAudioSource.sampleCache.getStatistics();
+        auto engineStats = synthAudioSource.synth.getStatistics();
+
+        auto toMB = [](size_t bytes) { return String((double)bytes / (1024.0 * 1024.0), 1) + " MB"; };
+
+        statusLabel.setText("Sample cache: " + toMB(stats.residentBytes) + " of " + toMB(stats.budgetBytes)
+                              + ", " + String(stats.numResident) + "/" + String(stats.numEntries) + " samples resident"
+                              + (stats.numFailed > 0 ? ", " + String(stats.numFailed) + " couldn't be decoded\n" : String("\n"))
+                              + "hits " + String(stats.hits) + ", misses " + String(stats.misses)
+                              + ", evictions " + String(stats.evictions) + "; "
+                              + String(synthAudioSource.wavetables.getNumTables()) + " wavetables, "
+                              + toMB(synthAudioSource.wavetables.getSizeInBytes()) + "\n"
+                              + "Blocks: " + String(engineStats.parallelBlocks) + " parallel, "
+                              + String(engineStats.serialBlocks) + " serial, "
+                              + String(engineStats.deadlineMisses) + " missed deadlines\n"
+                              + "Voices: " + String(engineStats.numActiveVoices) + " active, "
+                              + String(engineStats.culledVoices) + " culled while silent, "
+                              + String(engineStats.stolenVoices) + " stolen, "
+                              + String(synthAudioSource.reverb.getStatistics().lateTailBlocks) + " late reverb blocks"
+                              + getLatencyDescription() + "\n"
+                              + synthAudioSource.latencyMonitor.getSummary()
+                              + getStemDescription()
+                              + libraryStatus,
+                            dontSendNotification);
+    }
+
+    String getStemDescription()
+    {
+        auto numStems = synthAudioSource.synth.getNumStems();
+
+        if (numStems == 0)
+            return {};
+
+        auto* device = audioDeviceManager.getCurrentAudioDevice();
+        auto numOutputs = device != nullptr ? device->getActiveOutputChannels().countNumberOfSetBits() : 0;
+        auto numOnOutputs = synthAudioSource.getNumStemsOnOutputs(jmin(numOutputs, SynthAudioSource::maxOutputChannels));
+
+        return "\nStems: " + String(numOnOutputs) + " of " + String(numStems) + " have their own outputs"
+                 + (numOnOutputs < numStems ? ", the rest are only in the mix" : "");
+    }
+
+    String getLatencyDescription()
+    {
+        auto* device = audioDeviceManager.getCurrentAudioDevice();
+
+        if (device == nullptr || device->getCurrentSampleRate() <= 0.0)
+            return {};
+
+        auto deviceLatency = device->getOutputLatencyInSamples() + device->getCurrentBufferSizeSamples();
+        auto synthLatency = synthAudioSource.getLatencyInSamples();
+        auto toMs = [device](int samples) { return String(1000.0 * samples / device->getCurrentSampleRate(), 1) + " ms"; };
+
+        return "\nOutput latency: " + toMs(deviceLatency + synthLatency)
+                 + " (device " + String(deviceLatency) + " + synth quantum " + String(synthLatency) + " samples)";
+    }
+
+    //==============================================================================
+    void chooseMidiFile()
+    {
+        instrumentChooser = std::make_unique<FileChooser>("Choose a MIDI file...",
+                                                          File::getSpecialLocation(File::userHomeDirectory),
+                                                          "*.mid;*.midi;*.smf");
+
+        instrumentChooser->launchAsync(FileBrowserComponent::openMode | FileBrowserComponent::canSelectFiles,
+                                       [this](const FileChooser& chooser)
+                                       {
+                                           auto file = chooser.getResult();
+
+                                           if (file == File())
+                                               return;
+
+                                           auto& player = synthAudioSource.midiFilePlayer;
+
+                                           if (player.load(file))
+                                           {
+                                               midiFilePosition.setRange(0.0, jmax(0.1, player.getLengthInSeconds()), dontSendNotification);
+                                               midiFilePosition.setValue(0.0, dontSendNotification);
+                                               midiFilePosition.setEnabled(true);
+                                               playMidiFileButton.setEnabled(true);
+                                           }
+                                           else
+                                           {
+                                               AlertWindow::showMessageBoxAsync(MessageBoxIconType::WarningIcon,
+                                                                                "Load MIDI file",
+                                                                                "Couldn't find any notes in " + file.getFullPathName());
+                                           }
+                                       });
+    }
+
+    void toggleMidiFilePlayback()
+    {
+        auto& player = synthAudioSource.midiFilePlayer;
+
+        if (player.isPlaying())
+        {
+            player.stop();
+        }
+        else
+        {
+            // Start again from the top if it ran to the end, unless somewhere else was just picked
+            if (!player.isSeekPending() && player.getPositionInSeconds() >= player.getLengthInSeconds())
+                player.seek(0.0);
+
+            player.play();
+        }
+
+        updateMidiFileControls();
+    }
+
+    void updateMidiFileControls()
     {
-        auto list = MidiInput::getAvailableDevices();
-        if (list.isEmpty())
+        auto& player = synthAudioSource.midiFilePlayer;
+        player.collectGarbage();
+
+        playMidiFileButton.setButtonText(player.isPlaying() ? "Stop" : "Play");
+
+        if (!midiFilePosition.isMouseButtonDown())
+            midiFilePosition.setValue(player.getPositionInSeconds(), dontSendNotification);
+    }
+
+    void chooseLatencyReportFile()
+    {
+        instrumentChooser = std::make_unique<FileChooser>("Save latency statistics...",
+                                                          File::getSpecialLocation(File::userDocumentsDirectory)
+                                                              .getChildFile("synth-latency.txt"),
+                                                          "*.txt");
+
+        instrumentChooser->launchAsync(FileBrowserComponent::saveMode | FileBrowserComponent::warnAboutOverwriting,
+                                       [this](const FileChooser& chooser)
+                                       {
+                                           auto file = chooser.getResult();
+
+                                           if (file != File() && !synthAudioSource.latencyMonitor.writeReport(file))
+                                               AlertWindow::showMessageBoxAsync(MessageBoxIconType::WarningIcon,
+                                                                                "Save latency statistics",
+                                                                                "Couldn't write to " + file.getFullPathName());
+                                       });
+    }
+
+    //==============================================================================
+    /** 0 while "All channels" is selected. */
+    int getSelectedChannel() const
+    {
+        return jmax(0, partSelector.getSelectedId() - 1);
+    }
+
+    void updatePartControls()
+    {
+        auto channel = getSelectedChannel();
+        auto sound = synthAudioSource.getSoundDescription(channel);
+
+        sineButton.setToggleState(sound == "sine", dontSendNotification);
+        sampledButton.setToggleState(sound == "sampled", dontSendNotification);
+        instrumentButton.setToggleState(sound.startsWith("instrument:") || sound.startsWith("library:"), dontSendNotification);
+
+        if (sound.startsWith("wavetable:"))
+        {
+            oscillatorSelector.setSelectedId(sound == "wavetable:sample" ? wavetableFromSampleId : wavetableFileId,
+                                             dontSendNotification);
+        }
+        else if (sound.startsWith("fm:"))
+        {
+            oscillatorSelector.setSelectedId(fmFirstId + sound.fromFirstOccurrenceOf(":", false, false).getIntValue(),
+                                             dontSendNotification);
+        }
+        else if (sound.startsWith("additive:"))
+        {
+            auto preset = sound.fromFirstOccurrenceOf(":", false, false).getIntValue();
+            oscillatorSelector.setSelectedId(additiveFirstId + preset, dontSendNotification);
+        }
+        else if (sound.startsWith("polyblep:"))
+        {
+            auto settings = StringArray::fromTokens(sound.fromFirstOccurrenceOf(":", false, false), ":", {});
+            auto factorIndex = settings[1].getIntValue() == 4 ? 2 : (settings[1].getIntValue() == 2 ? 1 : 0);
+            oscillatorSelector.setSelectedId(settings[0].getIntValue() * 3 + factorIndex + 1, dontSendNotification);
+        }
+        else
+        {
+            oscillatorSelector.setSelectedId(0, dontSendNotification);
+        }
+
+        reservedVoicesSlider.setEnabled(channel > 0);
+        reservedVoicesSlider.setValue(synthAudioSource.synth.getPartVoiceReservation(channel), dontSendNotification);
+        sharedSoundButton.setEnabled(channel > 0 && sound != "shared");
+    }
+
+    void toggleSessionRecording()
+    {
+        if (synthAudioSource.isRecordingSession())
+        {
+            synthAudioSource.stopRecordingSession();
+            recordSessionButton.setButtonText("Record session...");
             return;
+        }
+
+        instrumentChooser = std::make_unique<FileChooser>("Record the session to...",
+                                                          File::getSpecialLocation(File::userDocumentsDirectory)
+                                                              .getChildFile("synth-session.midilog"),
+                                                          "*.midilog");
+
+        instrumentChooser->launchAsync(FileBrowserComponent::saveMode | FileBrowserComponent::warnAboutOverwriting,
+                                       [this](const FileChooser& chooser)
+                                       {
+                                           auto file = chooser.getResult();
+
+                                           if (file == File())
+                                               return;
+
+                                           if (synthAudioSource.startRecordingSession(file))
+                                               recordSessionButton.setButtonText("Stop recording");
+                                           else
+                                               AlertWindow::showMessageBoxAsync(MessageBoxIconType::WarningIcon,
+                                                                                "Record session",
+                                                                                "Couldn't write to " + file.getFullPathName());
+                                       });
+    }
+
+    void chooseInstrument()
+    {
+        instrumentChooser = std::make_unique<FileChooser>("Choose an instrument definition...",
+                                                          File::getSpecialLocation(File::userHomeDirectory),
+                                                          "*.xml");
+
+        instrumentChooser->launchAsync(FileBrowserComponent::openMode | FileBrowserComponent::canSelectFiles,
+                                       [this](const FileChooser& chooser)
+                                       {
+                                           auto file = chooser.getResult();
+
+                                           if (file == File())
+                                               return;
+
+                                           if (synthAudioSource.loadInstrument(file, getSelectedChannel()))
+                                           {
+                                               instrumentButton.setButtonText("Use " + file.getFileNameWithoutExtension());
+                                               instrumentButton.setEnabled(true);
+                                               updatePartControls();
+                                           }
+                                           else
+                                           {
+                                               AlertWindow::showMessageBoxAsync(MessageBoxIconType::WarningIcon,
+                                                                                "Load instrument",
+                                                                                "Couldn't read an instrument from " + file.getFullPathName());
+                                           }
+                                       });
+    }
 
-        // Disable all current MIDI inputs
-        for (auto& input : MidiInput::getAvailableDevices())
-            audioDeviceManager.setMidiInputDeviceEnabled(input.identifier, false);
+    void chooseWavetable()
+    {
+        instrumentChooser = std::make_unique<FileChooser>("Choose a wavetable (single cycles of 2048 samples)...",
+                                                          File::getSpecialLocation(File::userHomeDirectory),
+                                                          "*.wav;*.aif;*.aiff;*.flac");
+
+        instrumentChooser->launchAsync(FileBrowserComponent::openMode | FileBrowserComponent::canSelectFiles,
+                                       [this](const FileChooser& chooser)
+                                       {
+                                           auto file = chooser.getResult();
+
+                                           if (file != File() && !synthAudioSource.loadWavetable(file, getSelectedChannel()))
+                                               AlertWindow::showMessageBoxAsync(MessageBoxIconType::WarningIcon,
+                                                                                "Load wavetable",
+                                                                                "Couldn't read any whole cycles from " + file.getFullPathName());
+
+                                           updatePartControls();
+                                       });
+    }
 
-        audioDeviceManager.removeMidiInputDeviceCallback({}, &(synthAudioSource.midiCollector));
+    /** Sends the slider's position as CC 74 on the selected channel, or on every channel. */
+    void sendWavetablePosition()
+    {
+        auto value = (int)wavetablePositionSlider.getValue();
+        auto now = Time::getMillisecondCounterHiRes() * 0.001;
+        auto channel = getSelectedChannel();
+
+        for (int ch = 1; ch <= 16; ++ch)
+            if (channel == 0 || ch == channel)
+                synthAudioSource.midiQueue.push(MidiMessage::controllerEvent(ch, WavetableVoice::positionController, value)
+                                                    .withTimeStamp(now));
+    }
+
+    void chooseSampleLibrary()
+    {
+        instrumentChooser = std::make_unique<FileChooser>("Choose a sample folder...",
+                                                          File::getSpecialLocation(File::userHomeDirectory));
+
+        instrumentChooser->launchAsync(FileBrowserComponent::openMode | FileBrowserComponent::canSelectDirectories,
+                                       [this](const FileChooser& chooser)
+                                       {
+                                           auto directory = chooser.getResult();
+
+                                           if (!directory.isDirectory())
+                                               return;
+
+                                           loadLibraryButton.setEnabled(false);
+                                           loadLibraryButton.setButtonText("Indexing...");
+
+                                           libraryScanner.scanAsync(directory,
+                                               [safeThis = SafePointer<AudioSynthesiserDemo>(this), directory]
+                                               (std::shared_ptr<const SampleLibraryIndex> index, int numFilesOpened, bool indexSaved)
+                                               {
+                                                   if (safeThis != nullptr)
+                                                       safeThis->sampleLibraryScanned(directory, *index, numFilesOpened, indexSaved);
+                                               });
+                                       });
+    }
+
+    void sampleLibraryScanned(const File& directory, const SampleLibraryIndex& index, int numFilesOpened, bool indexSaved)
+    {
+        loadLibraryButton.setEnabled(true);
+        loadLibraryButton.setButtonText("Load sample folder...");
 
-        if (index >= 0 && index < list.size())
+        // Shown in the status label until the next folder is scanned
+        libraryStatus = "\nLibrary: " + String((int)index.getSamples().size()) + " samples indexed in "
+                          + directory.getFileName() + ", " + String(numFilesOpened) + " files opened";
+
+        if (index.getNumUnreadable() > 0)
+            libraryStatus << ", " << index.getNumUnreadable() << " unreadable";
+
+        if (!indexSaved)
+            libraryStatus << ", couldn't save the index";
+
+        if (synthAudioSource.loadSampleLibrary(index, directory, getSelectedChannel()))
         {
-            auto newInput = list[index];
-            if (!audioDeviceManager.isMidiInputDeviceEnabled(newInput.identifier))
-            {
-                audioDeviceManager.setMidiInputDeviceEnabled(newInput.identifier, true);
-                audioDeviceManager.addMidiInputDeviceCallback(newInput.identifier, &(synthAudioSource.midiCollector));
-            }
+            instrumentButton.setButtonText("Use " + directory.getFileName());
+            instrumentButton.setEnabled(true);
+            updatePartControls();
+        }
+        else
+        {
+            AlertWindow::showMessageBoxAsync(MessageBoxIconType::WarningIcon,
+                                             "Load sample folder",
+                                             "None of the samples in " + directory.getFullPathName()
+                                               + " has a root note in its metadata or file name.");
         }
     }
 
+    //==============================================================================
+    void midiDevicesChanged()
+    {
+        midiDevices = midiDeviceList.getDevices();
+
+        // As before, the first device is switched on when the app starts
+        if (!hasReceivedDeviceList && !midiDevices.isEmpty())
+            synthAudioSource.midiInputs.setDeviceEnabled(audioDeviceManager, midiDevices.getReference(0), true);
+
+        hasReceivedDeviceList = true;
+        midiInputList.updateContent();
+        midiInputList.repaint();
+        updateChannelMappingBox();
+    }
+
+    int getNumRows() override
+    {
+        return midiDevices.size();
+    }
+
+    void paintListBoxItem(int row, Graphics& g, int width, int height, bool rowIsSelected) override
+    {
+        if (!isPositiveAndBelow(row, midiDevices.size()))
+            return;
+
+        auto& device = midiDevices.getReference(row);
+        auto& inputs = synthAudioSource.midiInputs;
+        auto enabled = inputs.isDeviceEnabled(device.identifier);
+
+        if (rowIsSelected)
+            g.fillAll(findColour(TextEditor::highlightColourId));
+
+        auto tick = Rectangle<int>(4, (height - 12) / 2, 12, 12).toFloat();
+        g.setColour(findColour(ToggleButton::tickDisabledColourId));
+        g.drawRoundedRectangle(tick, 2.0f, 1.0f);
+
+        if (enabled)
+        {
+            g.setColour(findColour(ToggleButton::tickColourId));
+            g.fillRoundedRectangle(tick.reduced(3.0f), 1.0f);
+        }
+
+        auto text = device.name;
+
+        if (auto channel = inputs.getChannelMapping(device.identifier); channel > 0)
+            text << "  -> ch " << channel;
+
+        g.setColour(findColour(ListBox::textColourId));
+        g.setFont(Font(13.0f));
+        g.drawText(text, 22, 0, width - 24, height, Justification::centredLeft, true);
+    }
+
+    void listBoxItemClicked(int row, const MouseEvent&) override
+    {
+        if (!isPositiveAndBelow(row, midiDevices.size()))
+            return;
+
+        auto& device = midiDevices.getReference(row);
+        auto& inputs = synthAudioSource.midiInputs;
+
+        if (!inputs.setDeviceEnabled(audioDeviceManager, device, !inputs.isDeviceEnabled(device.identifier)))
+            AlertWindow::showMessageBoxAsync(MessageBoxIconType::WarningIcon,
+                                             "MIDI inputs",
+                                             "No more than " + String(MidiInputRouter::maxDevices)
+                                               + " MIDI inputs can be enabled at once.");
+
+        midiInputList.repaintRow(row);
+        updateChannelMappingBox();
+    }
+
+    void selectedRowsChanged(int) override
+    {
+        updateChannelMappingBox();
+    }
+
+    void updateChannelMappingBox()
+    {
+        auto row = midiInputList.getSelectedRow();
+        auto hasDevice = isPositiveAndBelow(row, midiDevices.size())
+                           && synthAudioSource.midiInputs.isDeviceEnabled(midiDevices.getReference(row).identifier);
+
+        midiChannelMapping.setEnabled(hasDevice);
+
+        if (hasDevice)
+            midiChannelMapping.setSelectedId(synthAudioSource.midiInputs.getChannelMapping(midiDevices.getReference(row).identifier) + 1,
+                                             dontSendNotification);
+    }
+
+    void applyChannelMapping()
+    {
+        auto row = midiInputList.getSelectedRow();
+
+        if (!isPositiveAndBelow(row, midiDevices.size()))
+            return;
+
+        synthAudioSource.midiInputs.setChannelMapping(midiDevices.getReference(row).identifier,
+                                                      midiChannelMapping.getSelectedId() - 1);
+        midiInputList.repaintRow(row);
+    }
+
     AudioDeviceManager audioDeviceManager;
 
-    Label midiInputListLabel { {}, "MIDI Input:" };
-    ComboBox midiInputList;
+    Label midiInputListLabel { {}, "MIDI inputs:" };
+    ListBox midiInputList;
+    ComboBox midiChannelMapping;
+    Array<MidiDeviceInfo> midiDevices;
+    bool hasReceivedDeviceList = false;
 
     MidiKeyboardState keyboardState;
     AudioSourcePlayer audioSourcePlayer;
@@ -716,10 +1870,35 @@ private:
 
     ToggleButton sineButton { "Use sine wave" };
     ToggleButton sampledButton { "Use sampled sound" };
+    ToggleButton instrumentButton { "Use instrument" };
+    TextButton loadInstrumentButton { "Load instrument..." };
+    TextButton loadLibraryButton { "Load sample folder..." };
+    ToggleButton parallelButton { "Parallel voices" };
+    ToggleButton surroundButton { "Surround speaker ring" };
+    TextButton saveLatencyButton { "Save latency stats..." };
+    TextButton loadMidiFileButton { "Load MIDI file..." };
+    TextButton playMidiFileButton { "Play" };
+    TextButton recordSessionButton { "Record session..." };
+    ComboBox partSelector, stemSelector, reverbSelector, filterSelector, oscillatorSelector;
+    Slider reservedVoicesSlider, spreadSlider, reverbLevelSlider, filterCutoffSlider, filterResonanceSlider;
+    Slider wavetablePositionSlider;
+
+    // Past the PolyBLEP waveforms' ids in the oscillator selector
+    static constexpr int wavetableFromSampleId = 100, wavetableFileId = 101, additiveFirstId = 110, fmFirstId = 120;
+    static constexpr int additivePartials = 512;
+    TextButton sharedSoundButton { "Shared" };
+    Slider midiFilePosition;
+    std::unique_ptr<FileChooser> instrumentChooser;
+    SampleLibraryScanner libraryScanner;
+
+    Label statusLabel;
+    String libraryStatus;
 
     LiveScrollingAudioDisplay liveAudioDisplayComp;
 
     Callback callback { audioSourcePlayer, liveAudioDisplayComp };
 
+    MidiDeviceListCache midiDeviceList;
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AudioSynthesiserDemo)
 };
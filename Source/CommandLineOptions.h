@@ -0,0 +1,23 @@
+#pragma once
+
+#include "DemoUtilities.h"
+
+//==============================================================================
+/** Reads the options given to the app's headless modes (see LatencyProbe and SessionReplay). */
+struct CommandLineOptions
+{
+    /** Finds "--name=value", or the token following "--name". */
+    static String get(const StringArray& args, const String& name, const String& defaultValue = {})
+    {
+        for (int i = 0; i < args.size(); ++i)
+        {
+            if (name.endsWithChar('=') && args[i].startsWith(name))
+                return args[i].fromFirstOccurrenceOf("=", false, false).unquoted();
+
+            if (args[i] == name && !args[i + 1].startsWith("--"))
+                return args[i + 1].unquoted();
+        }
+
+        return defaultValue;
+    }
+};
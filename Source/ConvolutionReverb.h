@@ -0,0 +1,519 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "SmoothedParameter.h"
+
+//==============================================================================
+/** Convolves one channel with part of an impulse response, using uniformly
+    partitioned overlap-save convolution in the frequency domain.
+
+    Each call takes exactly one block of input and adds one block of output.
+    The IR is split into block-sized partitions whose spectra are worked out
+    up front, and each block's input spectrum goes into a delay line so that
+    a block costs one forward FFT, one multiply-add per partition and one
+    inverse FFT, however long the IR is.
+*/
+class PartitionedConvolver final
+{
+public:
+    PartitionedConvolver() = default;
+
+    /** Takes the IR from firstSample up to endSample, split into partitions of blockSize (a power of two). */
+    void prepare(const float* impulseResponse, int firstSample, int endSample, int blockSize)
+    {
+        jassert(isPowerOfTwo(blockSize));
+
+        partitionSize = blockSize;
+        fftSize = blockSize * 2;
+        spectrumSize = fftSize + 2;     // fftSize / 2 + 1 complex bins
+        fft = std::make_unique<dsp::FFT>(roundToInt(std::log2(fftSize)));
+
+        numPartitions = jmax(0, (endSample - firstSample + blockSize - 1) / blockSize);
+
+        partitions.assign((size_t)(numPartitions * spectrumSize), 0.0f);
+        delayLine.assign((size_t)(numPartitions * spectrumSize), 0.0f);
+        inputHistory.assign((size_t)fftSize, 0.0f);
+        fftBuffer.assign((size_t)fftSize * 2, 0.0f);
+        accumulator.assign((size_t)fftSize * 2, 0.0f);
+        delayLineHead = 0;
+
+        for (int p = 0; p < numPartitions; ++p)
+        {
+            std::fill(fftBuffer.begin(), fftBuffer.end(), 0.0f);
+
+            auto start = firstSample + p * blockSize;
+            std::copy(impulseResponse + start, impulseResponse + jmin(start + blockSize, endSample), fftBuffer.begin());
+
+            fft->performRealOnlyForwardTransform(fftBuffer.data(), true);
+            std::copy(fftBuffer.begin(), fftBuffer.begin() + spectrumSize, partitions.begin() + p * spectrumSize);
+        }
+    }
+
+    void reset() noexcept
+    {
+        std::fill(delayLine.begin(), delayLine.end(), 0.0f);
+        std::fill(inputHistory.begin(), inputHistory.end(), 0.0f);
+        delayLineHead = 0;
+    }
+
+    bool isEmpty() const noexcept         { return numPartitions == 0; }
+    int getBlockSize() const noexcept     { return partitionSize; }
+
+    /** Reads getBlockSize() samples of input and adds as many of output. */
+    void processBlock(const float* input, float* outputToAddTo) noexcept
+    {
+        if (numPartitions == 0)
+            return;
+
+        // Overlap-save: the transform covers the previous block and this one
+        std::copy(inputHistory.begin() + partitionSize, inputHistory.end(), inputHistory.begin());
+        std::copy(input, input + partitionSize, inputHistory.begin() + partitionSize);
+
+        std::copy(inputHistory.begin(), inputHistory.end(), fftBuffer.begin());
+        std::fill(fftBuffer.begin() + fftSize, fftBuffer.end(), 0.0f);
+        fft->performRealOnlyForwardTransform(fftBuffer.data(), true);
+
+        std::copy(fftBuffer.begin(), fftBuffer.begin() + spectrumSize, delayLine.begin() + delayLineHead * spectrumSize);
+
+        std::fill(accumulator.begin(), accumulator.end(), 0.0f);
+
+        // The newest input meets the first partition, the oldest the last
+        for (int p = 0; p < numPartitions; ++p)
+        {
+            auto slot = delayLineHead - p;
+
+            if (slot < 0)
+                slot += numPartitions;
+
+            multiplyAccumulate(accumulator.data(),
+                               delayLine.data() + slot * spectrumSize,
+                               partitions.data() + p * spectrumSize,
+                               spectrumSize / 2);
+        }
+
+        delayLineHead = (delayLineHead + 1) % numPartitions;
+
+        fft->performRealOnlyInverseTransform(accumulator.data());
+        FloatVectorOperations::add(outputToAddTo, accumulator.data() + partitionSize, partitionSize);
+    }
+
+private:
+    /** Complex multiply-add of interleaved (re, im) spectra. */
+    static void multiplyAccumulate(float* dest, const float* a, const float* b, int numBins) noexcept
+    {
+        for (int i = 0; i < numBins; ++i)
+        {
+            auto re = a[2 * i] * b[2 * i] - a[2 * i + 1] * b[2 * i + 1];
+            auto im = a[2 * i] * b[2 * i + 1] + a[2 * i + 1] * b[2 * i];
+
+            dest[2 * i] += re;
+            dest[2 * i + 1] += im;
+        }
+    }
+
+    std::unique_ptr<dsp::FFT> fft;
+    int partitionSize = 0, fftSize = 0, spectrumSize = 0, numPartitions = 0, delayLineHead = 0;
+    std::vector<float> partitions, delayLine, inputHistory, fftBuffer, accumulator;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PartitionedConvolver)
+};
+
+//==============================================================================
+/** A convolution reverb for the synth's output, using the impulse responses
+    bundled with the examples.
+
+    The IR is split non-uniformly. Its first 2 * tailBlockSize samples are
+    convolved on the audio thread in partitions of blockSize (the synth's
+    processing quantum), which adds no latency. The rest is convolved in much
+    larger partitions of tailBlockSize on a background thread: every
+    tailBlockSize samples, the audio thread hands over the input it has
+    gathered, and picks up the result of the previous handover, which the
+    worker has had a whole tailBlockSize to produce. Because the tail starts
+    2 * tailBlockSize samples into the IR, that result is due exactly then, so
+    the overall latency stays at zero and long IRs cost about the same on the
+    audio thread as short ones.
+
+    If the worker ever fails to deliver in time, that stretch of the tail is
+    left silent and counted. With background processing switched off, the
+    tail is convolved on the audio thread at each handover instead, which
+    makes the output exactly repeatable.
+
+    Only the first two channels are processed.
+*/
+class ConvolutionReverb final
+{
+public:
+    static constexpr int blockSize = 64;
+    static constexpr int tailBlockSize = 1024;
+    static constexpr int maxChannels = 2;
+
+    struct Statistics
+    {
+        uint64 lateTailBlocks = 0, droppedTailBlocks = 0;
+    };
+
+    ConvolutionReverb() = default;
+
+    ~ConvolutionReverb()
+    {
+        delete incoming.exchange(nullptr);
+        delete retired.exchange(nullptr);
+        delete current;
+    }
+
+    //==============================================================================
+    /** The IRs bundled as assets, with "None" first. */
+    static StringArray getImpulseResponseNames()
+    {
+        return { "None", "Reverb", "Cassette recorder", "Guitar amp" };
+    }
+
+    /** Loads one of the bundled IRs (see getImpulseResponseNames()), or switches
+        the reverb off with 0. Call this on the message thread.
+    */
+    bool loadImpulseResponse(int index)
+    {
+        static const char* const assetNames[] = { nullptr, "reverb_ir.wav", "cassette_recorder.wav", "guitar_amp.wav" };
+
+        if (!isPositiveAndBelow(index, (int)numElementsInArray(assetNames)))
+            return false;
+
+        if (index == 0)
+        {
+            setImpulseResponse({}, 0.0);
+            return true;
+        }
+
+        auto stream = createAssetInputStream(assetNames[index], AssertAssetExists::no);
+
+        if (stream == nullptr)
+            return false;
+
+        WavAudioFormat wavFormat;
+        std::unique_ptr<AudioFormatReader> reader(wavFormat.createReaderFor(stream.release(), true));
+
+        if (reader == nullptr || reader->lengthInSamples <= 0)
+            return false;
+
+        AudioBuffer<float> ir(jlimit(1, maxChannels, (int)reader->numChannels), (int)reader->lengthInSamples);
+        reader->read(&ir, 0, ir.getNumSamples(), 0, true, ir.getNumChannels() > 1);
+
+        setImpulseResponse(ir, reader->sampleRate);
+        return true;
+    }
+
+    /** Uses any IR, resampled to the playback rate. An empty one switches the
+        reverb off. Call this on the message thread.
+    */
+    void setImpulseResponse(const AudioBuffer<float>& ir, double irSampleRate)
+    {
+        collectGarbage();
+
+        impulseResponse.makeCopyOf(ir);
+        impulseResponseRate = irSampleRate;
+
+        publishEngine();
+    }
+
+    /** Call this with the audio stopped, e.g. from prepareToPlay(). */
+    void prepare(double newSampleRate)
+    {
+        sampleRate = newSampleRate;
+        wetLevel.prepare(sampleRate, 0.02);
+
+        delete incoming.exchange(nullptr);
+        delete retired.exchange(nullptr);
+        delete current;
+        incomingIsEmpty.store(false);
+        current = createEngine().release();
+    }
+
+    /** When off, the tail is convolved on the audio thread, so the output is exactly repeatable. */
+    void setBackgroundProcessing(bool shouldUseWorker)
+    {
+        collectGarbage();
+
+        backgroundProcessing = shouldUseWorker;
+        publishEngine();
+    }
+
+    void setWetLevel(float newLevel) noexcept    { wetLevel.setTargetValue(jlimit(0.0f, 1.0f, newLevel)); }
+    float getWetLevel() const noexcept           { return wetLevel.getTargetValue(); }
+
+    /** Frees an engine the audio thread has finished with. Call this on the message thread. */
+    void collectGarbage()
+    {
+        delete retired.exchange(nullptr);
+    }
+
+    Statistics getStatistics() const noexcept
+    {
+        return { lateTailBlocks.load(std::memory_order_relaxed), droppedTailBlocks.load(std::memory_order_relaxed) };
+    }
+
+    //==============================================================================
+    /** Adds the reverb to a block of exactly blockSize samples. Call this on the audio thread. */
+    void process(AudioBuffer<float>& buffer) noexcept
+    {
+        takeNewEngine();
+
+        if (current == nullptr)
+            return;
+
+        if (buffer.getNumSamples() != blockSize)
+        {
+            jassertfalse;   // the reverb expects the synth's processing quantum
+            return;
+        }
+
+        auto numChannels = jmin(maxChannels, buffer.getNumChannels());
+        auto* wetGains = wetLevel.getNextValues(blockSize);
+
+        current->process(buffer, numChannels, wetGains, *this);
+    }
+
+private:
+    //==============================================================================
+    /** Everything built from one IR at one sample rate, swapped in and out as a whole. */
+    class Engine final : private Thread
+    {
+    public:
+        Engine(const AudioBuffer<float>& ir, bool useWorker)
+            : Thread("Convolution tail"), numIRChannels(ir.getNumChannels()), worker(useWorker)
+        {
+            auto length = ir.getNumSamples();
+            auto headLength = jmin(length, 2 * tailBlockSize);
+
+            for (int ch = 0; ch < numIRChannels; ++ch)
+            {
+                head[(size_t)ch].prepare(ir.getReadPointer(ch), 0, headLength, blockSize);
+                tail[(size_t)ch].prepare(ir.getReadPointer(ch), headLength, length, tailBlockSize);
+            }
+
+            hasTail = !tail[0].isEmpty();
+
+            input.setSize(maxChannels, blockSize);
+            wet.setSize(maxChannels, blockSize);
+            tailInput.setSize(maxChannels * numSlots, tailBlockSize);
+            tailOutput.setSize(maxChannels * numSlots, tailBlockSize);
+            tailPlaying.setSize(maxChannels, tailBlockSize);
+            tailInput.clear();
+            tailOutput.clear();
+            tailPlaying.clear();
+
+            if (hasTail && worker)
+                startThread(Thread::Priority::high);
+        }
+
+        ~Engine() override
+        {
+            signalThreadShouldExit();
+            wakeUp.signal();
+            stopThread(2000);
+        }
+
+        void process(AudioBuffer<float>& buffer, int numChannels, const float* wetGains, ConvolutionReverb& owner) noexcept
+        {
+            for (int ch = 0; ch < numChannels; ++ch)
+            {
+                auto irChannel = jmin(ch, numIRChannels - 1);
+                auto* dry = buffer.getWritePointer(ch);
+                auto* in = input.getWritePointer(ch);
+                auto* out = wet.getWritePointer(ch);
+
+                FloatVectorOperations::copy(in, dry, blockSize);
+                FloatVectorOperations::clear(out, blockSize);
+
+                head[(size_t)irChannel].processBlock(in, out);
+
+                if (hasTail)
+                {
+                    FloatVectorOperations::copy(tailInput.getWritePointer(getSlotChannel(gatheringJob, ch), tailPosition), in, blockSize);
+                    FloatVectorOperations::add(out, tailPlaying.getReadPointer(ch, tailPosition), blockSize);
+                }
+
+                FloatVectorOperations::addWithMultiply(dry, out, wetGains, blockSize);
+            }
+
+            activeChannels = numChannels;
+
+            if (hasTail && (tailPosition += blockSize) == tailBlockSize)
+                handOver(owner);
+        }
+
+    private:
+        /** Called each time a whole tail block of input has been gathered. */
+        void handOver(ConvolutionReverb& owner) noexcept
+        {
+            tailPosition = 0;
+
+            // The previous job's output belongs in the tail block starting now
+            if (gatheringJob > 0 && completedJobs.load(std::memory_order_acquire) >= gatheringJob)
+            {
+                for (int ch = 0; ch < maxChannels; ++ch)
+                    tailPlaying.copyFrom(ch, 0, tailOutput, getSlotChannel(gatheringJob - 1, ch), 0, tailBlockSize);
+            }
+            else
+            {
+                tailPlaying.clear();
+
+                if (gatheringJob > 0)
+                    owner.lateTailBlocks.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // With one slot always kept clear, the worker is never reading the
+            // slot being gathered into, nor writing the one just read
+            if (gatheringJob - completedJobs.load(std::memory_order_acquire) >= numSlots - 1)
+            {
+                owner.droppedTailBlocks.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            jobChannels.store(activeChannels, std::memory_order_relaxed);
+            submittedJobs.store(++gatheringJob, std::memory_order_release);
+
+            if (worker)
+                wakeUp.signal();
+            else
+                runPendingJobs();
+        }
+
+        void run() override
+        {
+            while (!threadShouldExit())
+            {
+                if (!runPendingJobs())
+                    wakeUp.wait(20);
+            }
+        }
+
+        bool runPendingJobs() noexcept
+        {
+            auto job = completedJobs.load(std::memory_order_relaxed);
+
+            if (job >= submittedJobs.load(std::memory_order_acquire))
+                return false;
+
+            for (; job < submittedJobs.load(std::memory_order_acquire); ++job)
+            {
+                for (int ch = 0; ch < jobChannels.load(std::memory_order_relaxed); ++ch)
+                {
+                    auto slotChannel = getSlotChannel(job, ch);
+                    tailOutput.clear(slotChannel, 0, tailBlockSize);
+                    tail[(size_t)jmin(ch, numIRChannels - 1)].processBlock(tailInput.getReadPointer(slotChannel),
+                                                                           tailOutput.getWritePointer(slotChannel));
+                }
+
+                completedJobs.store(job + 1, std::memory_order_release);
+            }
+
+            return true;
+        }
+
+        static int getSlotChannel(int64 job, int channel) noexcept
+        {
+            return (int)(job % numSlots) * maxChannels + channel;
+        }
+
+        static constexpr int numSlots = 4;
+
+        std::array<PartitionedConvolver, maxChannels> head, tail;
+        int numIRChannels = 1;
+        bool hasTail = false;
+        const bool worker;
+
+        AudioBuffer<float> input, wet, tailInput, tailOutput, tailPlaying;
+        WaitableEvent wakeUp;
+        std::atomic<int64> submittedJobs { 0 }, completedJobs { 0 };
+        std::atomic<int> jobChannels { maxChannels };
+
+        // Only touched on the audio thread
+        int64 gatheringJob = 0;
+        int tailPosition = 0, activeChannels = maxChannels;
+
+        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Engine)
+    };
+
+    //==============================================================================
+    /** Resamples and normalises the IR, then partitions it. Returns nullptr if there's no IR. */
+    std::unique_ptr<Engine> createEngine() const
+    {
+        if (impulseResponse.getNumSamples() == 0 || sampleRate <= 0.0 || impulseResponseRate <= 0.0)
+            return {};
+
+        auto ratio = impulseResponseRate / sampleRate;
+        auto numChannels = impulseResponse.getNumChannels();
+        auto length = jmax(1, (int)std::ceil(impulseResponse.getNumSamples() / ratio));
+
+        AudioBuffer<float> ir(numChannels, length);
+        ir.clear();
+
+        for (int ch = 0; ch < numChannels; ++ch)
+        {
+            if (approximatelyEqual(ratio, 1.0))
+            {
+                ir.copyFrom(ch, 0, impulseResponse, ch, 0, jmin(length, impulseResponse.getNumSamples()));
+            }
+            else
+            {
+                LagrangeInterpolator interpolator;
+                interpolator.process(ratio, impulseResponse.getReadPointer(ch), ir.getWritePointer(ch),
+                                     length, impulseResponse.getNumSamples(), 0);
+            }
+        }
+
+        // Unit energy per channel keeps the wet signal at roughly the level of the dry one
+        auto energy = 0.0;
+
+        for (int ch = 0; ch < numChannels; ++ch)
+            for (auto* s = ir.getReadPointer(ch), *end = s + length; s != end; ++s)
+                energy += (double)*s * *s;
+
+        if (energy > 0.0)
+            ir.applyGain((float)std::sqrt(numChannels / energy));
+
+        return std::make_unique<Engine>(ir, backgroundProcessing);
+    }
+
+    /** Hands a new engine, or the lack of one, to the audio thread. */
+    void publishEngine()
+    {
+        auto engine = createEngine();
+
+        incomingIsEmpty.store(engine == nullptr);
+        delete incoming.exchange(engine.release());
+    }
+
+    void takeNewEngine() noexcept
+    {
+        // Wait until the message thread has freed the last one we retired
+        if (retired.load() != nullptr)
+            return;
+
+        if (auto* engine = incoming.exchange(nullptr))
+        {
+            retired.store(current);
+            current = engine;
+        }
+        else if (incomingIsEmpty.exchange(false))
+        {
+            retired.store(current);
+            current = nullptr;
+        }
+    }
+
+    AudioBuffer<float> impulseResponse;
+    double impulseResponseRate = 0.0, sampleRate = 0.0;
+    bool backgroundProcessing = true;
+
+    std::atomic<Engine*> incoming { nullptr }, retired { nullptr };
+    std::atomic<bool> incomingIsEmpty { false };
+    SmoothedParameter wetLevel { SmoothedParameter::Ramp::linear, 0.3f };
+
+    // Only touched on the audio thread
+    Engine* current = nullptr;
+
+    std::atomic<uint64> lateTailBlocks { 0 }, droppedTailBlocks { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ConvolutionReverb)
+};
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "SmoothedParameter.h"
+#include <juce_dsp/juce_dsp.h>
+
+//==============================================================================
+/** An algorithmic reverb built from a 16-line feedback delay network, for when
+    convolution is too heavy.
+
+    The lines are processed as SIMD lanes (dsp::SIMDRegister), four at a time
+    with SSE or NEON. The delay memory is interleaved, one frame of all sixteen
+    lines per sample, so the new values are written as whole registers and
+    only the taps, which sit at a different distance on each line, are read
+    one at a time. Each line has a one-pole damping filter and a gain that
+    gives the same decay time whatever its length.
+
+    The feedback matrix is orthogonal, so the network neither builds up nor
+    loses energy on its own: a Hadamard transform across the registers,
+    followed by a Householder reflection within each register, which needs
+    no lane shuffles and still mixes every line into every other.
+*/
+class FdnReverb final
+{
+public:
+    static constexpr int numLines = 16;
+
+    FdnReverb() = default;
+
+    //==============================================================================
+    /** Allocates the delay lines. Call this with the audio stopped, e.g. from prepareToPlay(). */
+    void prepare(double newSampleRate)
+    {
+        sampleRate = newSampleRate;
+        wetLevel.prepare(sampleRate, 0.05);
+
+        // Roughly 20 to 100 ms at 48 kHz, with no two lengths sharing a factor
+        static constexpr int lengthsAt48k[numLines] = { 1031, 1327, 1523, 1783, 1999, 2251, 2477, 2749,
+                                                        2953, 3217, 3469, 3697, 3931, 4177, 4423, 4691 };
+        auto longest = 0;
+
+        for (int i = 0; i < numLines; ++i)
+        {
+            lengths[(size_t)i] = jmax(1, roundToInt(lengthsAt48k[i] * sampleRate / 48000.0));
+            longest = jmax(longest, lengths[(size_t)i]);
+        }
+
+        auto numFrames = (int)nextPowerOfTwo(longest + 1);
+        frameMask = numFrames - 1;
+        frames.assign((size_t)(numFrames * numRegisters), Lanes::expand(0.0f));
+
+        float inputSigns[numLines], leftSigns[numLines], rightSigns[numLines];
+
+        for (int i = 0; i < numLines; ++i)
+        {
+            inputSigns[i] = (i & 1) != 0 ? -1.0f : 1.0f;
+            leftSigns[i] = (i & 2) != 0 ? -1.0f : 1.0f;
+            rightSigns[i] = (i & 4) != 0 ? -1.0f : 1.0f;
+        }
+
+        loadLanes(inputGains, inputSigns, 1.0f / std::sqrt((float)numLines));
+        loadLanes(leftGains, leftSigns, 1.0f / std::sqrt((float)numLines));
+        loadLanes(rightGains, rightSigns, 1.0f / std::sqrt((float)numLines));
+        filterStates.fill(Lanes::expand(0.0f));
+
+        appliedDecayTime = appliedDampingHz = -1.0f;
+        updateCoefficients();
+        idle = true;
+    }
+
+    //==============================================================================
+    /** The rest can be called from any thread. */
+    void setEnabled(bool shouldBeEnabled) noexcept
+    {
+        enabled.store(shouldBeEnabled);
+        wetLevel.setTargetValue(shouldBeEnabled ? level.load() : 0.0f);
+    }
+
+    bool isEnabled() const noexcept    { return enabled.load(); }
+
+    void setWetLevel(float newLevel) noexcept
+    {
+        level.store(jlimit(0.0f, 1.0f, newLevel));
+
+        if (enabled.load())
+            wetLevel.setTargetValue(level.load());
+    }
+
+    /** The time it takes to decay by 60 dB. */
+    void setDecayTime(float seconds) noexcept       { decayTime.store(jlimit(0.1f, 30.0f, seconds)); }
+
+    /** Where the damping filters start taking the highs out of each repeat. */
+    void setDampingFrequency(float hz) noexcept     { dampingHz.store(jlimit(500.0f, 20000.0f, hz)); }
+
+    //==============================================================================
+    /** Adds the reverb to the first two channels. Call this on the audio thread. */
+    void process(AudioBuffer<float>& buffer) noexcept
+    {
+        if (frames.empty())
+            return;
+
+        // After fading out, the reverb stops costing anything until it's switched back on
+        if (!enabled.load() && !wetLevel.isSmoothing() && wetLevel.getCurrentValue() == 0.0f)
+        {
+            idle = true;
+            return;
+        }
+
+        if (idle)
+        {
+            clear();
+            idle = false;
+        }
+
+        updateCoefficients();
+
+        auto* left = buffer.getWritePointer(0);
+        auto* right = buffer.getNumChannels() > 1 ? buffer.getWritePointer(1) : nullptr;
+
+        for (int start = 0; start < buffer.getNumSamples(); start += SmoothedParameter::maxChunkSize)
+        {
+            auto numSamples = jmin(SmoothedParameter::maxChunkSize, buffer.getNumSamples() - start);
+            auto* wetGains = wetLevel.getNextValues(numSamples);
+
+            for (int i = 0; i < numSamples; ++i)
+            {
+                auto input = right != nullptr ? 0.5f * (left[start + i] + right[start + i]) : left[start + i];
+                auto wet = processSample(input);
+
+                left[start + i] += wet.first * wetGains[i];
+
+                if (right != nullptr)
+                    right[start + i] += wet.second * wetGains[i];
+            }
+        }
+    }
+
+private:
+    //==============================================================================
+    using Lanes = dsp::SIMDRegister<float>;
+
+    static constexpr int lanesPerRegister = (int)Lanes::SIMDNumElements;
+    static constexpr int numRegisters = numLines / lanesPerRegister;
+
+    static_assert(numLines % lanesPerRegister == 0 && isPowerOfTwo(numRegisters),
+                  "The lines have to fill a power-of-two number of registers");
+
+    using LaneArray = std::array<Lanes, (size_t)numRegisters>;
+
+    std::pair<float, float> processSample(float input) noexcept
+    {
+        LaneArray lines;
+
+        // The taps are the only part that can't be done a register at a time
+        auto* taps = reinterpret_cast<float*>(lines.data());
+
+        for (int i = 0; i < numLines; ++i)
+        {
+            auto frame = (writeFrame - lengths[(size_t)i]) & frameMask;
+            taps[i] = reinterpret_cast<const float*>(frames.data() + frame * numRegisters)[i];
+        }
+
+        auto leftOut = Lanes::expand(0.0f), rightOut = Lanes::expand(0.0f);
+
+        for (int r = 0; r < numRegisters; ++r)
+        {
+            // One-pole lowpass, then the line's decay gain
+            filterStates[(size_t)r] += dampingCoefficients[(size_t)r] * (lines[(size_t)r] - filterStates[(size_t)r]);
+            lines[(size_t)r] = filterStates[(size_t)r] * feedbackGains[(size_t)r];
+
+            leftOut += lines[(size_t)r] * leftGains[(size_t)r];
+            rightOut += lines[(size_t)r] * rightGains[(size_t)r];
+        }
+
+        mix(lines);
+
+        auto in = Lanes::expand(input);
+        auto* frame = frames.data() + writeFrame * numRegisters;
+
+        for (int r = 0; r < numRegisters; ++r)
+            frame[r] = lines[(size_t)r] + in * inputGains[(size_t)r];
+
+        writeFrame = (writeFrame + 1) & frameMask;
+
+        return { leftOut.sum(), rightOut.sum() };
+    }
+
+    /** An orthogonal mix of all the lines: a Householder reflection within each
+        register, then a normalised Hadamard transform across the registers.
+    */
+    static void mix(LaneArray& lines) noexcept
+    {
+        constexpr auto householderScale = 2.0f / (float)lanesPerRegister;
+
+        for (auto& r : lines)
+            r = r - Lanes::expand(householderScale * r.sum());
+
+        for (int stride = 1; stride < numRegisters; stride *= 2)
+        {
+            for (int i = 0; i < numRegisters; i += 2 * stride)
+            {
+                for (int j = i; j < i + stride; ++j)
+                {
+                    auto a = lines[(size_t)j], b = lines[(size_t)(j + stride)];
+                    lines[(size_t)j] = a + b;
+                    lines[(size_t)(j + stride)] = a - b;
+                }
+            }
+        }
+
+        if constexpr (numRegisters > 1)
+        {
+            auto norm = Lanes::expand(1.0f / std::sqrt((float)numRegisters));
+
+            for (auto& r : lines)
+                r = r * norm;
+        }
+    }
+
+    /** Only does any work when the decay time or damping has changed. */
+    void updateCoefficients() noexcept
+    {
+        auto newDecay = decayTime.load(), newDamping = dampingHz.load();
+
+        if (approximatelyEqual(newDecay, appliedDecayTime) && approximatelyEqual(newDamping, appliedDampingHz))
+            return;
+
+        appliedDecayTime = newDecay;
+        appliedDampingHz = newDamping;
+
+        float gains[numLines], coefficients[numLines];
+        auto damping = 1.0f - std::exp(-MathConstants<float>::twoPi * newDamping / (float)sampleRate);
+
+        for (int i = 0; i < numLines; ++i)
+        {
+            // -60 dB after decayTime, spread evenly over the trips round each line
+            gains[i] = std::pow(10.0f, -3.0f * (float)lengths[(size_t)i] / (newDecay * (float)sampleRate));
+            coefficients[i] = damping;
+        }
+
+        loadLanes(feedbackGains, gains, 1.0f);
+        loadLanes(dampingCoefficients, coefficients, 1.0f);
+    }
+
+    void clear() noexcept
+    {
+        std::fill(frames.begin(), frames.end(), Lanes::expand(0.0f));
+        filterStates.fill(Lanes::expand(0.0f));
+        writeFrame = 0;
+    }
+
+    static void loadLanes(LaneArray& dest, const float* values, float scale) noexcept
+    {
+        auto* lanes = reinterpret_cast<float*>(dest.data());
+
+        for (int i = 0; i < numLines; ++i)
+            lanes[i] = values[i] * scale;
+    }
+
+    //==============================================================================
+    double sampleRate = 48000.0;
+    std::array<int, numLines> lengths {};
+    std::vector<Lanes> frames;      // numRegisters per frame, one frame per sample
+    int frameMask = 0, writeFrame = 0;
+
+    LaneArray inputGains {}, leftGains {}, rightGains {}, feedbackGains {}, dampingCoefficients {}, filterStates {};
+
+    std::atomic<bool> enabled { false };
+    std::atomic<float> level { 0.3f }, decayTime { 2.5f }, dampingHz { 6000.0f };
+    SmoothedParameter wetLevel { SmoothedParameter::Ramp::linear, 0.0f };
+
+    // Only touched on the audio thread
+    float appliedDecayTime = -1.0f, appliedDampingHz = -1.0f;
+    bool idle = true;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(FdnReverb)
+};
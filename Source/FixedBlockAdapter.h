@@ -0,0 +1,147 @@
+#pragma once
+
+#include "DemoUtilities.h"
+
+//==============================================================================
+/** Lets the synth run at a fixed internal block size, whatever the device asks for.
+
+    Incoming MIDI is queued on the same timeline as the audio, and a quantum is
+    only rendered once every event that can fall inside it has arrived. The
+    rendered audio goes into a small FIFO that the device blocks are read from.
+    Starting that FIFO off with one quantum of silence means it can never run
+    dry, at the cost of exactly one quantum of extra latency.
+
+    It's prepared for a maximum number of channels, and renders as many of them
+    as the device blocks have. Any further device channels are cleared.
+*/
+class FixedBlockAdapter final
+{
+public:
+    FixedBlockAdapter() = default;
+
+    /** Call this before processing starts. Nothing gets allocated after this. */
+    void prepare(int numChannelsToUse, int maximumDeviceBlockSize, int quantumSize)
+    {
+        numChannels = jmax(1, numChannelsToUse);
+        numActiveChannels = numChannels;
+        quantum = jmax(1, quantumSize);
+
+        quantumBuffer.setSize(numChannels, quantum);
+        fifo.setSize(numChannels, jmax(1, maximumDeviceBlockSize) + 2 * quantum);
+
+        pendingMidi.ensureSize(4096);
+        spareMidi.ensureSize(4096);
+        quantumMidi.ensureSize(4096);
+
+        reset();
+    }
+
+    void reset()
+    {
+        fifo.clear();
+        pendingMidi.clear();
+        readPosition = 0;
+        numAvailable = quantum;
+        numUnrendered = 0;
+    }
+
+    /** The delay this adds between a MIDI event arriving and its audio being heard. */
+    int getLatencyInSamples() const noexcept    { return quantum; }
+    int getQuantumSize() const noexcept         { return quantum; }
+
+    //==============================================================================
+    /** Fills a device block, calling renderQuantum(AudioBuffer<float>&, const MidiBuffer&)
+        as many times as needed. The quantum buffer is cleared before each call,
+        has as many channels as the output, and the MIDI is timestamped relative
+        to the start of the quantum.
+    */
+    template <typename RenderFunction>
+    void process(AudioBuffer<float>& output, int startSample, int numSamples,
+                 const MidiBuffer& incomingMidi, RenderFunction&& renderQuantum)
+    {
+        jassert(numSamples + quantum <= fifo.getNumSamples());
+
+        // The device has been reopened with a different number of outputs
+        if (auto channelsNeeded = jlimit(1, numChannels, output.getNumChannels()); channelsNeeded != numActiveChannels)
+        {
+            numActiveChannels = channelsNeeded;
+            reset();
+        }
+
+        AudioBuffer<float> quantumView(quantumBuffer.getArrayOfWritePointers(), numActiveChannels, quantum);
+
+        pendingMidi.addEvents(incomingMidi, 0, numSamples, numUnrendered);
+        numUnrendered += numSamples;
+
+        while (numUnrendered >= quantum)
+        {
+            quantumMidi.clear();
+            quantumMidi.addEvents(pendingMidi, 0, quantum, 0);
+
+            quantumView.clear();
+            renderQuantum(quantumView, quantumMidi);
+            pushToFifo();
+
+            // Move what's left of the queue onto the next quantum's timeline
+            spareMidi.clear();
+            spareMidi.addEvents(pendingMidi, quantum, -1, -quantum);
+            pendingMidi.swapWith(spareMidi);
+
+            numUnrendered -= quantum;
+        }
+
+        popFromFifo(output, startSample, numSamples);
+    }
+
+private:
+    void pushToFifo()
+    {
+        auto size = fifo.getNumSamples();
+        auto writePosition = (readPosition + numAvailable) % size;
+        auto firstPart = jmin(quantum, size - writePosition);
+
+        for (int ch = 0; ch < numActiveChannels; ++ch)
+        {
+            fifo.copyFrom(ch, writePosition, quantumBuffer, ch, 0, firstPart);
+
+            if (firstPart < quantum)
+                fifo.copyFrom(ch, 0, quantumBuffer, ch, firstPart, quantum - firstPart);
+        }
+
+        numAvailable += quantum;
+    }
+
+    void popFromFifo(AudioBuffer<float>& output, int startSample, int numSamples)
+    {
+        jassert(numAvailable >= numSamples);
+
+        auto size = fifo.getNumSamples();
+        auto firstPart = jmin(numSamples, size - readPosition);
+
+        for (int ch = 0; ch < output.getNumChannels(); ++ch)
+        {
+            // Outputs beyond what the source renders are silent, not copies of its last channel
+            if (ch >= numActiveChannels)
+            {
+                output.clear(ch, startSample, numSamples);
+                continue;
+            }
+
+            output.copyFrom(ch, startSample, fifo, ch, readPosition, firstPart);
+
+            if (firstPart < numSamples)
+                output.copyFrom(ch, startSample + firstPart, fifo, ch, 0, numSamples - firstPart);
+        }
+
+        readPosition = (readPosition + numSamples) % size;
+        numAvailable -= numSamples;
+    }
+
+    AudioBuffer<float> quantumBuffer, fifo;
+    MidiBuffer pendingMidi, spareMidi, quantumMidi;
+
+    int numChannels = 2, numActiveChannels = 2, quantum = 64;
+    int readPosition = 0, numAvailable = 0, numUnrendered = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(FixedBlockAdapter)
+};
@@ -0,0 +1,386 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "SineTable.h"
+#include "SmoothedParameter.h"
+
+//==============================================================================
+/** An operator routing for the FmVoice, as bit masks of operator indices:
+    which operators modulate each one, and which of them are heard.
+
+    Operators are numbered from 0, and only ever modulated by ones with higher
+    numbers (the last one by nothing but its own feedback), so rendering them
+    from the last to the first always has every modulator ready in time.
+*/
+template <int modulators0, int modulators1, int modulators2, int carrierMask>
+struct FmRouting
+{
+    static_assert((modulators0 & 0b0001) == 0 && (modulators1 & 0b0011) == 0 && (modulators2 & 0b0111) == 0,
+                  "An operator can only be modulated by higher-numbered ones");
+
+    static constexpr bool modulates(int modulator, int op)
+    {
+        constexpr int masks[] = { modulators0, modulators1, modulators2, 0 };
+        return ((masks[op] >> modulator) & 1) != 0;
+    }
+
+    static constexpr bool isCarrier(int op)    { return ((carrierMask >> op) & 1) != 0; }
+};
+
+/** The eight classic four-operator algorithms. "4 > 3" below means operator 4
+    (index 3) modulates operator 3 (index 2).
+*/
+template <int algorithm> struct FmAlgorithm;
+
+template <> struct FmAlgorithm<0> : FmRouting<0b0010, 0b0100, 0b1000, 0b0001> {};   // 4 > 3 > 2 > 1
+template <> struct FmAlgorithm<1> : FmRouting<0b0010, 0b1100, 0b0000, 0b0001> {};   // (3 + 4) > 2 > 1
+template <> struct FmAlgorithm<2> : FmRouting<0b1010, 0b0100, 0b0000, 0b0001> {};   // 3 > 2 > 1, 4 > 1
+template <> struct FmAlgorithm<3> : FmRouting<0b0110, 0b0000, 0b1000, 0b0001> {};   // 4 > 3 > 1, 2 > 1
+template <> struct FmAlgorithm<4> : FmRouting<0b0010, 0b0000, 0b1000, 0b0101> {};   // 2 > 1, 4 > 3
+template <> struct FmAlgorithm<5> : FmRouting<0b1000, 0b1000, 0b1000, 0b0111> {};   // 4 > 1, 2 and 3
+template <> struct FmAlgorithm<6> : FmRouting<0b0000, 0b0000, 0b1000, 0b0111> {};   // 4 > 3, with 1 and 2
+template <> struct FmAlgorithm<7> : FmRouting<0b0000, 0b0000, 0b0000, 0b1111> {};   // all four heard
+
+//==============================================================================
+/** The sound for the FmVoice: a patch of four operators and the algorithm that
+    connects them.
+*/
+struct FmSound final : public SynthesiserSound
+{
+    static constexpr int numOperators = 4;
+    static constexpr int numAlgorithms = 8;
+
+    struct Operator
+    {
+        float ratio = 1.0f;    // to the note's frequency
+        float level = 0.0f;    // the amplitude of a carrier, or a modulator's index in radians
+        ADSR::Parameters envelope { 0.001f, 0.0f, 1.0f, 0.1f };
+    };
+
+    struct Patch
+    {
+        int algorithm = 0;
+        float feedback = 0.0f;   // of the last operator, in radians
+        std::array<Operator, numOperators> operators;
+    };
+
+    explicit FmSound(const Patch& patchToUse)
+        : patch(patchToUse)
+    {
+        jassert(isPositiveAndBelow(patch.algorithm, numAlgorithms));
+    }
+
+    bool appliesToNote(int /*midiNoteNumber*/) override    { return true; }
+    bool appliesToChannel(int /*midiChannel*/) override    { return true; }
+
+    static StringArray getPresetNames()    { return { "Electric piano", "Bell", "Bass", "Brass", "Organ" }; }
+
+    /** The patch for one of getPresetNames(). Operators are listed from the first (index 0). */
+    static Patch getPreset(int index)
+    {
+        switch (index)
+        {
+            case 0:     return { 4, 0.0f, {{ { 1.0f,  0.8f, { 0.001f, 2.0f, 0.2f, 0.5f } },
+                                             { 1.0f,  1.8f, { 0.001f, 1.0f, 0.1f, 0.5f } },
+                                             { 1.0f,  0.4f, { 0.001f, 0.8f, 0.0f, 0.3f } },
+                                             { 14.0f, 1.0f, { 0.001f, 0.15f, 0.0f, 0.1f } } }} };
+
+            case 1:     return { 5, 0.0f, {{ { 1.0f,  0.6f, { 0.001f, 4.0f, 0.0f, 4.0f } },
+                                             { 3.5f,  0.3f, { 0.001f, 2.5f, 0.0f, 2.5f } },
+                                             { 5.4f,  0.2f, { 0.001f, 1.5f, 0.0f, 1.5f } },
+                                             { 1.41f, 2.5f, { 0.001f, 3.0f, 0.0f, 3.0f } } }} };
+
+            case 2:     return { 0, 0.6f, {{ { 1.0f,  1.0f, { 0.001f, 0.8f, 0.6f, 0.1f } },
+                                             { 1.0f,  1.5f, { 0.001f, 0.3f, 0.3f, 0.1f } },
+                                             { 2.0f,  1.0f, { 0.001f, 0.2f, 0.1f, 0.1f } },
+                                             { 1.0f,  0.8f, { 0.001f, 0.1f, 0.0f, 0.1f } } }} };
+
+            case 3:     return { 1, 0.8f, {{ { 1.0f,  0.9f, { 0.05f, 0.2f, 0.8f, 0.2f } },
+                                             { 1.0f,  2.0f, { 0.08f, 0.3f, 0.6f, 0.2f } },
+                                             { 1.0f,  0.5f, { 0.1f,  0.5f, 0.5f, 0.2f } },
+                                             { 3.0f,  0.3f, { 0.01f, 0.2f, 0.2f, 0.2f } } }} };
+
+            case 4:
+            default:    return { 7, 0.3f, {{ { 0.5f,  0.35f, { 0.005f, 0.0f, 1.0f, 0.05f } },
+                                             { 1.0f,  0.35f, { 0.005f, 0.0f, 1.0f, 0.05f } },
+                                             { 2.0f,  0.25f, { 0.005f, 0.0f, 1.0f, 0.05f } },
+                                             { 3.0f,  0.2f,  { 0.005f, 0.0f, 1.0f, 0.05f } } }} };
+        }
+    }
+
+    const Patch patch;
+};
+
+//==============================================================================
+/** A four-operator FM voice.
+
+    Each algorithm is rendered by its own instantiation of renderAlgorithm(),
+    so which operator feeds which is settled at compile time and the loops
+    have no routing decisions in them; the voice picks the instantiation when
+    a note starts. An operator is rendered for the whole chunk at once, from
+    the last to the first: its phases, plus its modulators' outputs, are
+    read from the shared SineTable in one pass, then scaled by its envelope.
+
+    The phases come from one running sum of the note's (bent, vibrato'd)
+    increments per chunk, which each operator scales by its ratio with a
+    vector multiply, instead of every operator accumulating its own. Only
+    the last operator's feedback has to be worked out a sample at a time.
+*/
+class FmVoice final : public SynthesiserVoice
+{
+public:
+    static constexpr int numOperators = FmSound::numOperators;
+
+    FmVoice() = default;
+
+    bool canPlaySound(SynthesiserSound* sound) override
+    {
+        return dynamic_cast<FmSound*>(sound) != nullptr;
+    }
+
+    void startNote(int midiNoteNumber, float velocity, SynthesiserSound* sound, int currentPitchWheelPosition) override
+    {
+        auto* fmSound = dynamic_cast<FmSound*>(sound);
+
+        if (fmSound == nullptr)
+            return;
+
+        auto& patch = fmSound->patch;
+        renderFunction = getRenderFunction(patch.algorithm);
+
+        for (size_t op = 0; op < (size_t)numOperators; ++op)
+        {
+            auto& settings = patch.operators[op];
+
+            ratios[op] = settings.ratio;
+            phases[op] = 0.0f;
+
+            // Harder notes are brighter: the modulators' indices follow velocity, in cycles
+            outputGains[op] = isCarrier(patch.algorithm, (int)op)
+                                  ? settings.level
+                                  : settings.level / MathConstants<float>::twoPi * (0.5f + 0.5f * velocity);
+
+            envelopes[op].setSampleRate(getSampleRate());
+            envelopes[op].setParameters(settings.envelope);
+            envelopes[op].noteOn();
+        }
+
+        feedback = patch.feedback / MathConstants<float>::twoPi;
+        feedbackHistory = { 0.0f, 0.0f };
+        cyclesPerSample = (float)(MidiMessage::getMidiNoteInHertz(midiNoteNumber) / getSampleRate());
+        level = velocity * 0.15f;
+
+        controls.prepare(getSampleRate());
+        controls.startNote(currentPitchWheelPosition);
+    }
+
+    void stopNote(float /*velocity*/, bool allowTailOff) override
+    {
+        for (auto& envelope : envelopes)
+        {
+            if (allowTailOff)
+                envelope.noteOff();
+            else
+                envelope.reset();
+        }
+
+        if (!allowTailOff)
+            clearCurrentNote();
+    }
+
+    void pitchWheelMoved(int newValue) override                              { controls.pitchWheelMoved(newValue); }
+    void controllerMoved(int controllerNumber, int newValue) override        { controls.controllerMoved(controllerNumber, newValue); }
+
+    void renderNextBlock(AudioBuffer<float>& outputBuffer, int startSample, int numSamples) override
+    {
+        // In chunks, so the controls can hand over their smoothed values in fixed-size arrays
+        while (numSamples > 0 && isVoiceActive())
+        {
+            auto chunk = jmin(numSamples, VoiceControls::maxChunkSize);
+            auto* pitch = controls.getNextPitchMultipliers(chunk);
+            auto* gains = controls.getNextGains(chunk);
+
+            renderChunk(outputBuffer, startSample, chunk, pitch, gains);
+            startSample += chunk;
+            numSamples -= chunk;
+        }
+    }
+
+    using SynthesiserVoice::renderNextBlock;
+
+private:
+    //==============================================================================
+    using Chunk = std::array<float, VoiceControls::maxChunkSize>;
+
+    /** Renders the carriers' mix into the mix chunk, and returns false once they've all finished. */
+    using RenderFunction = bool (FmVoice::*)(int);
+
+    static RenderFunction getRenderFunction(int algorithm) noexcept
+    {
+        switch (algorithm)
+        {
+            case 0:     return &FmVoice::renderAlgorithm<0>;
+            case 1:     return &FmVoice::renderAlgorithm<1>;
+            case 2:     return &FmVoice::renderAlgorithm<2>;
+            case 3:     return &FmVoice::renderAlgorithm<3>;
+            case 4:     return &FmVoice::renderAlgorithm<4>;
+            case 5:     return &FmVoice::renderAlgorithm<5>;
+            case 6:     return &FmVoice::renderAlgorithm<6>;
+            case 7:
+            default:    return &FmVoice::renderAlgorithm<7>;
+        }
+    }
+
+    static bool isCarrier(int algorithm, int op) noexcept
+    {
+        switch (algorithm)
+        {
+            case 0:     return FmAlgorithm<0>::isCarrier(op);
+            case 1:     return FmAlgorithm<1>::isCarrier(op);
+            case 2:     return FmAlgorithm<2>::isCarrier(op);
+            case 3:     return FmAlgorithm<3>::isCarrier(op);
+            case 4:     return FmAlgorithm<4>::isCarrier(op);
+            case 5:     return FmAlgorithm<5>::isCarrier(op);
+            case 6:     return FmAlgorithm<6>::isCarrier(op);
+            case 7:
+            default:    return FmAlgorithm<7>::isCarrier(op);
+        }
+    }
+
+    void renderChunk(AudioBuffer<float>& outputBuffer, int startSample, int numSamples,
+                     const float* pitch, const float* gains)
+    {
+        // Cycles of the note so far in the chunk, before each sample, which every operator shares
+        auto* cycles = noteCycles.data();
+        auto total = 0.0f;
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            cycles[i] = total;
+            total += pitch[i] * cyclesPerSample;
+        }
+
+        auto stillPlaying = (this->*renderFunction)(numSamples);
+
+        for (size_t op = 0; op < (size_t)numOperators; ++op)
+        {
+            auto phase = phases[op] + ratios[op] * total;
+            phases[op] = phase - std::floor(phase);
+        }
+
+        auto* mono = mix.data();
+        FloatVectorOperations::multiply(mono, gains, numSamples);
+        FloatVectorOperations::multiply(mono, level, numSamples);
+
+        for (auto ch = outputBuffer.getNumChannels(); --ch >= 0;)
+            FloatVectorOperations::add(outputBuffer.getWritePointer(ch, startSample), mono, numSamples);
+
+        if (!stillPlaying)
+            clearCurrentNote();
+    }
+
+    template <int algorithm>
+    bool renderAlgorithm(int numSamples) noexcept
+    {
+        using Algorithm = FmAlgorithm<algorithm>;
+
+        renderFeedbackOperator(numSamples);
+        renderOperator<Algorithm, 2>(numSamples);
+        renderOperator<Algorithm, 1>(numSamples);
+        renderOperator<Algorithm, 0>(numSamples);
+
+        FloatVectorOperations::clear(mix.data(), numSamples);
+        return mixCarrier<Algorithm, 0>(numSamples) | mixCarrier<Algorithm, 1>(numSamples)
+             | mixCarrier<Algorithm, 2>(numSamples) | mixCarrier<Algorithm, 3>(numSamples);
+    }
+
+    template <typename Algorithm, int op>
+    void renderOperator(int numSamples) noexcept
+    {
+        auto* phase = operatorPhases.data();
+        FloatVectorOperations::copyWithMultiply(phase, noteCycles.data(), ratios[(size_t)op], numSamples);
+        FloatVectorOperations::add(phase, phases[(size_t)op], numSamples);
+        addModulation<Algorithm, op, op + 1>(phase, numSamples);
+
+        auto* output = outputs[(size_t)op].data();
+        SineTable::get().process(phase, output, numSamples);
+        applyEnvelope(op, output, numSamples);
+    }
+
+    template <typename Algorithm, int op, int modulator>
+    void addModulation(float* phase, int numSamples) const noexcept
+    {
+        if constexpr (modulator < numOperators)
+        {
+            if constexpr (Algorithm::modulates(modulator, op))
+                FloatVectorOperations::add(phase, outputs[(size_t)modulator].data(), numSamples);
+
+            addModulation<Algorithm, op, modulator + 1>(phase, numSamples);
+        }
+    }
+
+    /** The last operator modulates itself with the average of its last two
+        outputs, which tames the noise full feedback would otherwise turn into.
+    */
+    void renderFeedbackOperator(int numSamples) noexcept
+    {
+        constexpr size_t op = numOperators - 1;
+
+        auto* output = outputs[op].data();
+        auto* envelope = envelopeValues.data();
+        auto& table = SineTable::get();
+
+        for (int i = 0; i < numSamples; ++i)
+            envelope[i] = envelopes[op].getNextSample();
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto phase = phases[op] + ratios[op] * noteCycles[(size_t)i]
+                       + feedback * (feedbackHistory[0] + feedbackHistory[1]) * 0.5f;
+            auto sample = table.lookup(phase) * envelope[i];
+
+            feedbackHistory[1] = feedbackHistory[0];
+            feedbackHistory[0] = sample;
+            output[i] = sample * outputGains[op];
+        }
+    }
+
+    void applyEnvelope(int op, float* output, int numSamples) noexcept
+    {
+        auto* envelope = envelopeValues.data();
+
+        for (int i = 0; i < numSamples; ++i)
+            envelope[i] = envelopes[(size_t)op].getNextSample();
+
+        FloatVectorOperations::multiply(output, envelope, numSamples);
+        FloatVectorOperations::multiply(output, outputGains[(size_t)op], numSamples);
+    }
+
+    template <typename Algorithm, int op>
+    bool mixCarrier(int numSamples) noexcept
+    {
+        if constexpr (Algorithm::isCarrier(op))
+        {
+            FloatVectorOperations::add(mix.data(), outputs[(size_t)op].data(), numSamples);
+            return envelopes[(size_t)op].isActive();
+        }
+        else
+        {
+            ignoreUnused(numSamples);
+            return false;
+        }
+    }
+
+    //==============================================================================
+    RenderFunction renderFunction = &FmVoice::renderAlgorithm<0>;
+
+    std::array<float, numOperators> ratios {}, phases {}, outputGains {};   // phases in cycles, at the chunk's start
+    std::array<ADSR, numOperators> envelopes;
+    std::array<Chunk, numOperators> outputs {};
+    Chunk noteCycles {}, operatorPhases {}, envelopeValues {}, mix {};
+    std::array<float, 2> feedbackHistory {};
+    float feedback = 0.0f, cyclesPerSample = 0.0f, level = 0.0f;
+    VoiceControls controls;
+
+    JUCE_LEAK_DETECTOR(FmVoice)
+};
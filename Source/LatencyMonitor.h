@@ -0,0 +1,207 @@
+#pragma once
+
+#include "DemoUtilities.h"
+
+//==============================================================================
+/** Measures how long it takes from a note-on arriving from a MIDI device to the
+    first non-zero sample of the voice it starts being handed to the device.
+
+    The MidiEventQueue reports each note-on's arrival time, the engine picks it
+    up when it starts a voice, and tells us at which sample of the current
+    quantum that voice first made a sound. Knowing when the current device block
+    was requested, and how far the FixedBlockAdapter delays the rendered quanta,
+    turns that sample position into a time. The device's own output latency
+    comes on top of the figures recorded here.
+
+    Recording is lock-free and may happen on any of the rendering threads.
+*/
+class LatencyMonitor final
+{
+public:
+    struct Statistics
+    {
+        int count = 0;
+        double minMs = 0.0, maxMs = 0.0, meanMs = 0.0;
+        double p50Ms = 0.0, p95Ms = 0.0, p99Ms = 0.0;
+    };
+
+    LatencyMonitor()
+    {
+        reset();
+    }
+
+    /** Call this from prepareToPlay(), with the latency of the block adapter. */
+    void prepare(double newSampleRate, int adapterLatencySamples)
+    {
+        sampleRate = newSampleRate;
+        adapterLatency = adapterLatencySamples;
+
+        devicePosition = 0;
+        blockStartPosition = 0;
+        internalPosition = 0;
+        quantumStartPosition = 0;
+
+        for (auto& channel : arrivalTimes)
+            std::fill(channel.begin(), channel.end(), 0.0);
+    }
+
+    //==============================================================================
+    // These are called on the audio thread, in this order.
+
+    /** The device has asked for a block. callbackTime is on the getMillisecondCounterHiRes() clock, in seconds. */
+    void beginDeviceBlock(double callbackTime, int numSamples) noexcept
+    {
+        blockStartTime = callbackTime;
+        blockStartPosition = devicePosition;
+        devicePosition += numSamples;
+    }
+
+    /** A note-on has come out of the MIDI queue. */
+    void noteQueued(int midiChannel, int midiNoteNumber, double arrivalTime) noexcept
+    {
+        if (isPositiveAndBelow(midiChannel - 1, 16) && isPositiveAndBelow(midiNoteNumber, 128))
+            arrivalTimes[(size_t)midiChannel - 1][(size_t)midiNoteNumber] = arrivalTime;
+    }
+
+    /** The engine is about to render a quantum. */
+    void beginQuantum(int numSamples) noexcept
+    {
+        quantumStartPosition = internalPosition;
+        internalPosition += numSamples;
+    }
+
+    /** The engine is starting a voice for this note. Returns 0 if the note didn't
+        come from a MIDI device (e.g. the on-screen keyboard).
+    */
+    double takeArrivalTime(int midiChannel, int midiNoteNumber) noexcept
+    {
+        if (!isPositiveAndBelow(midiChannel - 1, 16) || !isPositiveAndBelow(midiNoteNumber, 128))
+            return 0.0;
+
+        auto& slot = arrivalTimes[(size_t)midiChannel - 1][(size_t)midiNoteNumber];
+        auto arrivalTime = slot;
+        slot = 0.0;
+        return arrivalTime;
+    }
+
+    /** A voice produced its first non-zero sample at this offset into the current quantum. */
+    void voiceSounded(double arrivalTime, int offsetInQuantum) noexcept
+    {
+        auto outputPosition = quantumStartPosition + offsetInQuantum + adapterLatency;
+        auto outputTime = blockStartTime + (double)(outputPosition - blockStartPosition) / sampleRate;
+
+        record((outputTime - arrivalTime) * 1000.0);
+    }
+
+    //==============================================================================
+    void record(double latencyMs) noexcept
+    {
+        auto micros = (int64)jmax(0.0, latencyMs * 1000.0);
+        auto bin = (size_t)jmin((int64)numBins, micros / binWidthMicros);
+
+        bins[bin].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sumMicros.fetch_add(micros, std::memory_order_relaxed);
+
+        auto currentMin = minMicros.load(std::memory_order_relaxed);
+        while (micros < currentMin && !minMicros.compare_exchange_weak(currentMin, micros, std::memory_order_relaxed)) {}
+
+        auto currentMax = maxMicros.load(std::memory_order_relaxed);
+        while (micros > currentMax && !maxMicros.compare_exchange_weak(currentMax, micros, std::memory_order_relaxed)) {}
+    }
+
+    void reset() noexcept
+    {
+        for (auto& bin : bins)
+            bin.store(0, std::memory_order_relaxed);
+
+        count.store(0);
+        sumMicros.store(0);
+        minMicros.store(std::numeric_limits<int64>::max());
+        maxMicros.store(0);
+    }
+
+    Statistics getStatistics() const
+    {
+        Statistics stats;
+        stats.count = (int)count.load();
+
+        if (stats.count == 0)
+            return stats;
+
+        stats.minMs = (double)minMicros.load() * 0.001;
+        stats.maxMs = (double)maxMicros.load() * 0.001;
+        stats.meanMs = (double)sumMicros.load() * 0.001 / stats.count;
+        stats.p50Ms = getPercentile(0.50);
+        stats.p95Ms = getPercentile(0.95);
+        stats.p99Ms = getPercentile(0.99);
+        return stats;
+    }
+
+    //==============================================================================
+    String getSummary() const
+    {
+        auto stats = getStatistics();
+
+        if (stats.count == 0)
+            return "MIDI to audio: no notes measured yet";
+
+        return "MIDI to audio: " + String(stats.meanMs, 2) + " ms mean, " + String(stats.p95Ms, 2) + " ms p95, "
+                 + String(stats.maxMs, 2) + " ms max (" + String(stats.count) + " notes)";
+    }
+
+    /** Writes the statistics and the non-empty histogram bins as plain text. */
+    bool writeReport(const File& file) const
+    {
+        auto stats = getStatistics();
+
+        String report;
+        report << "# MIDI note-on to first non-zero output sample, excluding the device's output latency\n"
+               << "notes " << stats.count << "\n"
+               << "min_ms " << String(stats.minMs, 3) << "\n"
+               << "mean_ms " << String(stats.meanMs, 3) << "\n"
+               << "p50_ms " << String(stats.p50Ms, 3) << "\n"
+               << "p95_ms " << String(stats.p95Ms, 3) << "\n"
+               << "p99_ms " << String(stats.p99Ms, 3) << "\n"
+               << "max_ms " << String(stats.maxMs, 3) << "\n"
+               << "# bin_start_ms count\n";
+
+        for (size_t i = 0; i < bins.size(); ++i)
+            if (auto n = bins[i].load())
+                report << String((double)((int64)i * binWidthMicros) * 0.001, 1) << (i == numBins ? "+ " : " ") << (int)n << "\n";
+
+        return file.replaceWithText(report);
+    }
+
+private:
+    double getPercentile(double fraction) const
+    {
+        auto target = (uint32)std::ceil(fraction * (double)count.load());
+        uint32 seen = 0;
+
+        for (size_t i = 0; i < bins.size(); ++i)
+        {
+            seen += bins[i].load();
+
+            if (seen >= target)
+                return (double)((int64)(i + 1) * binWidthMicros) * 0.001;
+        }
+
+        return (double)maxMicros.load() * 0.001;
+    }
+
+    static constexpr int64 binWidthMicros = 100;
+    static constexpr size_t numBins = 1000; // 0 - 100 ms, plus one bin for anything longer
+
+    std::array<std::atomic<uint32>, numBins + 1> bins;
+    std::atomic<uint32> count { 0 };
+    std::atomic<int64> sumMicros { 0 }, minMicros { 0 }, maxMicros { 0 };
+
+    // Only touched on the audio thread, or read by the workers during a parallel run
+    std::array<std::array<double, 128>, 16> arrivalTimes {};
+    double sampleRate = 44100.0, blockStartTime = 0.0;
+    int adapterLatency = 0;
+    int64 devicePosition = 0, blockStartPosition = 0, internalPosition = 0, quantumStartPosition = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(LatencyMonitor)
+};
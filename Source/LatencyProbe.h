@@ -0,0 +1,200 @@
+#pragma once
+
+#include "AudioSynthesiserDemo.h"
+#include "CommandLineOptions.h"
+#include <iostream>
+
+//==============================================================================
+/** Measures MIDI-to-audio latency without anyone at the keyboard, for automated runs.
+
+    Start the app with:
+
+        --measure-latency [seconds] [--stats-file=<path>] [--block-size=<n>] [--audio-device]
+
+    A loopback thread stands in for a MIDI device, pushing timestamped note-ons
+    into the synth's MidiEventQueue at irregular intervals, exactly like a
+    MidiInput callback would. Audio is pulled either by a simulated device
+    thread that keeps real-time pace, or with --audio-device by the default
+    output device, if one can be opened. The statistics are printed and written
+    to the stats file. The exit code is non-zero if no note was measured.
+*/
+class LatencyProbe final
+{
+public:
+    static int run(const String& commandLine)
+    {
+        auto args = StringArray::fromTokens(commandLine, true);
+
+        auto seconds = CommandLineOptions::get(args, "--measure-latency", "10").getDoubleValue();
+        auto blockSize = jlimit(16, 4096, CommandLineOptions::get(args, "--block-size=", "256").getIntValue());
+        auto statsFile = File::getCurrentWorkingDirectory().getChildFile(CommandLineOptions::get(args, "--stats-file=", "latency-stats.txt"));
+        auto useAudioDevice = args.contains("--audio-device");
+
+        if (seconds <= 0.0)
+            seconds = 10.0;
+
+        MidiKeyboardState keyboardState;
+        FFTAnalyzer fftAnalyzer;
+        SynthAudioSource source(keyboardState, fftAnalyzer);
+        LoopbackMidiSource loopback(source.midiQueue);
+
+        AudioDeviceManager deviceManager;
+        AudioSourcePlayer player;
+        std::unique_ptr<SimulatedDevice> simulatedDevice;
+        int deviceLatency = 0;
+
+        if (useAudioDevice && openAudioDevice(deviceManager, blockSize))
+        {
+            auto* device = deviceManager.getCurrentAudioDevice();
+            deviceLatency = device->getOutputLatencyInSamples();
+
+            std::cout << "Using " << device->getName() << " at " << device->getCurrentSampleRate() << " Hz, "
+                      << device->getCurrentBufferSizeSamples() << " samples per block" << std::endl;
+
+            player.setSource(&source);
+            deviceManager.addAudioCallback(&player);
+        }
+        else
+        {
+            if (useAudioDevice)
+                std::cout << "No audio device could be opened, falling back to the simulated one" << std::endl;
+
+            std::cout << "Using a simulated device at 48000 Hz, " << blockSize << " samples per block" << std::endl;
+
+            simulatedDevice = std::make_unique<SimulatedDevice>(source, blockSize, 48000.0);
+            simulatedDevice->startThread(Thread::Priority::highest);
+        }
+
+        // Let the device settle before the first note goes in
+        Thread::sleep(200);
+        source.latencyMonitor.reset();
+
+        loopback.startThread(Thread::Priority::high);
+        Thread::sleep(roundToInt(seconds * 1000.0));
+        loopback.stopThread(1000);
+
+        if (simulatedDevice != nullptr)
+            simulatedDevice->stopThread(1000);
+
+        deviceManager.removeAudioCallback(&player);
+        player.setSource(nullptr);
+        deviceManager.closeAudioDevice();
+
+        std::cout << source.latencyMonitor.getSummary() << std::endl;
+
+        if (deviceLatency > 0)
+            std::cout << "(plus " << deviceLatency << " samples of device output latency)" << std::endl;
+
+        if (source.latencyMonitor.writeReport(statsFile))
+            std::cout << "Statistics written to " << statsFile.getFullPathName() << std::endl;
+        else
+            std::cout << "Couldn't write " << statsFile.getFullPathName() << std::endl;
+
+        return source.latencyMonitor.getStatistics().count > 0 ? 0 : 1;
+    }
+
+private:
+    //==============================================================================
+    /** Calls the audio source from a thread at the pace a real device would. */
+    struct SimulatedDevice final : public Thread
+    {
+        SimulatedDevice(AudioSource& sourceIn, int blockSizeIn, double sampleRateIn)
+            : Thread("Simulated audio device"), source(sourceIn), blockSize(blockSizeIn), sampleRate(sampleRateIn)
+        {
+            source.prepareToPlay(blockSize, sampleRate);
+        }
+
+        ~SimulatedDevice() override
+        {
+            stopThread(1000);
+            source.releaseResources();
+        }
+
+        void run() override
+        {
+            AudioBuffer<float> buffer(2, blockSize);
+            auto blockMs = 1000.0 * blockSize / sampleRate;
+            auto nextCallback = Time::getMillisecondCounterHiRes() + blockMs;
+
+            while (!threadShouldExit())
+            {
+                waitUntil(nextCallback);
+
+                AudioSourceChannelInfo info(&buffer, 0, blockSize);
+                source.getNextAudioBlock(info);
+
+                nextCallback += blockMs;
+
+                // Like an xrun: give up on the blocks we've missed
+                if (Time::getMillisecondCounterHiRes() > nextCallback + blockMs * 4.0)
+                    nextCallback = Time::getMillisecondCounterHiRes() + blockMs;
+            }
+        }
+
+        static void waitUntil(double targetMs)
+        {
+            for (;;)
+            {
+                auto remaining = targetMs - Time::getMillisecondCounterHiRes();
+
+                if (remaining <= 0.0)
+                    return;
+
+                if (remaining > 2.0)
+                    Thread::sleep(1);
+                else
+                    Thread::yield();
+            }
+        }
+
+        AudioSource& source;
+        const int blockSize;
+        const double sampleRate;
+    };
+
+    //==============================================================================
+    /** Stands in for a MIDI device, playing short notes at irregular intervals. */
+    struct LoopbackMidiSource final : public Thread
+    {
+        explicit LoopbackMidiSource(MidiEventQueue& queueIn)
+            : Thread("Loopback MIDI source"), queue(queueIn)
+        {
+        }
+
+        void run() override
+        {
+            Random random(1234);
+
+            while (!threadShouldExit())
+            {
+                auto note = 48 + random.nextInt(36);
+
+                send(MidiMessage::noteOn(1, note, (uint8)(40 + random.nextInt(80))));
+                wait(30 + random.nextInt(40));
+                send(MidiMessage::noteOff(1, note));
+                wait(10 + random.nextInt(80));
+            }
+        }
+
+        void send(MidiMessage message)
+        {
+            message.setTimeStamp(Time::getMillisecondCounterHiRes() * 0.001);
+            queue.push(message);
+        }
+
+        MidiEventQueue& queue;
+    };
+
+    //==============================================================================
+    static bool openAudioDevice(AudioDeviceManager& deviceManager, int blockSize)
+    {
+        if (deviceManager.initialise(0, 2, nullptr, true).isNotEmpty())
+            return false;
+
+        auto setup = deviceManager.getAudioDeviceSetup();
+        setup.bufferSize = blockSize;
+        deviceManager.setAudioDeviceSetup(setup, true);
+
+        return deviceManager.getCurrentAudioDevice() != nullptr;
+    }
+};
@@ -8,6 +8,9 @@
 
 #include <JuceHeader.h>
 #include "AudioSynthesiserDemo.h"
+#include "SynthBenchmarks.h"
+#include "LatencyProbe.h"
+#include "SessionReplay.h"
 
 class Application    : public juce::JUCEApplication
 {
@@ -18,8 +21,29 @@ public:
     const juce::String getApplicationName() override       { return "AudioSynthesiserDemo"; }
     const juce::String getApplicationVersion() override    { return "1.0.0"; }
 
-    void initialise (const juce::String&) override
+    void initialise (const juce::String& commandLine) override
     {
+        if (commandLine.contains ("--benchmark"))
+        {
+            setApplicationReturnValue (SynthBenchmarks::run (commandLine));
+            quit();
+            return;
+        }
+
+        if (commandLine.contains ("--measure-latency"))
+        {
+            setApplicationReturnValue (LatencyProbe::run (commandLine));
+            quit();
+            return;
+        }
+
+        if (commandLine.contains ("--replay"))
+        {
+            setApplicationReturnValue (SessionReplay::run (commandLine));
+            quit();
+            return;
+        }
+
         mainWindow.reset (new MainWindow ("AudioSynthesiserDemo", new AudioSynthesiserDemo(), *this));    }
 
     void shutdown() override                         { mainWindow = nullptr; }
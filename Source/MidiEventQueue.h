@@ -0,0 +1,174 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "LatencyMonitor.h"
+
+//==============================================================================
+/** A wait-free replacement for MidiMessageCollector.
+
+    The MIDI input thread pushes events, together with their device timestamps,
+    into a single-producer/single-consumer FIFO, and the audio thread pulls out
+    a block's worth at a time. Neither side ever takes a lock.
+
+    Instead of stamping everything that has arrived since the last callback onto
+    the start of the block, each audio block is matched to a window of wall-clock
+    time exactly one block long, ending at the (smoothed) time of the callback
+    that renders it. An event's offset within the block is then its position
+    within that window. Every event is delayed by the same single block, and
+    callback jitter only moves the window slightly rather than squashing
+    events together.
+*/
+class MidiEventQueue final : public MidiInputCallback
+{
+public:
+    MidiEventQueue() = default;
+
+    /** Call this from prepareToPlay(). */
+    void prepare(double newSampleRate)
+    {
+        jassert(newSampleRate > 0.0);
+
+        sampleRate = newSampleRate;
+        windowStart = 0.0;
+        hasWindow = false;
+    }
+
+    //==============================================================================
+    /** Queues a message. Wait-free, so it's fine to call from any one producer thread.
+        The message must be timestamped in seconds on the Time::getMillisecondCounterHiRes()
+        clock, as MidiInput does. Messages longer than three bytes (i.e. sysex) aren't queued.
+    */
+    bool push(const MidiMessage& message) noexcept
+    {
+        auto numBytes = message.getRawDataSize();
+
+        if (numBytes > 3 || numBytes <= 0)
+            return false;
+
+        int start1, size1, start2, size2;
+        fifo.prepareToWrite(1, start1, size1, start2, size2);
+
+        if (size1 + size2 == 0)
+        {
+            numDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        auto& event = events[(size_t)(size1 > 0 ? start1 : start2)];
+        event.timestamp = message.getTimeStamp();
+        event.numBytes = (uint8)numBytes;
+        std::memcpy(event.bytes, message.getRawData(), (size_t)numBytes);
+
+        fifo.finishedWrite(1);
+        return true;
+    }
+
+    void handleIncomingMidiMessage(MidiInput*, const MidiMessage& message) override
+    {
+        push(message);
+    }
+
+    //==============================================================================
+    /** Moves the events that fall inside the next block into a MidiBuffer, with
+        sample-accurate offsets. Call this once per audio callback.
+    */
+    void popBlock(MidiBuffer& destination, int numSamples)
+    {
+        popBlock(destination, numSamples, Time::getMillisecondCounterHiRes() * 0.001);
+    }
+
+    /** As above, but with the callback time given explicitly, in seconds on the
+        Time::getMillisecondCounterHiRes() clock.
+    */
+    void popBlock(MidiBuffer& destination, int numSamples, double callbackTime)
+    {
+        destination.clear();
+
+        if (numSamples <= 0)
+            return;
+
+        auto blockDuration = numSamples / sampleRate;
+        auto observedStart = callbackTime - blockDuration;
+        auto error = observedStart - windowStart;
+
+        // Follow the callbacks closely enough to track clock drift, but not their jitter.
+        // After a dropout or a stall, just jump to where we are now.
+        if (!hasWindow || std::abs(error) > blockDuration * 2.0)
+            windowStart = observedStart;
+        else
+            windowStart += error * smoothing;
+
+        hasWindow = true;
+        auto windowEnd = windowStart + blockDuration;
+
+        int start1, size1, start2, size2;
+        fifo.prepareToRead(fifo.getNumReady(), start1, size1, start2, size2);
+
+        auto numRead = takeEvents(destination, start1, size1, numSamples);
+
+        if (numRead == size1)
+            numRead += takeEvents(destination, start2, size2, numSamples);
+
+        fifo.finishedRead(numRead);
+        windowStart = windowEnd;
+    }
+
+    /** Note-ons will report their arrival times to this monitor. */
+    void setLatencyMonitor(LatencyMonitor* monitorToUse) noexcept    { latencyMonitor = monitorToUse; }
+
+    /** How late every event is heard, compared to when it was played. */
+    int getLatencyInSamples(int blockSize) const noexcept    { return blockSize; }
+
+    int getNumDropped() const noexcept    { return numDropped.load(std::memory_order_relaxed); }
+
+private:
+    struct Event
+    {
+        double timestamp = 0.0;
+        uint8 bytes[3] = {};
+        uint8 numBytes = 0;
+    };
+
+    /** Copies events until one turns up that belongs to a later block, and returns how many it took. */
+    int takeEvents(MidiBuffer& destination, int start, int size, int numSamples)
+    {
+        auto windowEnd = windowStart + numSamples / sampleRate;
+
+        for (int i = 0; i < size; ++i)
+        {
+            auto& event = events[(size_t)(start + i)];
+
+            if (event.timestamp >= windowEnd)
+                return i;
+
+            // Events left over from before the stream was (re)started are dropped
+            if (event.timestamp < windowStart - staleAfterSeconds)
+                continue;
+
+            // Anything that was late for its own window goes at the very start
+            auto offset = jlimit(0, numSamples - 1, roundToInt((event.timestamp - windowStart) * sampleRate));
+            destination.addEvent(event.bytes, event.numBytes, offset);
+
+            if (latencyMonitor != nullptr && (event.bytes[0] & 0xf0) == 0x90 && event.numBytes == 3 && event.bytes[2] != 0)
+                latencyMonitor->noteQueued((event.bytes[0] & 0x0f) + 1, event.bytes[1], event.timestamp);
+        }
+
+        return size;
+    }
+
+    static constexpr int capacity = 1024;
+    static constexpr double smoothing = 0.05;
+    static constexpr double staleAfterSeconds = 0.5;
+
+    AbstractFifo fifo { capacity };
+    std::array<Event, capacity> events;
+
+    LatencyMonitor* latencyMonitor = nullptr;
+    double sampleRate = 44100.0;
+    double windowStart = 0.0;
+    bool hasWindow = false;
+
+    std::atomic<int> numDropped { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MidiEventQueue)
+};
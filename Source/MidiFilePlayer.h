@@ -0,0 +1,268 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include <numeric>
+
+//==============================================================================
+/** Plays a Standard MIDI File into the synth, with sample-accurate timing.
+
+    All the parsing happens in load(): the tracks are flattened into a single
+    time-sorted array, and each event's sample position is worked out from the
+    file's tempo map up front. On the audio thread, each block is just a
+    binary search for its first event followed by a linear copy, with no
+    allocation and no state that could go stale. Seeking therefore only has to
+    move the play position.
+
+    A newly loaded sequence is handed to the audio thread through an atomic
+    pointer, and the one it replaces is handed back the same way, so that it's
+    freed on the message thread.
+*/
+class MidiFilePlayer final
+{
+public:
+    MidiFilePlayer() = default;
+
+    ~MidiFilePlayer()
+    {
+        delete incoming.exchange(nullptr);
+        delete retired.exchange(nullptr);
+        delete current;
+    }
+
+    //==============================================================================
+    /** Parses a MIDI file and queues it for playback. Call this on the message thread. */
+    bool load(const File& file)
+    {
+        collectGarbage();
+
+        FileInputStream in(file);
+        MidiFile midiFile;
+
+        if (!in.openedOk() || !midiFile.readFrom(in))
+            return false;
+
+        midiFile.convertTimestampTicksToSeconds();
+
+        auto sequence = std::make_unique<Sequence>();
+
+        for (int t = 0; t < midiFile.getNumTracks(); ++t)
+        {
+            for (auto* holder : *midiFile.getTrack(t))
+            {
+                auto& message = holder->message;
+                auto size = message.getRawDataSize();
+
+                // The synth has no use for meta events and sysex
+                if (message.isMetaEvent() || message.isSysEx() || size > 3 || size <= 0)
+                    continue;
+
+                Event event;
+                std::memcpy(event.bytes, message.getRawData(), (size_t)size);
+                event.numBytes = (uint8)size;
+
+                sequence->seconds.push_back(message.getTimeStamp());
+                sequence->events.push_back(event);
+            }
+        }
+
+        if (sequence->events.empty())
+            return false;
+
+        sequence->sortByTime();
+        sequence->updatePositions(sampleRate.load());
+        lengthInSeconds.store(sequence->seconds.back());
+
+        delete incoming.exchange(sequence.release());
+        seek(0.0);
+        return true;
+    }
+
+    /** Frees a sequence that the audio thread has finished with. Call this on the message thread. */
+    void collectGarbage()
+    {
+        delete retired.exchange(nullptr);
+    }
+
+    //==============================================================================
+    void play() noexcept                        { playing.store(true); }
+    void stop() noexcept                        { playing.store(false); }
+    bool isPlaying() const noexcept             { return playing.load(); }
+
+    /** Jumps to a new position at the start of the next block, silencing any
+        notes left hanging. Every jump cuts off what's playing, so a position
+        slider should only call this once the user lets go of it.
+    */
+    void seek(double seconds) noexcept
+    {
+        seconds = jmax(0.0, seconds);
+        seekRequest.store(seconds);
+
+        // So the position reads back at once, even while it's stopped and no blocks move it
+        positionInSeconds.store(seconds);
+    }
+
+    /** True if a seek hasn't been picked up by the audio thread yet. */
+    bool isSeekPending() const noexcept         { return seekRequest.load() >= 0.0; }
+
+    void setLooping(bool shouldLoop) noexcept   { looping.store(shouldLoop); }
+
+    double getLengthInSeconds() const noexcept      { return lengthInSeconds.load(); }
+    double getPositionInSeconds() const noexcept    { return positionInSeconds.load(); }
+
+    //==============================================================================
+    void prepare(double newSampleRate)
+    {
+        sampleRate.store(newSampleRate);
+
+        if (current != nullptr)
+        {
+            current->updatePositions(newSampleRate);
+            playPosition = secondsToSamples(positionInSeconds.load());
+        }
+    }
+
+    /** Adds this block's events to the buffer. Call this on the audio thread. */
+    void renderNextBlock(MidiBuffer& destination, int numSamples)
+    {
+        takeNewSequence();
+
+        auto seekTo = seekRequest.exchange(-1.0);
+
+        if (seekTo >= 0.0)
+        {
+            playPosition = secondsToSamples(seekTo);
+            positionInSeconds.store(seekTo);
+            silenceHangingNotes(destination);
+        }
+
+        auto isPlayingNow = playing.load();
+
+        if (wasPlaying && !isPlayingNow)
+            silenceHangingNotes(destination);
+
+        wasPlaying = isPlayingNow;
+
+        if (!isPlayingNow || current == nullptr || current->events.empty())
+            return;
+
+        auto& positions = current->positions;
+        auto blockStart = playPosition;
+        auto blockEnd = blockStart + numSamples;
+
+        auto index = (size_t)std::distance(positions.begin(), std::lower_bound(positions.begin(), positions.end(), blockStart));
+
+        for (; index < positions.size() && positions[index] < blockEnd; ++index)
+        {
+            auto& event = current->events[index];
+            destination.addEvent(event.bytes, event.numBytes, (int)(positions[index] - blockStart));
+        }
+
+        playPosition = blockEnd;
+
+        if (playPosition > positions.back())
+        {
+            silenceHangingNotes(destination);
+
+            if (looping.load())
+                playPosition = 0;
+            else
+                playing.store(false);
+        }
+
+        positionInSeconds.store((double)playPosition / sampleRate.load());
+    }
+
+private:
+    //==============================================================================
+    struct Event
+    {
+        uint8 bytes[3] = {};
+        uint8 numBytes = 0;
+    };
+
+    /** Sample positions and events are kept in separate arrays, so the binary
+        search only touches the positions.
+    */
+    struct Sequence
+    {
+        std::vector<double> seconds;
+        std::vector<int64> positions;
+        std::vector<Event> events;
+        double sampleRate = 0.0;
+
+        void sortByTime()
+        {
+            std::vector<size_t> order(seconds.size());
+            std::iota(order.begin(), order.end(), (size_t)0);
+
+            // Stable, so that events at the same time keep their order within a track
+            std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) { return seconds[a] < seconds[b]; });
+
+            std::vector<double> sortedSeconds;
+            std::vector<Event> sortedEvents;
+            sortedSeconds.reserve(order.size());
+            sortedEvents.reserve(order.size());
+
+            for (auto i : order)
+            {
+                sortedSeconds.push_back(seconds[i]);
+                sortedEvents.push_back(events[i]);
+            }
+
+            seconds = std::move(sortedSeconds);
+            events = std::move(sortedEvents);
+            positions.resize(seconds.size());
+        }
+
+        /** Doesn't allocate, so it's safe to call on the audio thread. */
+        void updatePositions(double newSampleRate) noexcept
+        {
+            sampleRate = newSampleRate;
+
+            for (size_t i = 0; i < seconds.size(); ++i)
+                positions[i] = (int64)std::llround(seconds[i] * newSampleRate);
+        }
+    };
+
+    void takeNewSequence()
+    {
+        // Wait until the message thread has freed the last one we retired
+        if (retired.load() != nullptr)
+            return;
+
+        if (auto* sequence = incoming.exchange(nullptr))
+        {
+            if (!approximatelyEqual(sequence->sampleRate, sampleRate.load()))
+                sequence->updatePositions(sampleRate.load());
+
+            retired.store(current);
+            current = sequence;
+        }
+    }
+
+    void silenceHangingNotes(MidiBuffer& destination)
+    {
+        for (int channel = 1; channel <= 16; ++channel)
+        {
+            destination.addEvent(MidiMessage::allNotesOff(channel), 0);
+            destination.addEvent(MidiMessage::controllerEvent(channel, 64, 0), 0); // sustain pedal up
+        }
+    }
+
+    int64 secondsToSamples(double seconds) const noexcept
+    {
+        return (int64)std::llround(seconds * sampleRate.load());
+    }
+
+    std::atomic<Sequence*> incoming { nullptr }, retired { nullptr };
+    std::atomic<double> sampleRate { 44100.0 }, seekRequest { -1.0 };
+    std::atomic<double> lengthInSeconds { 0.0 }, positionInSeconds { 0.0 };
+    std::atomic<bool> playing { false }, looping { false };
+
+    // Only touched on the audio thread
+    Sequence* current = nullptr;
+    int64 playPosition = 0;
+    bool wasPlaying = false;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MidiFilePlayer)
+};
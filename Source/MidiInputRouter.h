@@ -0,0 +1,255 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "MidiEventQueue.h"
+
+//==============================================================================
+/** Merges any number of MIDI input devices into one stream for the audio thread.
+
+    Every enabled device gets its own callback object and its own wait-free
+    MidiEventQueue, so each producer stays single-threaded and no two devices
+    ever contend. On the audio thread the queues are emptied one after another
+    into the same MidiBuffer, which keeps its events sorted, so the result is a
+    single timestamp-ordered stream. Each device can have all of its channel
+    messages moved onto one channel before they're queued.
+
+    The device slots are allocated up front and never freed. A slot is only
+    rebound to another device after its callback has been removed from the
+    AudioDeviceManager, so the MIDI threads never see it change.
+*/
+class MidiInputRouter final
+{
+public:
+    static constexpr int maxDevices = 16;
+
+    MidiInputRouter()
+    {
+        for (auto& input : inputs)
+            input = std::make_unique<DeviceInput>();
+    }
+
+    //==============================================================================
+    void prepare(double sampleRate)
+    {
+        for (auto& input : inputs)
+            input->queue.prepare(sampleRate);
+
+        deviceMidi.ensureSize(4096);
+    }
+
+    void setLatencyMonitor(LatencyMonitor* monitorToUse) noexcept
+    {
+        for (auto& input : inputs)
+            input->queue.setLatencyMonitor(monitorToUse);
+    }
+
+    /** Adds this block's events from every device to the destination buffer. */
+    void popBlock(MidiBuffer& destination, int numSamples, double callbackTime)
+    {
+        for (auto& input : inputs)
+        {
+            // Slots that have never been bound can't have anything queued
+            if (!input->hasBeenUsed.load(std::memory_order_acquire))
+                continue;
+
+            input->queue.popBlock(deviceMidi, numSamples, callbackTime);
+
+            if (!deviceMidi.isEmpty())
+                destination.addEvents(deviceMidi, 0, numSamples, 0);
+        }
+    }
+
+    //==============================================================================
+    /** Opens or closes a device and connects it to the router. Call this on the message thread. */
+    bool setDeviceEnabled(AudioDeviceManager& deviceManager, const MidiDeviceInfo& device, bool shouldBeEnabled)
+    {
+        auto* input = findInput(device.identifier);
+
+        if (!shouldBeEnabled)
+        {
+            if (input != nullptr && input->enabled)
+            {
+                deviceManager.removeMidiInputDeviceCallback(device.identifier, input);
+                deviceManager.setMidiInputDeviceEnabled(device.identifier, false);
+                input->enabled = false;
+            }
+
+            return true;
+        }
+
+        if (input == nullptr)
+            input = bindFreeSlot(device);
+
+        if (input == nullptr)
+            return false; // every slot is taken by an enabled device
+
+        if (!input->enabled)
+        {
+            deviceManager.setMidiInputDeviceEnabled(device.identifier, true);
+            deviceManager.addMidiInputDeviceCallback(device.identifier, input);
+            input->enabled = true;
+        }
+
+        return true;
+    }
+
+    bool isDeviceEnabled(const String& identifier) const
+    {
+        auto* input = findInput(identifier);
+        return input != nullptr && input->enabled;
+    }
+
+    void disableAll(AudioDeviceManager& deviceManager)
+    {
+        for (auto& input : inputs)
+            if (input->enabled)
+                setDeviceEnabled(deviceManager, { input->name, input->identifier }, false);
+    }
+
+    /** Moves all channel messages from a device onto one channel (1-16), or 0 to leave them as sent. */
+    void setChannelMapping(const String& identifier, int targetChannel)
+    {
+        if (auto* input = findInput(identifier))
+            input->targetChannel.store(jlimit(0, 16, targetChannel));
+    }
+
+    int getChannelMapping(const String& identifier) const
+    {
+        if (auto* input = findInput(identifier))
+            return input->targetChannel.load();
+
+        return 0;
+    }
+
+private:
+    //==============================================================================
+    struct DeviceInput final : public MidiInputCallback
+    {
+        void handleIncomingMidiMessage(MidiInput*, const MidiMessage& message) override
+        {
+            auto target = targetChannel.load(std::memory_order_relaxed);
+
+            if (target > 0 && message.getChannel() > 0)
+            {
+                auto remapped = message;
+                remapped.setChannel(target);
+                queue.push(remapped);
+            }
+            else
+            {
+                queue.push(message);
+            }
+        }
+
+        MidiEventQueue queue;
+        std::atomic<int> targetChannel { 0 };
+        std::atomic<bool> hasBeenUsed { false };
+
+        // Only touched on the message thread
+        String identifier, name;
+        bool enabled = false;
+    };
+
+    DeviceInput* findInput(const String& identifier) const
+    {
+        for (auto& input : inputs)
+            if (input->identifier == identifier && identifier.isNotEmpty())
+                return input.get();
+
+        return nullptr;
+    }
+
+    DeviceInput* bindFreeSlot(const MidiDeviceInfo& device)
+    {
+        for (auto& input : inputs)
+        {
+            if (!input->enabled)
+            {
+                input->identifier = device.identifier;
+                input->name = device.name;
+                input->targetChannel.store(0);
+                input->hasBeenUsed.store(true, std::memory_order_release);
+                return input.get();
+            }
+        }
+
+        return nullptr;
+    }
+
+    std::array<std::unique_ptr<DeviceInput>, maxDevices> inputs;
+    MidiBuffer deviceMidi;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MidiInputRouter)
+};
+
+//==============================================================================
+/** Keeps a copy of the MIDI input device list, refreshed on a background thread.
+
+    Enumerating devices can block for a noticeable time on some systems, so the
+    message thread only ever reads the cached list. Hot-plug notifications, and
+    explicit refresh() calls, wake the thread, and onChange is called on the
+    message thread once the new list is in.
+*/
+class MidiDeviceListCache final : private Thread,
+                                  private AsyncUpdater
+{
+public:
+    MidiDeviceListCache() : Thread("MIDI device list")
+    {
+        startThread(Thread::Priority::background);
+        refresh();
+    }
+
+    ~MidiDeviceListCache() override
+    {
+        cancelPendingUpdate();
+        signalThreadShouldExit();
+        notify();
+        stopThread(5000);
+    }
+
+    void refresh()    { notify(); }
+
+    Array<MidiDeviceInfo> getDevices() const
+    {
+        const ScopedLock sl(listLock);
+        return devices;
+    }
+
+    /** Called on the message thread whenever a refresh has finished. */
+    std::function<void()> onChange;
+
+private:
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            wait(-1);
+
+            if (threadShouldExit())
+                break;
+
+            auto newDevices = MidiInput::getAvailableDevices();
+
+            {
+                const ScopedLock sl(listLock);
+                devices = std::move(newDevices);
+            }
+
+            triggerAsyncUpdate();
+        }
+    }
+
+    void handleAsyncUpdate() override
+    {
+        if (onChange != nullptr)
+            onChange();
+    }
+
+    CriticalSection listLock;
+    Array<MidiDeviceInfo> devices;
+
+    MidiDeviceListConnection connection = MidiDeviceListConnection::make([this] { refresh(); });
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MidiDeviceListCache)
+};
@@ -0,0 +1,464 @@
+#pragma once
+
+#include "DemoUtilities.h"
+
+//==============================================================================
+/** The binary format shared by MidiSessionRecorder and MidiSessionLog.
+
+    After the header, the file is a sequence of records, each starting with a
+    one-byte type. All numbers are little-endian.
+
+        header:       int32 magic, int32 version, float64 sample rate
+        block:        int32 numSamples, uint16 numEvents, then per event
+                      uint16 offset, uint8 size, size bytes of MIDI
+        emptyBlocks:  int32 numSamples, int32 count
+        soundChange:  int32 generation
+        soundName:    int32 generation, null-terminated UTF-8 description
+        dropped:      int32 number of blocks the writer couldn't keep up with
+*/
+struct MidiSessionFormat
+{
+    enum RecordType : uint8
+    {
+        block = 1,
+        emptyBlocks,
+        soundChange,
+        soundName,
+        dropped
+    };
+
+    static constexpr int magicNumber = 0x314c534d; // "MSL1"
+    static constexpr int formatVersion = 1;
+};
+
+//==============================================================================
+/** Captures every MIDI event the synth renders, block by block, so that a
+    session can be replayed exactly (see SessionReplay).
+
+    The audio thread encodes each block's events into a lock-free byte FIFO,
+    and a background thread writes them to disk. Runs of blocks without any
+    events are collapsed into a single record. If the writer ever falls
+    behind, the blocks that didn't fit are counted and the log says so.
+*/
+class MidiSessionRecorder final : private Thread
+{
+public:
+    MidiSessionRecorder() : Thread("MIDI session writer") {}
+
+    ~MidiSessionRecorder() override
+    {
+        stop();
+    }
+
+    //==============================================================================
+    /** Starts a new log, with the sounds in use right now in the order they
+        should be restored. Call this on the message thread.
+    */
+    bool start(const File& file, double sampleRate, const StringArray& soundDescriptions)
+    {
+        stop();
+
+        file.getParentDirectory().createDirectory();
+        auto stream = std::make_unique<FileOutputStream>(file);
+
+        if (!stream->openedOk())
+            return false;
+
+        stream->setPosition(0);
+        stream->truncate();
+        stream->writeInt(MidiSessionFormat::magicNumber);
+        stream->writeInt(MidiSessionFormat::formatVersion);
+        stream->writeDouble(sampleRate);
+
+        output = std::move(stream);
+        fifo.reset();
+        numDropped.store(0);
+        emptyRunSize = emptyRunLength = 0;
+        recordedGeneration = -1;
+        loggedGeneration.store(-1);
+
+        {
+            const ScopedLock sl(soundLock);
+            soundNames.clear();
+        }
+
+        for (auto& description : soundDescriptions)
+            addSound(description, false);
+
+        recording.store(true);
+        startThread(Thread::Priority::low);
+        return true;
+    }
+
+    /** Finishes the log. Call this on the message thread. */
+    void stop()
+    {
+        if (!recording.exchange(false))
+            return;
+
+        // Once the audio thread is out of recordBlock(), its state is ours
+        while (audioThreadInside.load() != 0)
+            Thread::yield();
+
+        flushEmptyRun();
+
+        signalThreadShouldExit();
+        notify();
+        stopThread(5000);
+
+        writeTrailer();
+        output.reset();
+    }
+
+    bool isRecording() const noexcept    { return recording.load(); }
+
+    /** Tells the recorder a sound has just been switched. Does nothing unless it's
+        recording, since start() is given everything in use at that point.
+        Call this on the message thread.
+    */
+    void soundChanged(const String& description)
+    {
+        if (recording.load())
+            addSound(description, false);
+    }
+
+    /** The same, for a setting that moves continuously, like a slider being
+        dragged: if the last change was to the same setting (the part of the
+        description before the first colon) and hasn't been logged yet, it's
+        replaced rather than added to.
+    */
+    void settingMoved(const String& description)
+    {
+        if (recording.load())
+            addSound(description, true);
+    }
+
+    //==============================================================================
+    /** Logs one device block's worth of MIDI. Call this on the audio thread. */
+    void recordBlock(int numSamples, const MidiBuffer& midi) noexcept
+    {
+        if (!recording.load())
+            return;
+
+        audioThreadInside.fetch_add(1);
+
+        if (recording.load())
+        {
+            auto generation = soundGeneration.load();
+
+            if (generation != recordedGeneration)
+            {
+                flushEmptyRun();
+
+                uint8 record[5];
+                record[0] = MidiSessionFormat::soundChange;
+                writeInt32(record + 1, generation);
+
+                if (push(record, sizeof(record)))
+                {
+                    recordedGeneration = generation;
+                    loggedGeneration.store(generation);
+                }
+            }
+
+            if (midi.isEmpty())
+                addEmptyBlock(numSamples);
+            else
+                writeBlock(numSamples, midi);
+        }
+
+        audioThreadInside.fetch_sub(1);
+    }
+
+private:
+    //==============================================================================
+    void writeBlock(int numSamples, const MidiBuffer& midi) noexcept
+    {
+        flushEmptyRun();
+
+        auto& record = blockRecord;
+        record[0] = MidiSessionFormat::block;
+        writeInt32(record.data() + 1, numSamples);
+
+        size_t size = 7;
+        int numEvents = 0;
+
+        for (const auto metadata : midi)
+        {
+            if (metadata.numBytes > 3 || size + 3 + (size_t)metadata.numBytes > record.size() || numEvents == 0xffff)
+                continue; // sysex isn't logged, and absurdly busy blocks get truncated
+
+            record[size++] = (uint8)(metadata.samplePosition & 0xff);
+            record[size++] = (uint8)((metadata.samplePosition >> 8) & 0xff);
+            record[size++] = (uint8)metadata.numBytes;
+            std::memcpy(record.data() + size, metadata.data, (size_t)metadata.numBytes);
+            size += (size_t)metadata.numBytes;
+            ++numEvents;
+        }
+
+        record[5] = (uint8)(numEvents & 0xff);
+        record[6] = (uint8)((numEvents >> 8) & 0xff);
+
+        if (!push(record.data(), size))
+            numDropped.fetch_add(1);
+    }
+
+    void addEmptyBlock(int numSamples) noexcept
+    {
+        if (numSamples != emptyRunSize)
+        {
+            flushEmptyRun();
+            emptyRunSize = numSamples;
+        }
+
+        ++emptyRunLength;
+    }
+
+    void flushEmptyRun() noexcept
+    {
+        if (emptyRunLength == 0)
+            return;
+
+        uint8 record[9];
+        record[0] = MidiSessionFormat::emptyBlocks;
+        writeInt32(record + 1, emptyRunSize);
+        writeInt32(record + 5, emptyRunLength);
+
+        if (!push(record, sizeof(record)))
+            numDropped.fetch_add(emptyRunLength);
+
+        emptyRunLength = 0;
+    }
+
+    bool push(const uint8* data, size_t size) noexcept
+    {
+        if (fifo.getFreeSpace() < (int)size)
+            return false;
+
+        const auto scope = fifo.write((int)size);
+
+        if (scope.blockSize1 > 0)
+            std::memcpy(buffer.data() + scope.startIndex1, data, (size_t)scope.blockSize1);
+
+        if (scope.blockSize2 > 0)
+            std::memcpy(buffer.data() + scope.startIndex2, data + scope.blockSize1, (size_t)scope.blockSize2);
+
+        return true;
+    }
+
+    void addSound(const String& description, bool replaceSameSetting)
+    {
+        const ScopedLock sl(soundLock);
+
+        if (replaceSameSetting && !soundNames.empty())
+        {
+            auto& last = soundNames.back();
+
+            if (last.first == soundGeneration.load() && last.first != loggedGeneration.load()
+                 && last.second.upToFirstOccurrenceOf(":", false, false) == description.upToFirstOccurrenceOf(":", false, false))
+            {
+                last.second = description;
+                return;
+            }
+        }
+
+        auto generation = ++soundGeneration;
+        soundNames.push_back({ generation, description });
+    }
+
+    static void writeInt32(uint8* dest, int value) noexcept
+    {
+        auto bits = (uint32)value;
+
+        for (int i = 0; i < 4; ++i)
+            dest[i] = (uint8)((bits >> (8 * i)) & 0xff);
+    }
+
+    //==============================================================================
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            wait(20);
+            drain();
+        }
+
+        drain();
+    }
+
+    void drain()
+    {
+        const auto scope = fifo.read(fifo.getNumReady());
+
+        if (scope.blockSize1 > 0)
+            output->write(buffer.data() + scope.startIndex1, (size_t)scope.blockSize1);
+
+        if (scope.blockSize2 > 0)
+            output->write(buffer.data() + scope.startIndex2, (size_t)scope.blockSize2);
+    }
+
+    /** The names of the sounds, and how much was lost, go at the end. */
+    void writeTrailer()
+    {
+        drain();
+
+        {
+            const ScopedLock sl(soundLock);
+
+            for (auto& sound : soundNames)
+            {
+                output->writeByte((char)MidiSessionFormat::soundName);
+                output->writeInt(sound.first);
+                output->writeString(sound.second);
+            }
+        }
+
+        if (auto dropped = numDropped.load(); dropped > 0)
+        {
+            output->writeByte((char)MidiSessionFormat::dropped);
+            output->writeInt(dropped);
+        }
+
+        output->flush();
+    }
+
+    //==============================================================================
+    static constexpr int fifoSize = 1 << 20;
+
+    AbstractFifo fifo { fifoSize };
+    std::vector<uint8> buffer = std::vector<uint8>((size_t)fifoSize);
+    std::unique_ptr<FileOutputStream> output;
+
+    // Where the audio thread encodes each block before pushing it, so it's not on the stack
+    std::array<uint8, 8192> blockRecord {};
+
+    std::atomic<bool> recording { false };
+    std::atomic<int> audioThreadInside { 0 }, numDropped { 0 };
+    std::atomic<int> soundGeneration { 0 }, loggedGeneration { -1 };
+
+    CriticalSection soundLock;
+    std::vector<std::pair<int, String>> soundNames;
+
+    // Only touched on the audio thread while recording
+    int emptyRunSize = 0, emptyRunLength = 0, recordedGeneration = -1;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MidiSessionRecorder)
+};
+
+//==============================================================================
+/** A recorded session, read back into memory. */
+struct MidiSessionLog
+{
+    struct Event
+    {
+        int offset = 0;
+        uint8 bytes[3] = {};
+        uint8 numBytes = 0;
+    };
+
+    /** A run of one or more blocks of the same size, all but the first of them empty. */
+    struct Step
+    {
+        int numSamples = 0, repeatCount = 1;
+        size_t firstEvent = 0, numEvents = 0;
+        int soundGeneration = 0;
+    };
+
+    bool loadFrom(const File& file)
+    {
+        FileInputStream in(file);
+
+        if (!in.openedOk() || in.readInt() != MidiSessionFormat::magicNumber || in.readInt() != MidiSessionFormat::formatVersion)
+            return false;
+
+        sampleRate = in.readDouble();
+
+        if (sampleRate <= 0.0)
+            return false;
+
+        auto generation = 0;
+
+        while (!in.isExhausted())
+        {
+            switch (in.readByte())
+            {
+                case MidiSessionFormat::block:
+                {
+                    Step step;
+                    step.numSamples = in.readInt();
+                    step.numEvents = (size_t)(uint16)in.readShort();
+                    step.firstEvent = events.size();
+                    step.soundGeneration = generation;
+
+                    for (size_t i = 0; i < step.numEvents; ++i)
+                    {
+                        Event event;
+                        event.offset = (int)(uint16)in.readShort();
+                        event.numBytes = (uint8)jlimit(0, 3, (int)(uint8)in.readByte());
+                        in.read(event.bytes, event.numBytes);
+                        events.push_back(event);
+                    }
+
+                    steps.push_back(step);
+                    break;
+                }
+
+                case MidiSessionFormat::emptyBlocks:
+                {
+                    Step step;
+                    step.numSamples = in.readInt();
+                    step.repeatCount = in.readInt();
+                    step.firstEvent = events.size();
+                    step.soundGeneration = generation;
+                    steps.push_back(step);
+                    break;
+                }
+
+                case MidiSessionFormat::soundChange:
+                    generation = in.readInt();
+                    break;
+
+                case MidiSessionFormat::soundName:
+                {
+                    auto soundGeneration = in.readInt();
+                    soundDescriptions[soundGeneration] = in.readString();
+                    break;
+                }
+
+                case MidiSessionFormat::dropped:
+                    numDroppedBlocks = in.readInt();
+                    break;
+
+                default:
+                    return false; // corrupt, or truncated mid-record
+            }
+        }
+
+        return !steps.empty();
+    }
+
+    /** Fills a MidiBuffer with the events of a step's first block. */
+    void getMidi(const Step& step, MidiBuffer& destination) const
+    {
+        destination.clear();
+
+        for (auto i = step.firstEvent; i < step.firstEvent + step.numEvents; ++i)
+            destination.addEvent(events[i].bytes, events[i].numBytes, events[i].offset);
+    }
+
+    int64 getTotalBlocks() const
+    {
+        int64 total = 0;
+
+        for (auto& step : steps)
+            total += step.repeatCount;
+
+        return total;
+    }
+
+    double sampleRate = 44100.0;
+    std::vector<Step> steps;
+    std::vector<Event> events;
+    std::map<int, String> soundDescriptions;
+    int numDroppedBlocks = 0;
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "DemoUtilities.h"
+
+//==============================================================================
+/** Spreads a block's worth of voice rendering over a pool of real-time threads.
+
+    The audio thread publishes a run by storing a single packed atomic word
+    (generation, job count, next job), and every thread, the audio thread
+    included, claims jobs from it with compare-and-swap until none are left.
+    Between runs the workers spin on that word for at least as long as the
+    longest recent gap between runs, which covers the time from one device
+    callback to the next, so while audio is running the hot path is made of
+    nothing but atomics. Once runs stop coming, the workers poll at millisecond
+    intervals instead. The audio thread never signals or locks anything: a
+    worker that isn't spinning just misses a run, and because jobs are claimed
+    rather than assigned, its share is rendered by the other threads.
+
+    A job that has been claimed has to be finished, though. If a worker is
+    preempted in the middle of one, the audio thread waits for it, however long
+    that takes. run() reports the missed deadline, and SynthEngine renders
+    serially for a while after repeated misses, which makes further stalls
+    less likely but does nothing for the block that was already late.
+*/
+class ParallelVoiceRenderer final
+{
+public:
+    struct Task
+    {
+        virtual ~Task() = default;
+
+        /** Called on one of the pool's threads, or on the audio thread (threadIndex 0). */
+        virtual void renderJob(int jobIndex, int threadIndex) = 0;
+    };
+
+    ParallelVoiceRenderer() = default;
+
+    ~ParallelVoiceRenderer()
+    {
+        stopWorkers();
+    }
+
+    //==============================================================================
+    /** Spawns the worker threads. Call this while no run can be in progress. */
+    void startWorkers(int numWorkers, int blockSize, double sampleRate)
+    {
+        stopWorkers();
+
+        for (int i = 0; i < numWorkers; ++i)
+        {
+            auto* worker = workers.add(new Worker(*this, i + 1));
+
+            auto options = Thread::RealtimeOptions{}.withApproximateAudioProcessingTime(blockSize, sampleRate);
+
+            if (!worker->startRealtimeThread(options))
+                worker->startThread(Thread::Priority::highest);
+        }
+    }
+
+    void stopWorkers()
+    {
+        // This also wakes any worker that's polling
+        for (auto* worker : workers)
+            worker->signalThreadShouldExit();
+
+        for (auto* worker : workers)
+            worker->stopThread(2000);
+
+        workers.clear();
+    }
+
+    /** The number of threads taking part in a run, including the audio thread. */
+    int getNumThreads() const noexcept    { return workers.size() + 1; }
+    bool hasWorkers() const noexcept      { return !workers.isEmpty(); }
+
+    //==============================================================================
+    /** Renders jobs [0, numJobs) and returns once they've all finished. The calling
+        thread joins in as thread 0. Returns false if the workers took longer than
+        deadlineMs to deliver their share, which doesn't make it return any sooner.
+    */
+    bool run(Task& task, int numJobs, double deadlineMs)
+    {
+        jassert(numJobs <= maxJobs);
+
+        currentTask = &task;
+        jobsDone.store(0, std::memory_order_relaxed);
+
+        generation = (generation + 1) & generationMask;
+        jobState.store(pack(generation, (uint64)numJobs, 0));
+
+        auto startTicks = Time::getHighResolutionTicks();
+
+        // The longest gap lately, decaying slowly, tells the workers how long to keep spinning
+        if (lastRunTicks > 0)
+        {
+            auto held = runGapTicks.load(std::memory_order_relaxed);
+            runGapTicks.store(jmax(startTicks - lastRunTicks, held - held / 64), std::memory_order_relaxed);
+        }
+
+        lastRunTicks = startTicks;
+        processJobs(0);
+
+        auto deadlineTicks = startTicks + (int64)(deadlineMs * 0.001 * (double)Time::getHighResolutionTicksPerSecond());
+        auto missedDeadline = false;
+
+        while (jobsDone.load(std::memory_order_acquire) < numJobs)
+        {
+            if (!missedDeadline && Time::getHighResolutionTicks() > deadlineTicks)
+                missedDeadline = true;
+
+            // A worker is still busy with a job it claimed, so all we can do is wait for it
+            if (missedDeadline)
+                std::this_thread::yield();
+        }
+
+        return !missedDeadline;
+    }
+
+    /** The least time workers keep spinning for more work before they start polling.
+        They spin for longer if that's what it takes to span the gaps between runs.
+    */
+    void setSpinTime(double milliseconds) noexcept
+    {
+        spinTicks.store((int64)(milliseconds * 0.001 * (double)Time::getHighResolutionTicksPerSecond()));
+    }
+
+private:
+    //==============================================================================
+    struct Worker final : public Thread
+    {
+        Worker(ParallelVoiceRenderer& ownerIn, int index)
+            : Thread("Voice renderer " + String(index)), owner(ownerIn), threadIndex(index)
+        {
+        }
+
+        void run() override
+        {
+            auto lastGeneration = getGeneration(owner.jobState.load());
+
+            while (!threadShouldExit())
+            {
+                if (!waitForNextRun(lastGeneration))
+                    continue;
+
+                lastGeneration = getGeneration(owner.jobState.load());
+                owner.processJobs(threadIndex);
+            }
+        }
+
+        bool waitForNextRun(uint64 lastGeneration)
+        {
+            auto spinFor = jmax(owner.spinTicks.load(std::memory_order_relaxed),
+                                owner.runGapTicks.load(std::memory_order_relaxed) * 5 / 4);
+            auto spinUntil = Time::getHighResolutionTicks() + jmin(spinFor, owner.maxSpinTicks);
+
+            while (Time::getHighResolutionTicks() < spinUntil)
+            {
+                for (int i = 0; i < 64; ++i)
+                    if (getGeneration(owner.jobState.load(std::memory_order_acquire)) != lastGeneration)
+                        return true;
+
+                if (threadShouldExit())
+                    return false;
+            }
+
+            // Nothing wakes us, so poll: any run published meanwhile is rendered without us
+            wait(1);
+
+            return getGeneration(owner.jobState.load()) != lastGeneration;
+        }
+
+        ParallelVoiceRenderer& owner;
+        const int threadIndex;
+    };
+
+    //==============================================================================
+    void processJobs(int threadIndex)
+    {
+        auto state = jobState.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            auto numJobs = getNumJobs(state);
+            auto nextJob = getNextJob(state);
+
+            if (nextJob >= numJobs)
+                return;
+
+            if (!jobState.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel))
+                continue;
+
+            // Once a job has been claimed, the audio thread can't finish the run
+            // without us, so the task pointer stays valid until we report back.
+            currentTask->renderJob((int)nextJob, threadIndex);
+            jobsDone.fetch_add(1, std::memory_order_release);
+
+            state = jobState.load(std::memory_order_acquire);
+        }
+    }
+
+    static constexpr int maxJobs = 0xffff;
+    static constexpr uint64 generationMask = 0xffffffff;
+
+    static uint64 pack(uint64 gen, uint64 numJobs, uint64 nextJob) noexcept    { return (gen << 32) | (numJobs << 16) | nextJob; }
+    static uint64 getGeneration(uint64 state) noexcept                          { return state >> 32; }
+    static uint64 getNumJobs(uint64 state) noexcept                             { return (state >> 16) & 0xffff; }
+    static uint64 getNextJob(uint64 state) noexcept                             { return state & 0xffff; }
+
+    OwnedArray<Worker> workers;
+
+    std::atomic<uint64> jobState { 0 };
+    std::atomic<int> jobsDone { 0 };
+    std::atomic<int64> spinTicks { Time::getHighResolutionTicksPerSecond() / 2000 };
+    std::atomic<int64> runGapTicks { 0 };
+    const int64 maxSpinTicks { Time::getHighResolutionTicksPerSecond() / 20 };   // so they stop spinning soon after the audio does
+    Task* currentTask = nullptr;
+    uint64 generation = 0;
+    int64 lastRunTicks = 0;   // only touched by the audio thread
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ParallelVoiceRenderer)
+};
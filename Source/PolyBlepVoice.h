@@ -0,0 +1,336 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "SmoothedParameter.h"
+#include <juce_dsp/juce_dsp.h>
+
+//==============================================================================
+/** A band-limited saw, square, pulse or triangle oscillator.
+
+    Each waveform is generated naively, then corrected around its
+    discontinuities: PolyBLEP (a two-sample polynomial band-limited step) where
+    the wave jumps, and PolyBLAMP (the same for a ramp) where the triangle's
+    slope turns round. The phases are accumulated in order, since each depends
+    on the last, but the naive wave is computed over the whole array at once,
+    and the corrections are only applied to the couple of samples either side
+    of an edge, which a cheap scan finds.
+*/
+class PolyBlepOscillator final
+{
+public:
+    enum class Waveform { saw, square, pulse, triangle };
+
+    /** The most samples that can be rendered at once. */
+    static constexpr int maxBlockSize = 256;
+
+    PolyBlepOscillator() = default;
+
+    void setWaveform(Waveform newWaveform) noexcept    { waveform = newWaveform; }
+    Waveform getWaveform() const noexcept              { return waveform; }
+
+    /** The pulse wave's duty cycle, as a fraction of a period. Square is always 0.5. */
+    void setPulseWidth(float newWidth) noexcept        { pulseWidth = jlimit(0.05f, 0.95f, newWidth); }
+
+    void reset() noexcept    { phase = 0.0; }
+
+    /** Writes numSamples of the waveform, advancing by increments[i] cycles at sample i. */
+    void render(float* output, const float* increments, int numSamples) noexcept
+    {
+        jassert(numSamples <= maxBlockSize);
+
+        auto* phases = phaseBuffer.data();
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            phases[i] = (float)phase;
+            phase += increments[i];
+
+            if (phase >= 1.0)
+                phase -= 1.0;
+        }
+
+        switch (waveform)
+        {
+            case Waveform::saw:
+                FloatVectorOperations::copyWithMultiply(output, phases, 2.0f, numSamples);
+                FloatVectorOperations::add(output, -1.0f, numSamples);
+                correctEdges(output, phases, increments, numSamples, 0.0f, -1.0f);
+                break;
+
+            case Waveform::square:
+            case Waveform::pulse:
+            {
+                auto width = waveform == Waveform::square ? 0.5f : pulseWidth;
+
+                for (int i = 0; i < numSamples; ++i)
+                    output[i] = phases[i] < width ? 1.0f : -1.0f;
+
+                correctEdges(output, phases, increments, numSamples, 0.0f, 1.0f);
+                correctEdges(output, phases, increments, numSamples, width, -1.0f);
+                break;
+            }
+
+            case Waveform::triangle:
+            default:
+                // Peaks at a quarter of the way through the cycle, troughs at three quarters
+                for (int i = 0; i < numSamples; ++i)
+                {
+                    auto y = phases[i] * 4.0f;
+                    output[i] = y >= 3.0f ? y - 4.0f : (y > 1.0f ? 2.0f - y : y);
+                }
+
+                correctCorners(output, phases, increments, numSamples, 0.25f, -8.0f);
+                correctCorners(output, phases, increments, numSamples, 0.75f, 8.0f);
+                break;
+        }
+    }
+
+private:
+    //==============================================================================
+    /** The correction to a unit step at t = 0, for a sample at t (in periods, either side of the step). */
+    static float blep(float t, float dt) noexcept
+    {
+        if (t < dt)
+        {
+            t /= dt;
+            return t + t - t * t - 1.0f;
+        }
+
+        t = (t - 1.0f) / dt;
+        return t * t + t + t + 1.0f;
+    }
+
+    /** The correction to a unit change of slope (per period) at t = 0. */
+    static float blamp(float t, float dt) noexcept
+    {
+        if (t < dt)
+        {
+            t = t / dt - 1.0f;
+            return -t * t * t / 3.0f;
+        }
+
+        t = (t - 1.0f) / dt + 1.0f;
+        return t * t * t / 3.0f;
+    }
+
+    /** The phase relative to an edge, wrapped into [0, 1). */
+    static float relativePhase(float phase, float edge) noexcept
+    {
+        auto t = phase - edge;
+        return t < 0.0f ? t + 1.0f : t;
+    }
+
+    /** Smooths the steps of the given height (halved, as blep() is for a step of 2) at the edge. */
+    static void correctEdges(float* output, const float* phases, const float* increments, int numSamples,
+                             float edge, float halfHeight) noexcept
+    {
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto dt = increments[i];
+            auto t = relativePhase(phases[i], edge);
+
+            if (t < dt || t > 1.0f - dt)
+                output[i] += halfHeight * blep(t, dt);
+        }
+    }
+
+    /** Rounds off the corners where the slope changes by slopeChange (per period) at the edge,
+        halved like the steps, as blamp() is scaled for a change of 2.
+    */
+    static void correctCorners(float* output, const float* phases, const float* increments, int numSamples,
+                               float edge, float slopeChange) noexcept
+    {
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto dt = increments[i];
+            auto t = relativePhase(phases[i], edge);
+
+            if (t < dt || t > 1.0f - dt)
+                output[i] += slopeChange * dt * blamp(t, dt) * 0.5f;
+        }
+    }
+
+    Waveform waveform = Waveform::saw;
+    float pulseWidth = 0.25f;
+    double phase = 0.0;
+    std::array<float, maxBlockSize> phaseBuffer {};
+};
+
+//==============================================================================
+/** The sound for the PolyBlepVoice, which says what it should play. */
+struct PolyBlepSound final : public SynthesiserSound
+{
+    PolyBlepSound(PolyBlepOscillator::Waveform waveformToUse, int oversampling)
+        : waveform(waveformToUse), oversamplingFactor(oversampling)
+    {
+        jassert(oversampling == 1 || oversampling == 2 || oversampling == 4);
+    }
+
+    bool appliesToNote(int /*midiNoteNumber*/) override    { return true; }
+    bool appliesToChannel(int /*midiChannel*/) override    { return true; }
+
+    static StringArray getWaveformNames()    { return { "Saw", "Square", "Pulse", "Triangle" }; }
+
+    const PolyBlepOscillator::Waveform waveform;
+    const int oversamplingFactor;
+    ADSR::Parameters envelope { 0.005f, 0.1f, 0.8f, 0.2f };
+};
+
+//==============================================================================
+/** A voice that plays a PolyBlepOscillator, at the sample rate or oversampled.
+
+    Oversampled, the oscillator runs two or four times as fast, with its edges
+    corrected at that rate, and a dsp::Oversampling's half-band filters bring it
+    back down, which takes out most of what aliasing PolyBLEP leaves. Both
+    oversamplers are built up front for the fixed chunk size the voice renders
+    in, so switching between them never allocates.
+
+    Like the other voices, it renders a chunk at a time and follows pitch bend,
+    the mod wheel and channel volume through a VoiceControls.
+*/
+class PolyBlepVoice final : public SynthesiserVoice
+{
+public:
+    PolyBlepVoice()
+    {
+        using Oversampler = dsp::Oversampling<float>;
+
+        for (size_t i = 0; i < oversamplers.size(); ++i)
+        {
+            oversamplers[i] = std::make_unique<Oversampler>(1, (int)i + 1, Oversampler::filterHalfBandPolyphaseIIR, true);
+            oversamplers[i]->initProcessing(VoiceControls::maxChunkSize);
+        }
+
+        chunkBuffer.setSize(1, VoiceControls::maxChunkSize);
+        silence.setSize(1, VoiceControls::maxChunkSize);
+        silence.clear();
+    }
+
+    bool canPlaySound(SynthesiserSound* sound) override
+    {
+        return dynamic_cast<PolyBlepSound*>(sound) != nullptr;
+    }
+
+    void startNote(int midiNoteNumber, float velocity, SynthesiserSound* sound, int currentPitchWheelPosition) override
+    {
+        auto* polyBlepSound = dynamic_cast<PolyBlepSound*>(sound);
+
+        if (polyBlepSound == nullptr)
+            return;
+
+        oscillator.setWaveform(polyBlepSound->waveform);
+        oscillator.reset();
+        oversamplingFactor = polyBlepSound->oversamplingFactor;
+
+        if (auto* oversampler = getOversampler())
+            oversampler->reset();
+
+        cyclesPerSample = (float)(MidiMessage::getMidiNoteInHertz(midiNoteNumber) / getSampleRate());
+        level = velocity * 0.1f;
+
+        adsr.setSampleRate(getSampleRate());
+        adsr.setParameters(polyBlepSound->envelope);
+        adsr.noteOn();
+
+        controls.prepare(getSampleRate());
+        controls.startNote(currentPitchWheelPosition);
+    }
+
+    void stopNote(float /*velocity*/, bool allowTailOff) override
+    {
+        if (allowTailOff)
+        {
+            adsr.noteOff();
+        }
+        else
+        {
+            adsr.reset();
+            clearCurrentNote();
+        }
+    }
+
+    void pitchWheelMoved(int newValue) override                              { controls.pitchWheelMoved(newValue); }
+    void controllerMoved(int controllerNumber, int newValue) override        { controls.controllerMoved(controllerNumber, newValue); }
+
+    void renderNextBlock(AudioBuffer<float>& outputBuffer, int startSample, int numSamples) override
+    {
+        // In chunks, so the controls can hand over their smoothed values in fixed-size arrays
+        while (numSamples > 0 && isVoiceActive())
+        {
+            auto chunk = jmin(numSamples, VoiceControls::maxChunkSize);
+            auto* pitch = controls.getNextPitchMultipliers(chunk);
+            auto* gains = controls.getNextGains(chunk);
+
+            renderChunk(outputBuffer, startSample, chunk, pitch, gains);
+            startSample += chunk;
+            numSamples -= chunk;
+        }
+    }
+
+    using SynthesiserVoice::renderNextBlock;
+
+private:
+    static_assert(VoiceControls::maxChunkSize * 4 <= PolyBlepOscillator::maxBlockSize,
+                  "The oscillator has to fit a chunk at 4x oversampling");
+
+    dsp::Oversampling<float>* getOversampler() const noexcept
+    {
+        switch (oversamplingFactor)
+        {
+            case 2:     return oversamplers[0].get();
+            case 4:     return oversamplers[1].get();
+            default:    return nullptr;
+        }
+    }
+
+    void renderChunk(AudioBuffer<float>& outputBuffer, int startSample, int numSamples,
+                     const float* pitch, const float* gains)
+    {
+        auto* mono = chunkBuffer.getWritePointer(0);
+        auto* increments = incrementBuffer.data();
+
+        if (auto* oversampler = getOversampler())
+        {
+            // Each base-rate increment covers oversamplingFactor samples at the higher rate
+            auto scale = cyclesPerSample / (float)oversamplingFactor;
+
+            for (int i = 0; i < numSamples; ++i)
+                for (int j = 0; j < oversamplingFactor; ++j)
+                    increments[i * oversamplingFactor + j] = pitch[i] * scale;
+
+            // The upsampled input is silence, so this just hands over the stage's buffer to fill
+            dsp::AudioBlock<const float> silentBlock(silence.getArrayOfReadPointers(), 1, (size_t)numSamples);
+            auto upsampled = oversampler->processSamplesUp(silentBlock);
+            oscillator.render(upsampled.getChannelPointer(0), increments, numSamples * oversamplingFactor);
+
+            dsp::AudioBlock<float> outputBlock(chunkBuffer.getArrayOfWritePointers(), 1, (size_t)numSamples);
+            oversampler->processSamplesDown(outputBlock);
+        }
+        else
+        {
+            FloatVectorOperations::copyWithMultiply(increments, pitch, cyclesPerSample, numSamples);
+            oscillator.render(mono, increments, numSamples);
+        }
+
+        FloatVectorOperations::multiply(mono, gains, numSamples);
+        FloatVectorOperations::multiply(mono, level, numSamples);
+        adsr.applyEnvelopeToBuffer(chunkBuffer, 0, numSamples);
+
+        for (auto ch = outputBuffer.getNumChannels(); --ch >= 0;)
+            FloatVectorOperations::add(outputBuffer.getWritePointer(ch, startSample), mono, numSamples);
+
+        if (!adsr.isActive())
+            clearCurrentNote();
+    }
+
+    PolyBlepOscillator oscillator;
+    std::array<std::unique_ptr<dsp::Oversampling<float>>, 2> oversamplers;   // 2x and 4x
+    AudioBuffer<float> chunkBuffer, silence;
+    std::array<float, PolyBlepOscillator::maxBlockSize> incrementBuffer {};
+    int oversamplingFactor = 1;
+    float cyclesPerSample = 0.0f, level = 0.0f;
+    ADSR adsr;
+    VoiceControls controls;
+
+    JUCE_LEAK_DETECTOR(PolyBlepVoice)
+};
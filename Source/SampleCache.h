@@ -0,0 +1,313 @@
+#pragma once
+
+#include "DemoUtilities.h"
+
+//==============================================================================
+/** One decoded sample, shared by every zone and sound that refers to the same
+    source. The entry itself lives for as long as anything points at it, but its
+    audio data can be evicted and decoded again by the SampleCache.
+*/
+struct CachedSample final : public ReferenceCountedObject
+{
+    using Ptr = ReferenceCountedObjectPtr<CachedSample>;
+
+    enum State
+    {
+        unloaded = 0,
+        queued,
+        loaded,
+        evicting,
+        failed
+    };
+
+    bool isResident() const noexcept    { return state.load() == loaded; }
+
+    size_t getSizeInBytes() const noexcept
+    {
+        return (size_t)data.getNumChannels() * (size_t)data.getNumSamples() * sizeof(float);
+    }
+
+    String key;
+    File file;
+    const void* memoryData = nullptr;
+    size_t memorySize = 0;
+
+    // Only written by SampleCache::decode() before the state becomes 'loaded'
+    AudioBuffer<float> data;
+    double sourceSampleRate = 44100.0;
+    int length = 0;
+
+    std::atomic<int> state { unloaded };
+    std::atomic<int> activeVoices { 0 };
+    std::atomic<uint32> lastUsed { 0 };
+};
+
+//==============================================================================
+/** Keeps decoded samples under a memory budget, shared by all the sampled sounds.
+
+    Voices never take a lock here. A voice bumps the sample's activeVoices count
+    and then re-checks that it's still resident, while eviction first marks a
+    sample as 'evicting' and only frees it once that count has dropped to zero.
+    Between the two, a sample can't disappear from under a voice that's playing it.
+
+    Because the audio thread can't maintain a linked list, recency is tracked
+    with a use-stamp on each sample and the least recently used idle sample is
+    found by a scan when the cache is over budget.
+*/
+class SampleCache final
+{
+public:
+    struct Statistics
+    {
+        uint64 hits = 0, misses = 0, evictions = 0;   // hits and misses count notes, see recordHit()
+        size_t residentBytes = 0, budgetBytes = 0;
+        int numResident = 0, numEntries = 0;
+        int numFailed = 0;                            // samples that couldn't be decoded, so their zones stay silent
+    };
+
+    explicit SampleCache(size_t initialBudgetBytes = 256 * 1024 * 1024)
+        : budgetBytes(initialBudgetBytes)
+    {
+        formatManager.registerBasicFormats();
+    }
+
+    //==============================================================================
+    /** Returns the shared entry for a file, creating an empty one if needed. */
+    CachedSample::Ptr getEntry(const File& file)
+    {
+        return getOrCreateEntry(file.getFullPathName(), [&](CachedSample& entry) { entry.file = file; });
+    }
+
+    /** Returns the shared entry for an in-memory sample such as a BinaryData resource. */
+    CachedSample::Ptr getEntry(const String& key, const void* data, size_t dataSize)
+    {
+        return getOrCreateEntry(key, [&](CachedSample& entry)
+                                     {
+                                         entry.memoryData = data;
+                                         entry.memorySize = dataSize;
+                                     });
+    }
+
+    //==============================================================================
+    /** Called on the audio thread when a voice wants to play a sample. If it's
+        resident, the voice holds it until it calls release().
+    */
+    bool acquire(CachedSample& sample) noexcept
+    {
+        sample.activeVoices.fetch_add(1);
+
+        if (sample.state.load() != CachedSample::loaded)
+        {
+            sample.activeVoices.fetch_sub(1);
+            return false;
+        }
+
+        sample.lastUsed.store(useCounter.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void release(CachedSample& sample) noexcept
+    {
+        jassert(sample.activeVoices.load() > 0);
+        sample.activeVoices.fetch_sub(1);
+    }
+
+    /** Called once per note, by whatever picks its sample, depending on whether
+        that sample was resident. Decoding doesn't count, so preloads and
+        repeated requests for the same sample don't skew the figures.
+    */
+    void recordHit() noexcept     { hits.fetch_add(1, std::memory_order_relaxed); }
+    void recordMiss() noexcept    { misses.fetch_add(1, std::memory_order_relaxed); }
+
+    //==============================================================================
+    /** Makes a sample resident, decoding it on the calling thread if necessary.
+        Never call this on the audio thread.
+    */
+    bool decode(CachedSample& sample)
+    {
+        const ScopedLock sl(decodeLock);
+
+        auto state = sample.state.load();
+
+        if (state == CachedSample::loaded)
+        {
+            touch(sample);
+            return true;
+        }
+
+        if (state == CachedSample::evicting)
+        {
+            // It hasn't been freed yet, so just take it back
+            sample.state.store(CachedSample::loaded);
+            bytesPendingEviction -= sample.getSizeInBytes();
+            touch(sample);
+            return true;
+        }
+
+        auto reader = createReaderFor(sample);
+
+        if (reader == nullptr || reader->lengthInSamples <= 0)
+        {
+            sample.state.store(CachedSample::failed);
+            return false;
+        }
+
+        auto length = (int)jmin(reader->lengthInSamples, (int64)(maxSampleLengthSeconds * reader->sampleRate));
+        auto numChannels = jmin(2, (int)reader->numChannels);
+
+        // A few extra samples at the end let the interpolator read past the last frame
+        sample.data.setSize(numChannels, length + 4);
+        sample.data.clear();
+        reader->read(&sample.data, 0, length, 0, true, numChannels > 1);
+
+        sample.sourceSampleRate = reader->sampleRate;
+        sample.length = length;
+        residentBytes += sample.getSizeInBytes();
+
+        touch(sample);
+        sample.state.store(CachedSample::loaded);
+
+        enforceBudget();
+        return true;
+    }
+
+    /** Frees whatever can be freed. Call this regularly from a background thread. */
+    void collectGarbage()
+    {
+        const ScopedLock sl(decodeLock);
+
+        enforceBudget();
+
+        for (int i = entries.size(); --i >= 0;)
+        {
+            auto* entry = entries.getObjectPointerUnchecked(i);
+
+            if (entry->state.load() == CachedSample::evicting && entry->activeVoices.load() == 0)
+            {
+                auto size = entry->getSizeInBytes();
+                entry->data.setSize(0, 0);
+                entry->length = 0;
+                entry->state.store(CachedSample::unloaded);
+
+                residentBytes -= size;
+                bytesPendingEviction -= size;
+            }
+
+            // Nobody refers to this source any more, so forget about it
+            if (entry->getReferenceCount() == 1 && entry->state.load() != CachedSample::evicting)
+            {
+                residentBytes -= entry->isResident() ? entry->getSizeInBytes() : 0;
+                entries.remove(i);
+            }
+        }
+    }
+
+    //==============================================================================
+    void setMemoryBudget(size_t newBudgetBytes)
+    {
+        const ScopedLock sl(decodeLock);
+        budgetBytes = newBudgetBytes;
+        enforceBudget();
+    }
+
+    size_t getMemoryBudget() const noexcept    { return budgetBytes; }
+
+    Statistics getStatistics() const
+    {
+        const ScopedLock sl(decodeLock);
+
+        Statistics stats;
+        stats.hits = hits.load();
+        stats.misses = misses.load();
+        stats.evictions = evictions.load();
+        stats.residentBytes = residentBytes;
+        stats.budgetBytes = budgetBytes;
+        stats.numEntries = entries.size();
+
+        for (auto* entry : entries)
+        {
+            if (entry->isResident())
+                ++stats.numResident;
+            else if (entry->state.load() == CachedSample::failed)
+                ++stats.numFailed;
+        }
+
+        return stats;
+    }
+
+    static constexpr double maxSampleLengthSeconds = 30.0;
+
+private:
+    template <typename Initialiser>
+    CachedSample::Ptr getOrCreateEntry(const String& key, Initialiser&& initialise)
+    {
+        const ScopedLock sl(decodeLock);
+
+        for (auto* entry : entries)
+            if (entry->key == key)
+                return entry;
+
+        CachedSample::Ptr entry(new CachedSample());
+        entry->key = key;
+        initialise(*entry);
+        entries.add(entry);
+        return entry;
+    }
+
+    std::unique_ptr<AudioFormatReader> createReaderFor(const CachedSample& sample)
+    {
+        if (sample.memoryData != nullptr)
+            return std::unique_ptr<AudioFormatReader>(formatManager.createReaderFor(
+                       std::make_unique<MemoryInputStream>(sample.memoryData, sample.memorySize, false)));
+
+        return std::unique_ptr<AudioFormatReader>(formatManager.createReaderFor(sample.file));
+    }
+
+    void touch(CachedSample& sample) noexcept
+    {
+        sample.lastUsed.store(useCounter.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /** Marks least recently used idle samples for eviction until the resident
+        set, minus what's already on its way out, fits the budget.
+    */
+    void enforceBudget()
+    {
+        while (residentBytes - bytesPendingEviction > budgetBytes)
+        {
+            CachedSample* victim = nullptr;
+
+            for (auto* entry : entries)
+                if (entry->state.load() == CachedSample::loaded && entry->activeVoices.load() == 0)
+                    if (victim == nullptr || entry->lastUsed.load() < victim->lastUsed.load())
+                        victim = entry;
+
+            if (victim == nullptr)
+                break; // everything left is being played
+
+            victim->state.store(CachedSample::evicting);
+
+            // A voice may have grabbed it just before we flagged it
+            if (victim->activeVoices.load() != 0)
+            {
+                victim->state.store(CachedSample::loaded);
+                break;
+            }
+
+            bytesPendingEviction += victim->getSizeInBytes();
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    CriticalSection decodeLock;
+    AudioFormatManager formatManager;
+    ReferenceCountedArray<CachedSample> entries;
+
+    size_t budgetBytes;
+    size_t residentBytes = 0, bytesPendingEviction = 0;
+
+    std::atomic<uint32> useCounter { 0 };
+    std::atomic<uint64> hits { 0 }, misses { 0 }, evictions { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SampleCache)
+};
@@ -0,0 +1,429 @@
+#pragma once
+
+#include "DemoUtilities.h"
+
+//==============================================================================
+/** What the library index knows about one sample file. */
+struct SampleInfo
+{
+    String path;
+    int64 fileSize = 0;
+    int64 modificationTime = 0;
+
+    String formatName;
+    double sampleRate = 0.0;
+    int numChannels = 0;
+    int64 lengthInSamples = 0;
+    int bitsPerSample = 0;
+
+    int rootNote = -1;              // -1 if neither the metadata nor the file name gave one away
+    float peak = 0.0f;              // linear, over all channels
+    float loudnessDecibels = -100.0f; // RMS level over the whole file, in dBFS
+
+    bool isUpToDateWith(const File& file) const
+    {
+        return fileSize == file.getSize()
+            && modificationTime == file.getLastModificationTime().toMilliseconds();
+    }
+};
+
+//==============================================================================
+/** A persistent index of the samples in a folder.
+
+    Scanning fans the files out over a thread pool, and each worker decodes its
+    file once to measure peak and loudness. The results are saved in a compact
+    binary file keyed by path, size and modification time, so the next scan
+    only opens files that are new or have changed since. Files that couldn't be
+    read are remembered the same way, so they aren't retried until they change.
+*/
+class SampleLibraryIndex final
+{
+public:
+    SampleLibraryIndex() = default;
+
+    //==============================================================================
+    /** Scans a folder, reusing whatever is still valid from the current index.
+        Returns the number of files that had to be opened.
+
+        If this is called on a Thread that's asked to exit, the scan gives up,
+        leaving the index as it was. Either way, none of the pool's jobs are
+        still running by the time it returns.
+    */
+    int scan(const File& directory, ThreadPool& pool)
+    {
+        Array<File> files;
+
+        for (const auto& entry : RangedDirectoryIterator(directory, true, supportedWildcard, File::findFiles))
+            files.add(entry.getFile());
+
+        std::vector<SampleInfo> results((size_t)files.size());
+        std::vector<size_t> toAnalyse;
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            auto& file = files.getReference((int)i);
+
+            if (auto* existing = find(file); existing != nullptr && existing->isUpToDateWith(file))
+                results[i] = *existing;
+            else if (auto* failure = findIn(unreadable, file); failure != nullptr && failure->isUpToDateWith(file))
+                results[i] = *failure;
+            else
+                toAnalyse.push_back(i);
+        }
+
+        if (!toAnalyse.empty())
+        {
+            auto* scanningThread = Thread::getCurrentThread();
+            auto shouldStop = [scanningThread] { return scanningThread != nullptr && scanningThread->threadShouldExit(); };
+
+            std::atomic<int> remaining { (int)toAnalyse.size() };
+            WaitableEvent finished;
+
+            // Every job writes to its own slot, so there's nothing to lock
+            for (auto index : toAnalyse)
+            {
+                pool.addJob([&, index]
+                            {
+                                if (!shouldStop())
+                                    analyseFile(files.getReference((int)index), results[index]);
+
+                                if (--remaining == 0)
+                                    finished.signal();
+                            });
+            }
+
+            while (!finished.wait(50))
+            {
+                if (shouldStop())
+                {
+                    // The jobs refer to this frame, so drop the ones that haven't started and wait for the rest
+                    pool.removeAllJobs(true, -1);
+                    return 0;
+                }
+            }
+        }
+
+        samples.clear();
+        unreadable.clear();
+
+        for (auto& info : results)
+            (info.lengthInSamples > 0 ? samples : unreadable).push_back(std::move(info));
+
+        auto byPath = [](const SampleInfo& a, const SampleInfo& b) { return a.path < b.path; };
+        std::sort(samples.begin(), samples.end(), byPath);
+        std::sort(unreadable.begin(), unreadable.end(), byPath);
+
+        return (int)toAnalyse.size();
+    }
+
+    /** Looks a file up by path. Doesn't check whether the entry is stale. */
+    const SampleInfo* find(const File& file) const    { return findIn(samples, file); }
+
+    const std::vector<SampleInfo>& getSamples() const noexcept    { return samples; }
+
+    /** The number of files the last scan found but couldn't read. */
+    int getNumUnreadable() const noexcept                         { return (int)unreadable.size(); }
+
+    //==============================================================================
+    bool loadFrom(const File& indexFile)
+    {
+        FileInputStream in(indexFile);
+
+        if (!in.openedOk() || in.readInt() != magicNumber || in.readInt() != formatVersion)
+            return false;
+
+        auto numEntries = in.readInt();
+
+        if (numEntries < 0 || numEntries > maxEntries)
+            return false;
+
+        std::vector<SampleInfo> loaded;
+        loaded.reserve((size_t)numEntries);
+
+        for (int i = 0; i < numEntries && !in.isExhausted(); ++i)
+        {
+            SampleInfo info;
+            info.path             = in.readString();
+            info.fileSize         = in.readInt64();
+            info.modificationTime = in.readInt64();
+            info.formatName       = in.readString();
+            info.sampleRate       = in.readDouble();
+            info.numChannels      = in.readShort();
+            info.bitsPerSample    = in.readShort();
+            info.lengthInSamples  = in.readInt64();
+            info.rootNote         = in.readShort();
+            info.peak             = in.readFloat();
+            info.loudnessDecibels = in.readFloat();
+
+            loaded.push_back(std::move(info));
+        }
+
+        if ((int)loaded.size() != numEntries)
+            return false;
+
+        auto numUnreadable = in.readInt();
+
+        if (numUnreadable < 0 || numUnreadable > maxEntries)
+            return false;
+
+        std::vector<SampleInfo> loadedUnreadable;
+        loadedUnreadable.reserve((size_t)numUnreadable);
+
+        for (int i = 0; i < numUnreadable && !in.isExhausted(); ++i)
+        {
+            SampleInfo info;
+            info.path             = in.readString();
+            info.fileSize         = in.readInt64();
+            info.modificationTime = in.readInt64();
+
+            loadedUnreadable.push_back(std::move(info));
+        }
+
+        if ((int)loadedUnreadable.size() != numUnreadable)
+            return false;
+
+        samples = std::move(loaded);
+        unreadable = std::move(loadedUnreadable);
+        return true;
+    }
+
+    bool saveTo(const File& indexFile) const
+    {
+        indexFile.getParentDirectory().createDirectory();
+
+        TemporaryFile temp(indexFile);
+
+        {
+            FileOutputStream out(temp.getFile());
+
+            if (!out.openedOk())
+                return false;
+
+            out.writeInt(magicNumber);
+            out.writeInt(formatVersion);
+            out.writeInt((int)samples.size());
+
+            for (auto& info : samples)
+            {
+                out.writeString(info.path);
+                out.writeInt64(info.fileSize);
+                out.writeInt64(info.modificationTime);
+                out.writeString(info.formatName);
+                out.writeDouble(info.sampleRate);
+                out.writeShort((short)info.numChannels);
+                out.writeShort((short)info.bitsPerSample);
+                out.writeInt64(info.lengthInSamples);
+                out.writeShort((short)info.rootNote);
+                out.writeFloat(info.peak);
+                out.writeFloat(info.loudnessDecibels);
+            }
+
+            out.writeInt((int)unreadable.size());
+
+            for (auto& info : unreadable)
+            {
+                out.writeString(info.path);
+                out.writeInt64(info.fileSize);
+                out.writeInt64(info.modificationTime);
+            }
+
+            out.flush();
+
+            if (out.getStatus().failed())
+                return false;
+        }
+
+        return temp.overwriteTargetFileWithTemporary();
+    }
+
+    /** Where the index for a given library folder is kept between runs. */
+    static File getIndexFileFor(const File& directory)
+    {
+        return File::getSpecialLocation(File::userApplicationDataDirectory)
+                 .getChildFile("AudioSynthesiserDemo")
+                 .getChildFile("SampleIndexes")
+                 .getChildFile(String::toHexString(directory.getFullPathName().hashCode64()) + ".index");
+    }
+
+    //==============================================================================
+    /** Guesses a root note from names like "lyra_D4.wav", "drone-F#2.flac" or
+        "bell_62.ogg", using the C4 = 60 convention. Returns -1 if there's no match.
+    */
+    static int parseRootNoteFromName(const String& fileNameWithoutExtension)
+    {
+        auto tokens = StringArray::fromTokens(fileNameWithoutExtension, "_- .", {});
+
+        for (int i = tokens.size(); --i >= 0;)
+        {
+            auto token = tokens[i].trim();
+
+            if (token.isEmpty())
+                continue;
+
+            static const int pitchClasses[] = { 9, 11, 0, 2, 4, 5, 7 }; // A B C D E F G
+            auto letter = CharacterFunctions::toUpperCase(token[0]);
+
+            if (letter >= 'A' && letter <= 'G')
+            {
+                auto pitchClass = pitchClasses[letter - 'A'];
+                auto rest = token.substring(1);
+
+                if (rest.startsWithChar('#'))       { ++pitchClass; rest = rest.substring(1); }
+                else if (rest.startsWithChar('b'))  { --pitchClass; rest = rest.substring(1); }
+
+                if (rest.isNotEmpty() && rest.removeCharacters("-").containsOnly("0123456789"))
+                {
+                    auto note = (rest.getIntValue() + 1) * 12 + pitchClass;
+
+                    if (isPositiveAndBelow(note, 128))
+                        return note;
+                }
+            }
+            else if (token.containsOnly("0123456789") && token.length() <= 3)
+            {
+                auto note = token.getIntValue();
+
+                if (isPositiveAndBelow(note, 128))
+                    return note;
+            }
+        }
+
+        return -1;
+    }
+
+    static constexpr const char* supportedWildcard = "*.wav;*.flac;*.ogg;*.aif;*.aiff";
+
+private:
+    static const SampleInfo* findIn(const std::vector<SampleInfo>& sortedByPath, const File& file)
+    {
+        auto path = file.getFullPathName();
+
+        auto it = std::lower_bound(sortedByPath.begin(), sortedByPath.end(), path,
+                                   [](const SampleInfo& info, const String& p) { return info.path < p; });
+
+        return it != sortedByPath.end() && it->path == path ? &*it : nullptr;
+    }
+
+    static void analyseFile(const File& file, SampleInfo& info)
+    {
+        info.path = file.getFullPathName();
+        info.fileSize = file.getSize();
+        info.modificationTime = file.getLastModificationTime().toMilliseconds();
+
+        AudioFormatManager formatManager;
+        formatManager.registerBasicFormats();
+
+        std::unique_ptr<AudioFormatReader> reader(formatManager.createReaderFor(file));
+
+        if (reader == nullptr)
+            return;
+
+        info.formatName = reader->getFormatName();
+        info.sampleRate = reader->sampleRate;
+        info.numChannels = (int)reader->numChannels;
+        info.bitsPerSample = (int)reader->bitsPerSample;
+        info.lengthInSamples = reader->lengthInSamples;
+
+        auto unityNote = reader->metadataValues.getValue("MidiUnityNote", {});
+
+        if (unityNote.isNotEmpty())
+            info.rootNote = jlimit(0, 127, unityNote.getIntValue());
+        else
+            info.rootNote = parseRootNoteFromName(file.getFileNameWithoutExtension());
+
+        // Decode the whole file once, in chunks, for the peak and RMS level
+        constexpr int chunkSize = 65536;
+        AudioBuffer<float> chunk(jmax(1, info.numChannels), chunkSize);
+
+        double sumOfSquares = 0.0;
+        float peak = 0.0f;
+
+        for (int64 position = 0; position < info.lengthInSamples; position += chunkSize)
+        {
+            auto numThisTime = (int)jmin((int64)chunkSize, info.lengthInSamples - position);
+            reader->read(&chunk, 0, numThisTime, position, true, true);
+
+            for (int ch = 0; ch < chunk.getNumChannels(); ++ch)
+            {
+                auto* data = chunk.getReadPointer(ch);
+                peak = jmax(peak, chunk.getMagnitude(ch, 0, numThisTime));
+
+                for (int i = 0; i < numThisTime; ++i)
+                    sumOfSquares += (double)data[i] * data[i];
+            }
+        }
+
+        auto numValues = (double)info.lengthInSamples * chunk.getNumChannels();
+
+        info.peak = peak;
+        info.loudnessDecibels = Decibels::gainToDecibels((float)std::sqrt(sumOfSquares / jmax(1.0, numValues)));
+    }
+
+    static constexpr int magicNumber = 0x494c5343; // "CSLI"
+    static constexpr int formatVersion = 2;
+    static constexpr int maxEntries = 1 << 22;
+
+    std::vector<SampleInfo> samples;    // sorted by path
+    std::vector<SampleInfo> unreadable; // sorted by path, with only the path, size and modification time
+
+    JUCE_LEAK_DETECTOR(SampleLibraryIndex)
+};
+
+//==============================================================================
+/** Brings the index for a library folder up to date on a background thread.
+
+    The saved index is loaded first, so only new or modified files are decoded,
+    and the refreshed index is written back before the callback is invoked on
+    the message thread, which is told whether that worked.
+*/
+class SampleLibraryScanner final : private Thread
+{
+public:
+    using Callback = std::function<void(std::shared_ptr<const SampleLibraryIndex>, int numFilesOpened, bool indexSaved)>;
+
+    SampleLibraryScanner() : Thread("Sample library scanner") {}
+
+    ~SampleLibraryScanner() override
+    {
+        stopThread(10000);
+    }
+
+    void scanAsync(const File& directory, Callback onFinished)
+    {
+        stopThread(10000);
+
+        directoryToScan = directory;
+        callback = std::move(onFinished);
+
+        startThread(Thread::Priority::background);
+    }
+
+    bool isScanning() const    { return isThreadRunning(); }
+
+private:
+    void run() override
+    {
+        auto index = std::make_shared<SampleLibraryIndex>();
+        auto indexFile = SampleLibraryIndex::getIndexFileFor(directoryToScan);
+
+        index->loadFrom(indexFile);
+        auto numFilesOpened = index->scan(directoryToScan, pool);
+
+        if (threadShouldExit())
+            return;
+
+        auto indexSaved = index->saveTo(indexFile);
+
+        MessageManager::callAsync([onFinished = callback, index, numFilesOpened, indexSaved]
+                                  {
+                                      if (onFinished != nullptr)
+                                          onFinished(index, numFilesOpened, indexSaved);
+                                  });
+    }
+
+    ThreadPool pool { jmax(1, SystemStats::getNumCpus() - 1) };
+    File directoryToScan;
+    Callback callback;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SampleLibraryScanner)
+};
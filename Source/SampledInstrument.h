@@ -0,0 +1,560 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "SampleCache.h"
+#include "SampleLibraryIndex.h"
+#include "SmoothedParameter.h"
+
+//==============================================================================
+/*  A multi-zone sampled instrument.
+
+    An instrument definition is a small XML file that maps key ranges and velocity
+    layers to sample files, relative to the definition itself:
+
+        <instrument name="Lyra" attack="0.01" release="0.3">
+          <zone sample="lyra_d4_soft.wav" lowNote="60" highNote="65" rootNote="62"
+                lowVelocity="0" highVelocity="79"/>
+          <zone sample="lyra_d4_hard.wav" lowNote="60" highNote="65" rootNote="62"
+                lowVelocity="80" highVelocity="127"/>
+        </instrument>
+
+    Parsing the definition doesn't touch any audio. Each zone's sample is decoded
+    into the SampleCache by the ZoneLoader thread the first time a note needs it,
+    and until it arrives the voice plays the nearest zone that's already resident.
+*/
+struct SampleZone final : public ReferenceCountedObject
+{
+    using Ptr = ReferenceCountedObjectPtr<SampleZone>;
+
+    bool contains(int midiNote, int velocity) const noexcept
+    {
+        return midiNote >= lowNote && midiNote <= highNote
+            && velocity >= lowVelocity && velocity <= highVelocity;
+    }
+
+    /** How far this zone is from a note/velocity pair. Velocity counts for
+        much less than pitch, so a fallback prefers the right keys
+        in the wrong layer over the right layer on the wrong keys.
+    */
+    int getDistanceTo(int midiNote, int velocity) const noexcept
+    {
+        auto noteDistance = midiNote < lowNote ? lowNote - midiNote
+                          : (midiNote > highNote ? midiNote - highNote : 0);
+
+        auto velocityDistance = velocity < lowVelocity ? lowVelocity - velocity
+                              : (velocity > highVelocity ? velocity - highVelocity : 0);
+
+        return noteDistance * 128 + velocityDistance;
+    }
+
+    bool isLoaded() const noexcept    { return sample->isResident(); }
+
+    CachedSample::Ptr sample;
+    int lowNote = 0, highNote = 127, rootNote = 60;
+    int lowVelocity = 0, highVelocity = 127;
+};
+
+//==============================================================================
+/** Decodes samples into the SampleCache on a background thread, and lets the
+    cache free evicted samples between requests.
+
+    The audio thread only ever pushes a sample pointer into a lock-free FIFO, so
+    asking for a zone costs nothing more than a couple of atomic operations.
+    An AbstractFifo only allows one writer, so requests from any other thread
+    go into a second FIFO, whose writers take turns under a lock.
+*/
+class ZoneLoader final : private Thread
+{
+public:
+    explicit ZoneLoader(SampleCache& cacheToUse)
+        : Thread("Sample zone loader"), cache(cacheToUse)
+    {
+        startThread(Thread::Priority::low);
+    }
+
+    ~ZoneLoader() override
+    {
+        stopThread(4000);
+
+        // Drop the references to anything that was still waiting to load
+        for (auto* queue : { &audioThreadRequests, &otherRequests })
+            while (auto* sample = queue->pop())
+                sample->decReferenceCount();
+    }
+
+    SampleCache& getCache() noexcept    { return cache; }
+
+    /** Queues a sample for decoding. Call this only from the audio thread. */
+    void requestLoad(CachedSample& sample)
+    {
+        push(audioThreadRequests, sample);
+    }
+
+    /** Queues a sample for decoding from any thread but the audio thread. */
+    void requestPreload(CachedSample& sample)
+    {
+        const ScopedLock sl(otherRequestsLock);
+        push(otherRequests, sample);
+    }
+
+private:
+    //==============================================================================
+    static constexpr int maxPendingRequests = 256;
+
+    /** A single-reader, single-writer queue of samples waiting to be decoded. */
+    struct RequestQueue
+    {
+        bool push(CachedSample* sample)
+        {
+            int start1, size1, start2, size2;
+            fifo.prepareToWrite(1, start1, size1, start2, size2);
+
+            if (size1 + size2 == 0)
+                return false;
+
+            slots[(size_t)(size1 > 0 ? start1 : start2)] = sample;
+            fifo.finishedWrite(1);
+            return true;
+        }
+
+        CachedSample* pop()
+        {
+            int start1, size1, start2, size2;
+            fifo.prepareToRead(1, start1, size1, start2, size2);
+
+            if (size1 + size2 == 0)
+                return nullptr;
+
+            auto* sample = slots[(size_t)(size1 > 0 ? start1 : start2)];
+            fifo.finishedRead(1);
+            return sample;
+        }
+
+        AbstractFifo fifo { maxPendingRequests };
+        std::array<CachedSample*, (size_t)maxPendingRequests> slots {};
+    };
+
+    static void push(RequestQueue& queue, CachedSample& sample)
+    {
+        auto expected = (int)CachedSample::unloaded;
+
+        if (!sample.state.compare_exchange_strong(expected, (int)CachedSample::queued))
+            return;
+
+        sample.incReferenceCount();
+
+        if (!queue.push(&sample))
+        {
+            // The queue is full: put the sample back so the next note can try again
+            sample.state.store(CachedSample::unloaded);
+            sample.decReferenceCountWithoutDeleting();
+        }
+    }
+
+    CachedSample* popRequest()
+    {
+        // The audio thread's requests are for notes being played, so they go first
+        if (auto* sample = audioThreadRequests.pop())
+            return sample;
+
+        return otherRequests.pop();
+    }
+
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            if (auto* sample = popRequest())
+            {
+                CachedSample::Ptr holder(sample);
+                sample->decReferenceCountWithoutDeleting();
+
+                // If this fails, decode() marks the sample as failed, and it's counted in the cache's statistics
+                cache.decode(*sample);
+                continue;
+            }
+
+            cache.collectGarbage();
+
+            // The audio thread never signals us, so just poll the queue briskly
+            wait(5);
+        }
+    }
+
+    SampleCache& cache;
+    RequestQueue audioThreadRequests, otherRequests;
+    CriticalSection otherRequestsLock;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ZoneLoader)
+};
+
+//==============================================================================
+/** A sound made of key/velocity zones that are decoded on demand. */
+class ZonedSamplerSound final : public SynthesiserSound
+{
+public:
+    using Ptr = ReferenceCountedObjectPtr<ZonedSamplerSound>;
+
+    ZonedSamplerSound(const String& soundName, ZoneLoader& loaderToUse)
+        : name(soundName), loader(loaderToUse)
+    {
+    }
+
+    /** Parses an instrument definition. No sample data is read here; zones that
+        don't give a root note take it from the library index if there is one.
+    */
+    static Ptr createFromDefinition(const File& definitionFile, ZoneLoader& loaderToUse,
+                                    const SampleLibraryIndex* index = nullptr)
+    {
+        auto xml = XmlDocument::parse(definitionFile);
+
+        if (xml == nullptr || !xml->hasTagName("instrument"))
+            return nullptr;
+
+        Ptr sound(new ZonedSamplerSound(xml->getStringAttribute("name", definitionFile.getFileNameWithoutExtension()),
+                                        loaderToUse));
+
+        sound->envelope.attack  = (float)xml->getDoubleAttribute("attack", 0.01);
+        sound->envelope.decay   = 0.0f;
+        sound->envelope.sustain = 1.0f;
+        sound->envelope.release = (float)xml->getDoubleAttribute("release", 0.3);
+
+        auto baseDirectory = definitionFile.getParentDirectory();
+
+        for (auto* zoneXml : xml->getChildWithTagNameIterator("zone"))
+        {
+            auto sampleFile = baseDirectory.getChildFile(zoneXml->getStringAttribute("sample"));
+
+            auto* zone = new SampleZone();
+            zone->sample       = loaderToUse.getCache().getEntry(sampleFile);
+            zone->lowNote      = jlimit(0, 127, zoneXml->getIntAttribute("lowNote", 0));
+            zone->highNote     = jlimit(zone->lowNote, 127, zoneXml->getIntAttribute("highNote", 127));
+            zone->rootNote     = zoneXml->getIntAttribute("rootNote", -1);
+            zone->lowVelocity  = jlimit(0, 127, zoneXml->getIntAttribute("lowVelocity", 0));
+            zone->highVelocity = jlimit(zone->lowVelocity, 127, zoneXml->getIntAttribute("highVelocity", 127));
+
+            if (zone->rootNote < 0 && index != nullptr)
+                if (auto* info = index->find(sampleFile))
+                    zone->rootNote = info->rootNote;
+
+            if (zone->rootNote < 0)
+                zone->rootNote = SampleLibraryIndex::parseRootNoteFromName(sampleFile.getFileNameWithoutExtension());
+
+            if (zone->rootNote < 0)
+                zone->rootNote = (zone->lowNote + zone->highNote) / 2;
+
+            sound->addZone(zone);
+        }
+
+        if (sound->zones.isEmpty())
+            return nullptr;
+
+        sound->preloadAnchorZone();
+        return sound;
+    }
+
+    /** Builds an instrument straight from a library index, without opening any
+        of its files. Each recorded pitch covers the keys half way to its
+        neighbours, and recordings of the same pitch become velocity layers in
+        order of loudness.
+    */
+    static Ptr createFromLibrary(const String& soundName, const SampleLibraryIndex& index, ZoneLoader& loaderToUse)
+    {
+        std::map<int, std::vector<const SampleInfo*>> samplesByRoot;
+
+        for (auto& info : index.getSamples())
+            if (info.rootNote >= 0)
+                samplesByRoot[info.rootNote].push_back(&info);
+
+        if (samplesByRoot.empty())
+            return nullptr;
+
+        std::vector<int> roots;
+
+        for (auto& group : samplesByRoot)
+            roots.push_back(group.first);
+
+        Ptr sound(new ZonedSamplerSound(soundName, loaderToUse));
+
+        for (size_t r = 0; r < roots.size(); ++r)
+        {
+            auto root = roots[r];
+            auto lowNote  = r == 0 ? 0 : (roots[r - 1] + root) / 2 + 1;
+            auto highNote = r + 1 == roots.size() ? 127 : (root + roots[r + 1]) / 2;
+
+            auto& layers = samplesByRoot[root];
+            std::sort(layers.begin(), layers.end(),
+                      [](const SampleInfo* a, const SampleInfo* b) { return a->loudnessDecibels < b->loudnessDecibels; });
+
+            auto numLayers = (int)layers.size();
+
+            for (int layer = 0; layer < numLayers; ++layer)
+            {
+                auto* zone = new SampleZone();
+                zone->sample       = loaderToUse.getCache().getEntry(File(layers[(size_t)layer]->path));
+                zone->rootNote     = root;
+                zone->lowNote      = lowNote;
+                zone->highNote     = highNote;
+                zone->lowVelocity  = layer * 128 / numLayers;
+                zone->highVelocity = (layer + 1) * 128 / numLayers - 1;
+
+                sound->addZone(zone);
+            }
+        }
+
+        sound->preloadAnchorZone();
+        return sound;
+    }
+
+    /** Wraps a single sample that covers the whole keyboard. */
+    static Ptr createSingleZone(const String& soundName, CachedSample::Ptr sample,
+                                int rootNote, ZoneLoader& loaderToUse)
+    {
+        Ptr sound(new ZonedSamplerSound(soundName, loaderToUse));
+
+        auto* zone = new SampleZone();
+        zone->sample = sample;
+        zone->rootNote = rootNote;
+        sound->addZone(zone);
+
+        return sound;
+    }
+
+    void addZone(SampleZone::Ptr zone)
+    {
+        coveredNotes.setRange(zone->lowNote, zone->highNote - zone->lowNote + 1, true);
+        zones.add(zone);
+    }
+
+    bool appliesToNote(int midiNoteNumber) override    { return coveredNotes[midiNoteNumber]; }
+    bool appliesToChannel(int /*midiChannel*/) override { return true; }
+
+    /** Picks the zone for a note. If the exact zone isn't resident yet, it's queued
+        for loading and the nearest zone that is resident is returned instead.
+        Returns nullptr if nothing at all has been loaded so far.
+    */
+    SampleZone* findZoneForNote(int midiNote, int velocity)
+    {
+        SampleZone* bestLoaded = nullptr;
+        auto bestDistance = std::numeric_limits<int>::max();
+        auto missed = false;
+
+        for (auto* zone : zones)
+        {
+            if (zone->contains(midiNote, velocity))
+            {
+                if (zone->isLoaded())
+                {
+                    loader.getCache().recordHit();
+                    return zone;
+                }
+
+                loader.requestLoad(*zone->sample);
+                missed = true;
+            }
+
+            if (zone->isLoaded())
+            {
+                auto distance = zone->getDistanceTo(midiNote, velocity);
+
+                if (distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    bestLoaded = zone;
+                }
+            }
+        }
+
+        if (missed)
+            loader.getCache().recordMiss();
+
+        return bestLoaded;
+    }
+
+    int getNumZones() const noexcept                     { return zones.size(); }
+    SampleZone* getZone(int index) const noexcept        { return zones[index].get(); }
+    const String& getName() const noexcept               { return name; }
+    const ADSR::Parameters& getEnvelope() const noexcept { return envelope; }
+    SampleCache& getCache() noexcept                     { return loader.getCache(); }
+
+    ADSR::Parameters envelope { 0.01f, 0.0f, 1.0f, 0.3f };
+
+private:
+    /** Starts decoding the zone nearest the middle of the keyboard, so there's
+        something to fall back on by the time the first note arrives.
+    */
+    void preloadAnchorZone()
+    {
+        SampleZone* anchor = nullptr;
+        auto bestDistance = std::numeric_limits<int>::max();
+
+        for (auto* zone : zones)
+        {
+            auto distance = zone->getDistanceTo(60, 80);
+
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                anchor = zone;
+            }
+        }
+
+        // This runs wherever the sound is built, which is never the audio thread
+        if (anchor != nullptr)
+            loader.requestPreload(*anchor->sample);
+    }
+
+    String name;
+    ZoneLoader& loader;
+    ReferenceCountedArray<SampleZone> zones;
+    BigInteger coveredNotes;
+
+    JUCE_LEAK_DETECTOR(ZonedSamplerSound)
+};
+
+//==============================================================================
+/** Plays a ZonedSamplerSound, much like SamplerVoice plays a SamplerSound.
+
+    While it's playing, the voice holds its sample in the SampleCache so that
+    eviction can't free it mid-note. It follows pitch bend, the mod wheel and
+    channel volume through a VoiceControls.
+*/
+class ZonedSamplerVoice final : public SynthesiserVoice
+{
+public:
+    ~ZonedSamplerVoice() override
+    {
+        releaseSample();
+    }
+
+    bool canPlaySound(SynthesiserSound* sound) override
+    {
+        return dynamic_cast<ZonedSamplerSound*>(sound) != nullptr;
+    }
+
+    void startNote(int midiNoteNumber, float velocity,
+                   SynthesiserSound* sound, int currentPitchWheelPosition) override
+    {
+        auto* zonedSound = dynamic_cast<ZonedSamplerSound*>(sound);
+        jassert(zonedSound != nullptr);
+
+        releaseSample();
+
+        auto* zone = zonedSound->findZoneForNote(midiNoteNumber, roundToInt(velocity * 127.0f));
+
+        if (zone == nullptr || !zonedSound->getCache().acquire(*zone->sample))
+        {
+            // Nothing suitable is resident yet, so there's nothing we can play
+            clearCurrentNote();
+            return;
+        }
+
+        sample = zone->sample.get();
+        cache = &zonedSound->getCache();
+
+        pitchRatio = std::pow(2.0, (midiNoteNumber - zone->rootNote) / 12.0)
+                        * sample->sourceSampleRate / getSampleRate();
+
+        sourceSamplePosition = 0.0;
+        gain = velocity;
+
+        adsr.setSampleRate(getSampleRate());
+        adsr.setParameters(zonedSound->getEnvelope());
+        adsr.noteOn();
+
+        controls.prepare(getSampleRate());
+        controls.startNote(currentPitchWheelPosition);
+    }
+
+    void stopNote(float /*velocity*/, bool allowTailOff) override
+    {
+        if (allowTailOff)
+        {
+            adsr.noteOff();
+        }
+        else
+        {
+            clearCurrentNote();
+            adsr.reset();
+            releaseSample();
+        }
+    }
+
+    void pitchWheelMoved(int newValue) override                              { controls.pitchWheelMoved(newValue); }
+    void controllerMoved(int controllerNumber, int newValue) override        { controls.controllerMoved(controllerNumber, newValue); }
+
+    void renderNextBlock(AudioBuffer<float>& outputBuffer, int startSample, int numSamples) override
+    {
+        // In chunks, so the controls can hand over their smoothed values in fixed-size arrays
+        while (numSamples > 0 && sample != nullptr && isVoiceActive())
+        {
+            auto chunk = jmin(numSamples, VoiceControls::maxChunkSize);
+            auto* pitch = controls.getNextPitchMultipliers(chunk);
+            auto* gains = controls.getNextGains(chunk);
+
+            renderChunk(outputBuffer, startSample, chunk, pitch, gains);
+            startSample += chunk;
+            numSamples -= chunk;
+        }
+    }
+
+    using SynthesiserVoice::renderNextBlock;
+
+private:
+    void renderChunk(AudioBuffer<float>& outputBuffer, int startSample, int numSamples,
+                     const float* pitch, const float* gains)
+    {
+        auto* inL = sample->data.getReadPointer(0);
+        auto* inR = sample->data.getNumChannels() > 1 ? sample->data.getReadPointer(1) : nullptr;
+
+        auto* outL = outputBuffer.getWritePointer(0, startSample);
+        auto* outR = outputBuffer.getNumChannels() > 1 ? outputBuffer.getWritePointer(1, startSample) : nullptr;
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto pos = (int)sourceSamplePosition;
+            auto alpha = (float)(sourceSamplePosition - pos);
+            auto invAlpha = 1.0f - alpha;
+
+            auto l = inL[pos] * invAlpha + inL[pos + 1] * alpha;
+            auto r = inR != nullptr ? inR[pos] * invAlpha + inR[pos + 1] * alpha : l;
+
+            auto envelopeValue = adsr.getNextSample() * gain * gains[i];
+
+            if (outR != nullptr)
+            {
+                *outL++ += l * envelopeValue;
+                *outR++ += r * envelopeValue;
+            }
+            else
+            {
+                *outL++ += (l + r) * 0.5f * envelopeValue;
+            }
+
+            sourceSamplePosition += pitchRatio * pitch[i];
+
+            if (sourceSamplePosition > sample->length || !adsr.isActive())
+            {
+                stopNote(0.0f, false);
+                break;
+            }
+        }
+    }
+
+    void releaseSample() noexcept
+    {
+        if (sample != nullptr)
+            cache->release(*sample);
+
+        sample = nullptr;
+    }
+
+    CachedSample* sample = nullptr;
+    SampleCache* cache = nullptr;
+    double pitchRatio = 1.0, sourceSamplePosition = 0.0;
+    float gain = 1.0f;
+    ADSR adsr;
+    VoiceControls controls;
+
+    JUCE_LEAK_DETECTOR(ZonedSamplerVoice)
+};
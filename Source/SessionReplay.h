@@ -0,0 +1,346 @@
+#pragma once
+
+#include "AudioSynthesiserDemo.h"
+#include "CommandLineOptions.h"
+#include <iostream>
+
+//==============================================================================
+/** Plays a recorded MIDI session back through the synth, offline, and profiles it.
+
+    Start the app with:
+
+        --replay <session.midilog> [--profile-out=<path>] [--parallel]
+
+    Every block is rendered with exactly the size and MIDI it had when it was
+    recorded, with the same sounds switched in at the same points, so a glitch
+    heard live can be reproduced and profiled as often as needed. Instruments
+    are decoded up front rather than streamed in, the reverb's tail is convolved
+    inline, and the voices are rendered serially unless --parallel is given,
+    which makes the output bit-exact from one run to the next; the checksum
+    printed at the end shows it.
+
+    Each block's render time is compared with the time the device gave it, and
+    the worst blocks are listed. --profile-out writes every block's figures as CSV.
+*/
+class SessionReplay final
+{
+public:
+    static int run(const String& commandLine)
+    {
+        auto args = StringArray::fromTokens(commandLine, true);
+        auto logFile = File::getCurrentWorkingDirectory().getChildFile(CommandLineOptions::get(args, "--replay"));
+        auto profileFile = CommandLineOptions::get(args, "--profile-out=");
+
+        MidiSessionLog log;
+
+        if (!log.loadFrom(logFile))
+        {
+            std::cout << "Couldn't read a session from " << logFile.getFullPathName() << std::endl;
+            return 1;
+        }
+
+        std::cout << "Replaying " << logFile.getFileName() << ": " << log.getTotalBlocks() << " blocks, "
+                  << log.events.size() << " MIDI events at " << log.sampleRate << " Hz" << std::endl;
+
+        if (log.numDroppedBlocks > 0)
+            std::cout << "Warning: " << log.numDroppedBlocks << " blocks were lost while recording, "
+                      << "so this won't match the live session" << std::endl;
+
+        MidiKeyboardState keyboardState;
+        FFTAnalyzer fftAnalyzer;
+        SynthAudioSource source(keyboardState, fftAnalyzer);
+        source.synth.setParallelRenderingEnabled(args.contains("--parallel"));
+
+        // Like the serial voices, this keeps the reverb's output the same from run to run
+        source.reverb.setBackgroundProcessing(false);
+
+        auto maxBlockSize = 0;
+
+        for (auto& step : log.steps)
+            maxBlockSize = jmax(maxBlockSize, step.numSamples);
+
+        source.prepareToPlay(maxBlockSize, log.sampleRate);
+
+        AudioBuffer<float> buffer(2, maxBlockSize);
+        MidiBuffer midi, noMidi;
+        midi.ensureSize(4096);
+
+        std::vector<BlockProfile> blocks;
+        blocks.reserve((size_t)log.getTotalBlocks());
+
+        auto soundGeneration = -1;
+        auto checksum = fnvOffsetBasis;
+        int64 position = 0;
+
+        for (auto& step : log.steps)
+        {
+            if (step.soundGeneration != soundGeneration)
+            {
+                // Several sounds can be switched between two blocks, and only the last switch is marked
+                for (auto it = log.soundDescriptions.upper_bound(soundGeneration);
+                     it != log.soundDescriptions.end() && it->first <= step.soundGeneration; ++it)
+                    restoreSound(source, it->second);
+
+                soundGeneration = step.soundGeneration;
+            }
+
+            log.getMidi(step, midi);
+
+            for (int i = 0; i < step.repeatCount; ++i)
+            {
+                auto& blockMidi = i == 0 ? midi : noMidi;
+                buffer.clear();
+
+                auto startTicks = Time::getHighResolutionTicks();
+                source.renderBlock(buffer, 0, step.numSamples, blockMidi);
+                auto elapsedTicks = Time::getHighResolutionTicks() - startTicks;
+
+                BlockProfile block;
+                block.index = (int64)blocks.size();
+                block.position = position;
+                block.startSeconds = (double)position / log.sampleRate;
+                block.numSamples = step.numSamples;
+                block.numEvents = blockMidi.getNumEvents();
+                block.numVoices = source.synth.getStatistics().numActiveVoices;
+                block.renderMs = Time::highResolutionTicksToSeconds(elapsedTicks) * 1000.0;
+                block.budgetMs = 1000.0 * step.numSamples / log.sampleRate;
+                blocks.push_back(block);
+
+                checksum = addToChecksum(checksum, buffer, step.numSamples);
+                position += step.numSamples;
+            }
+        }
+
+        printReport(blocks, (double)position / log.sampleRate);
+        printCounters(source);
+        std::cout << "Output checksum: " << String::toHexString((int64)checksum) << std::endl;
+
+        if (profileFile.isNotEmpty())
+        {
+            auto file = File::getCurrentWorkingDirectory().getChildFile(profileFile);
+
+            if (writeProfile(file, blocks))
+                std::cout << "Per-block profile written to " << file.getFullPathName() << std::endl;
+            else
+                std::cout << "Couldn't write " << file.getFullPathName() << std::endl;
+        }
+
+        return 0;
+    }
+
+private:
+    //==============================================================================
+    struct BlockProfile
+    {
+        int64 index = 0, position = 0;
+        int numSamples = 0, numEvents = 0, numVoices = 0;
+        double startSeconds = 0.0, renderMs = 0.0, budgetMs = 0.0;
+    };
+
+    /** Descriptions look like "sine", "polyblep:<waveform>:<oversampling>", "additive:<preset>:<partials>",
+        "fm:<preset>", "wavetable:sample", "wavetable:<path>", "instrument:<path>",
+        "part:<channel>:<description>", "reserve:<channel>:<voices>", "spread:<amount>", "stems:<layout>",
+        "filter:<mode>:<cutoff>:<resonance>",
+        "reverb:<SynthAudioSource::getReverbNames() index>" or "reverblevel:<wet level>".
+    */
+    static void restoreSound(SynthAudioSource& source, const String& description)
+    {
+        auto sound = description;
+        auto midiChannel = 0;
+
+        if (sound.startsWith("part:"))
+        {
+            sound = sound.fromFirstOccurrenceOf("part:", false, false);
+            midiChannel = sound.upToFirstOccurrenceOf(":", false, false).getIntValue();
+            sound = sound.fromFirstOccurrenceOf(":", false, false);
+        }
+
+        auto type = sound.upToFirstOccurrenceOf(":", false, false);
+        auto path = sound.fromFirstOccurrenceOf(":", false, false);
+        auto restored = true;
+
+        if (type == "sampled")
+        {
+            source.setUsingSampledSound(midiChannel);
+        }
+        else if (type == "polyblep")
+        {
+            auto waveform = jlimit(0, 3, path.upToFirstOccurrenceOf(":", false, false).getIntValue());
+            auto factor = path.fromFirstOccurrenceOf(":", false, false).getIntValue();
+            source.setUsingPolyBlepSound((PolyBlepOscillator::Waveform)waveform, factor == 4 || factor == 2 ? factor : 1, midiChannel);
+        }
+        else if (type == "fm")
+        {
+            source.setUsingFmSound(jlimit(0, FmSound::getPresetNames().size() - 1, path.getIntValue()), midiChannel);
+        }
+        else if (type == "additive")
+        {
+            auto preset = jlimit(0, 1, path.upToFirstOccurrenceOf(":", false, false).getIntValue());
+            auto numPartials = path.fromFirstOccurrenceOf(":", false, false).getIntValue();
+            source.setUsingAdditiveSound((AdditiveSound::Preset)preset, jlimit(1, AdditiveSound::maxPartials, numPartials), midiChannel);
+        }
+        else if (type == "wavetable")
+        {
+            restored = path == "sample" ? source.setUsingWavetableSound(midiChannel)
+                                        : source.loadWavetable(File(path), midiChannel);
+        }
+        else if (type == "instrument")
+        {
+            restored = source.loadInstrument(File(path), midiChannel) && source.loadAllInstrumentZones();
+        }
+        else if (type == "library")
+        {
+            SampleLibraryIndex index;
+            restored = index.loadFrom(SampleLibraryIndex::getIndexFileFor(File(path)))
+                         && source.loadSampleLibrary(index, File(path), midiChannel)
+                         && source.loadAllInstrumentZones();
+        }
+        else if (type == "spread")
+        {
+            source.setStereoSpread(path.getFloatValue());
+        }
+        else if (type == "surround")
+        {
+            source.setSurroundPanning(path.getIntValue() != 0);
+        }
+        else if (type == "reverb")
+        {
+            restored = source.setReverb(path.getIntValue());
+        }
+        else if (type == "reverblevel")
+        {
+            source.setReverbLevel(path.getFloatValue());
+        }
+        else if (type == "filter")
+        {
+            auto settings = StringArray::fromTokens(path, ":", {});
+
+            if (settings.size() == 3)
+                source.setVoiceFilter((VoiceFilter::Mode)jlimit(0, 3, settings[0].getIntValue()),
+                                      settings[1].getFloatValue(), settings[2].getFloatValue());
+            else
+                restored = false;
+        }
+        else if (type == "stems")
+        {
+            // Splitting changes the order the voices are summed in, so it's restored too
+            source.setStemLayout((SynthEngine::StemLayout)jlimit(0, 2, path.getIntValue()));
+        }
+        else if (sound.startsWith("reserve:"))
+        {
+            auto channel = path.upToFirstOccurrenceOf(":", false, false).getIntValue();
+            source.setPartVoiceReservation(channel, path.fromFirstOccurrenceOf(":", false, false).getIntValue());
+        }
+        else if (type == "shared" && midiChannel > 0)
+        {
+            source.setUsingSharedSound(midiChannel);
+        }
+        else
+        {
+            source.setUsingSineWaveSound(midiChannel);
+            restored = (type == "sine");
+        }
+
+        std::cout << "Sound: " << (description.isEmpty() ? String("(unknown)") : description)
+                  << (restored ? "" : " - couldn't restore it exactly, the replay will differ") << std::endl;
+    }
+
+    //==============================================================================
+    static void printReport(std::vector<BlockProfile> blocks, double secondsOfAudio)
+    {
+        if (blocks.empty())
+            return;
+
+        double totalMs = 0.0;
+        int overBudget = 0;
+
+        for (auto& block : blocks)
+        {
+            totalMs += block.renderMs;
+
+            if (block.renderMs > block.budgetMs)
+                ++overBudget;
+        }
+
+        std::sort(blocks.begin(), blocks.end(), [](const BlockProfile& a, const BlockProfile& b) { return a.renderMs > b.renderMs; });
+
+        auto percentile = [&blocks](double fraction)
+        {
+            auto rank = (size_t)((1.0 - fraction) * (double)blocks.size());
+            return blocks[jmin(rank, blocks.size() - 1)].renderMs;
+        };
+
+        std::cout << "\nRendered " << String(secondsOfAudio, 2) << " s of audio in " << String(totalMs, 1) << " ms ("
+                  << String(secondsOfAudio * 1000.0 / jmax(0.001, totalMs), 1) << "x realtime)\n"
+                  << "Block render time: mean " << String(totalMs / (double)blocks.size(), 3) << " ms, p50 "
+                  << String(percentile(0.50), 3) << " ms, p99 " << String(percentile(0.99), 3) << " ms, max "
+                  << String(blocks.front().renderMs, 3) << " ms\n"
+                  << overBudget << " blocks took longer than the device allowed them\n"
+                  << "\nSlowest blocks:\n"
+                  << "  block       time (s)   render (ms)   budget %   events   voices" << std::endl;
+
+        for (size_t i = 0; i < jmin((size_t)10, blocks.size()); ++i)
+        {
+            auto& block = blocks[i];
+
+            std::cout << "  " << String(block.index).paddedRight(' ', 10)
+                      << String(block.startSeconds, 3).paddedLeft(' ', 10)
+                      << String(block.renderMs, 3).paddedLeft(' ', 14)
+                      << String(100.0 * block.renderMs / block.budgetMs, 1).paddedLeft(' ', 11)
+                      << String(block.numEvents).paddedLeft(' ', 9)
+                      << String(block.numVoices).paddedLeft(' ', 9) << std::endl;
+        }
+    }
+
+    static void printCounters(SynthAudioSource& source)
+    {
+        auto engineStats = source.synth.getStatistics();
+        auto cacheStats = source.sampleCache.getStatistics();
+
+        std::cout << "\nEngine: " << (int64)engineStats.parallelBlocks << " parallel blocks, "
+                  << (int64)engineStats.serialBlocks << " serial, " << (int64)engineStats.deadlineMisses
+                  << " missed deadlines, " << (int64)engineStats.culledVoices << " voices culled while silent, "
+                  << (int64)engineStats.stolenVoices << " stolen\n"
+                  << "Sample cache: " << (int64)cacheStats.hits << " hits, " << (int64)cacheStats.misses
+                  << " misses, " << (int64)cacheStats.evictions << " evictions" << std::endl;
+    }
+
+    static bool writeProfile(const File& file, const std::vector<BlockProfile>& blocks)
+    {
+        String csv;
+        csv << "block,position,samples,events,voices,render_ms,budget_ms\n";
+
+        for (auto& block : blocks)
+            csv << block.index << "," << block.position << "," << block.numSamples << "," << block.numEvents << ","
+                << block.numVoices << "," << String(block.renderMs, 4) << "," << String(block.budgetMs, 4) << "\n";
+
+        return file.replaceWithText(csv);
+    }
+
+    //==============================================================================
+    static constexpr uint64 fnvOffsetBasis = 0xcbf29ce484222325ull;
+    static constexpr uint64 fnvPrime = 0x100000001b3ull;
+
+    /** FNV-1a over the raw bits of the samples, so any difference at all shows. */
+    static uint64 addToChecksum(uint64 hash, const AudioBuffer<float>& buffer, int numSamples)
+    {
+        for (int channel = 0; channel < buffer.getNumChannels(); ++channel)
+        {
+            auto* samples = buffer.getReadPointer(channel);
+
+            for (int i = 0; i < numSamples; ++i)
+            {
+                uint32 bits;
+                std::memcpy(&bits, samples + i, sizeof(bits));
+
+                for (int byte = 0; byte < 4; ++byte)
+                {
+                    hash ^= (bits >> (8 * byte)) & 0xff;
+                    hash *= fnvPrime;
+                }
+            }
+        }
+
+        return hash;
+    }
+};
@@ -0,0 +1,282 @@
+#pragma once
+
+#include "DemoUtilities.h"
+
+//==============================================================================
+/** A parameter that glides to new values instead of jumping, without zipper noise.
+
+    The target can be set from any thread. The audio thread asks for the values
+    a chunk at a time, and gets them as an array, so the code using them
+    multiplies by it without checking whether anything is moving.
+
+    Each ramp is generated with vector operations from a table that's only
+    rebuilt when a new target arrives: a linear ramp adds a fixed step per
+    sample, an exponential one multiplies by a fixed ratio, which suits
+    pitches and other quantities heard on a log scale. A new target is picked
+    up at the start of a chunk, and a chunk is only split where a ramp ends.
+    A steady parameter costs nothing at all once its array has been filled.
+*/
+class SmoothedParameter final
+{
+public:
+    enum class Ramp { linear, exponential };
+
+    /** The most values that can be asked for at once. */
+    static constexpr int maxChunkSize = 64;
+
+    explicit SmoothedParameter(Ramp rampType, float initialValue = 0.0f) noexcept
+        : ramp(rampType)
+    {
+        setCurrentAndTargetValue(initialValue);
+    }
+
+    /** Sets how long a glide to a new target takes. Call this on the audio thread. */
+    void prepare(double sampleRate, double rampLengthSeconds) noexcept
+    {
+        rampLength = jmax(0, roundToInt(sampleRate * rampLengthSeconds));
+    }
+
+    //==============================================================================
+    /** Can be called from any thread. */
+    void setTargetValue(float newTarget) noexcept    { target.store(limit(newTarget), std::memory_order_relaxed); }
+
+    float getTargetValue() const noexcept    { return target.load(std::memory_order_relaxed); }
+
+    /** Jumps straight to a value, e.g. when a voice starts a note. Call this on the audio thread. */
+    void setCurrentAndTargetValue(float newValue) noexcept
+    {
+        newValue = limit(newValue);
+
+        target.store(newValue, std::memory_order_relaxed);
+        current = rampTarget = newValue;
+        rampRemaining = 0;
+        valuesAreSteady = false;
+    }
+
+    /** Jumps to the target without gliding. Call this on the audio thread. */
+    void skipToTarget() noexcept    { setCurrentAndTargetValue(getTargetValue()); }
+
+    float getCurrentValue() const noexcept    { return current; }
+    bool isSmoothing() const noexcept         { return rampRemaining > 0 || getTargetValue() != rampTarget; }
+
+    //==============================================================================
+    /** Returns the next numSamples values (up to maxChunkSize). The array stays
+        valid until the next call. Call this on the audio thread.
+    */
+    const float* getNextValues(int numSamples) noexcept
+    {
+        jassert(isPositiveAndNotGreaterThan(numSamples, maxChunkSize));
+
+        if (auto newTarget = getTargetValue(); newTarget != rampTarget)
+            startRamp(newTarget);
+
+        if (rampRemaining == 0)
+        {
+            if (!valuesAreSteady)
+            {
+                FloatVectorOperations::fill(values.data(), current, maxChunkSize);
+                valuesAreSteady = true;
+            }
+
+            return values.data();
+        }
+
+        auto numRamped = jmin(numSamples, rampRemaining);
+
+        if (ramp == Ramp::linear)
+            FloatVectorOperations::add(values.data(), rampTable.data(), current, numRamped);
+        else
+            FloatVectorOperations::multiply(values.data(), rampTable.data(), current, numRamped);
+
+        rampRemaining -= numRamped;
+        valuesAreSteady = false;
+
+        if (rampRemaining > 0)
+        {
+            current = values[(size_t)numRamped - 1];
+        }
+        else
+        {
+            // Lands exactly on the target, which holds for the rest of the chunk
+            current = rampTarget;
+            FloatVectorOperations::fill(values.data() + numRamped, current, maxChunkSize - numRamped);
+        }
+
+        return values.data();
+    }
+
+private:
+    //==============================================================================
+    void startRamp(float newTarget) noexcept
+    {
+        rampTarget = newTarget;
+        rampRemaining = rampLength;
+        valuesAreSteady = false;
+
+        if (rampLength == 0 || current == rampTarget)
+        {
+            current = rampTarget;
+            rampRemaining = 0;
+            return;
+        }
+
+        // The table holds the offsets (or ratios) of a chunk's values from the
+        // value before it, and stays the same for every chunk of the ramp
+        if (ramp == Ramp::linear)
+        {
+            auto step = (rampTarget - current) / (float)rampLength;
+
+            for (int i = 0; i < maxChunkSize; ++i)
+                rampTable[(size_t)i] = step * (float)(i + 1);
+        }
+        else
+        {
+            auto ratio = (float)std::pow((double)rampTarget / (double)current, 1.0 / (double)rampLength);
+            auto product = 1.0f;
+
+            for (auto& entry : rampTable)
+                entry = (product *= ratio);
+        }
+    }
+
+    float limit(float value) const noexcept
+    {
+        // An exponential ramp can never reach or cross zero
+        return ramp == Ramp::exponential ? jmax(minimumExponentialValue, value) : value;
+    }
+
+    static constexpr float minimumExponentialValue = 1.0e-5f;
+
+    const Ramp ramp;
+    std::atomic<float> target { 0.0f };
+
+    // Only touched on the audio thread
+    float current = 0.0f, rampTarget = 0.0f;
+    int rampLength = 0, rampRemaining = 0;
+    bool valuesAreSteady = false;
+    std::array<float, maxChunkSize> values {}, rampTable {};
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SmoothedParameter)
+};
+
+//==============================================================================
+/** The MIDI controls a voice responds to: pitch bend, the mod wheel (as
+    vibrato) and channel volume, each smoothed by a SmoothedParameter.
+
+    A voice passes its pitchWheelMoved() and controllerMoved() calls on to this,
+    and renders in chunks of up to maxChunkSize samples, multiplying its phase
+    increment and its gain by the arrays it gets for each chunk.
+*/
+class VoiceControls final
+{
+public:
+    static constexpr int maxChunkSize = SmoothedParameter::maxChunkSize;
+
+    VoiceControls() noexcept
+    {
+        for (int i = 0; i < maxChunkSize; ++i)
+            chunkPositions[(size_t)i] = (float)(i + 1);
+    }
+
+    void prepare(double sampleRate) noexcept
+    {
+        pitchBend.prepare(sampleRate, 0.005);
+        modulation.prepare(sampleRate, 0.02);
+        volume.prepare(sampleRate, 0.02);
+
+        vibratoPhaseIncrement = MathConstants<double>::twoPi * vibratoRateHz / sampleRate;
+    }
+
+    /** Puts everything back to where a note on a fresh channel starts. Any
+        controllers that arrive before the first chunk is rendered are jumped to
+        rather than glided to, so a voice can be caught up with its channel.
+    */
+    void startNote(int currentPitchWheelPosition) noexcept
+    {
+        pitchWheelMoved(currentPitchWheelPosition);
+        modulation.setTargetValue(0.0f);
+        volume.setTargetValue(1.0f);
+        vibratoPhase = 0.0;
+        snapPending = true;
+    }
+
+    void pitchWheelMoved(int newValue) noexcept
+    {
+        auto semitones = (float)(newValue - 8192) / 8192.0f * pitchBendRangeSemitones;
+        pitchBend.setTargetValue(std::exp2(semitones / 12.0f));
+    }
+
+    void controllerMoved(int controllerNumber, int newValue) noexcept
+    {
+        auto normalised = (float)jlimit(0, 127, newValue) / 127.0f;
+
+        switch (controllerNumber)
+        {
+            case 1:     modulation.setTargetValue(normalised); break;
+            case 7:     volume.setTargetValue(normalised * normalised); break;  // roughly 40 log10, as GM has it
+            case 121:   modulation.setTargetValue(0.0f); pitchWheelMoved(8192); break;
+            default:    break;
+        }
+    }
+
+    //==============================================================================
+    /** What to multiply a voice's phase increment by, for each of the next numSamples samples. */
+    const float* getNextPitchMultipliers(int numSamples) noexcept
+    {
+        snapIfPending();
+
+        auto* bend = pitchBend.getNextValues(numSamples);
+        auto* depth = modulation.getNextValues(numSamples);
+
+        if (!modulation.isSmoothing() && modulation.getCurrentValue() == 0.0f)
+            return bend;
+
+        // The vibrato's sine is only worked out at the ends of the chunk and
+        // interpolated in between, and (1 + x) stands in for 2^(x / 12) at this depth
+        auto lfoStart = (float)std::sin(vibratoPhase);
+        vibratoPhase = std::fmod(vibratoPhase + vibratoPhaseIncrement * numSamples, MathConstants<double>::twoPi);
+        auto lfoEnd = (float)std::sin(vibratoPhase);
+
+        auto* out = multipliers.data();
+        FloatVectorOperations::copyWithMultiply(out, chunkPositions.data(), (lfoEnd - lfoStart) / (float)numSamples, numSamples);
+        FloatVectorOperations::add(out, lfoStart, numSamples);
+        FloatVectorOperations::multiply(out, depth, numSamples);
+        FloatVectorOperations::multiply(out, vibratoWidth, numSamples);
+        FloatVectorOperations::add(out, 1.0f, numSamples);
+        FloatVectorOperations::multiply(out, bend, numSamples);
+        return out;
+    }
+
+    /** What to multiply a voice's output by, for each of the next numSamples samples. */
+    const float* getNextGains(int numSamples) noexcept
+    {
+        snapIfPending();
+        return volume.getNextValues(numSamples);
+    }
+
+private:
+    void snapIfPending() noexcept
+    {
+        if (!snapPending)
+            return;
+
+        pitchBend.skipToTarget();
+        modulation.skipToTarget();
+        volume.skipToTarget();
+        snapPending = false;
+    }
+
+    static constexpr float pitchBendRangeSemitones = 2.0f;
+    static constexpr double vibratoRateHz = 5.5;
+    static constexpr float vibratoWidth = 0.029f;   // half a semitone either way at full depth
+
+    SmoothedParameter pitchBend { SmoothedParameter::Ramp::exponential, 1.0f };
+    SmoothedParameter modulation { SmoothedParameter::Ramp::linear, 0.0f };
+    SmoothedParameter volume { SmoothedParameter::Ramp::linear, 1.0f };
+
+    double vibratoPhase = 0.0, vibratoPhaseIncrement = 0.0;
+    bool snapPending = false;
+    std::array<float, maxChunkSize> chunkPositions {}, multipliers {};
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(VoiceControls)
+};
@@ -0,0 +1,646 @@
+#pragma once
+
+#include "AudioSynthesiserDemo.h"
+#include <ctime>
+#include <iostream>
+
+//==============================================================================
+/** Offline benchmarks for the synth engine, run by starting the app with
+    --benchmark. They render straight into memory, with no audio device, and
+    print their results to stdout.
+
+    Wall-clock and process CPU time are both reported. For cache behaviour, run
+    the same command under a profiler, e.g. "perf stat -e cache-misses,L1-dcache-load-misses".
+*/
+struct SynthBenchmarks
+{
+    static int run(const String& commandLine)
+    {
+        std::cout << "AudioSynthesiserDemo benchmarks" << std::endl;
+
+        if (wants(commandLine, "blocks"))
+            benchmarkBlockSizes();
+
+        if (wants(commandLine, "spatial"))
+            benchmarkSpatialOutput();
+
+        if (wants(commandLine, "filter"))
+            benchmarkVoiceFilters();
+
+        if (wants(commandLine, "oscillator"))
+            benchmarkOscillators();
+
+        if (wants(commandLine, "additive"))
+            benchmarkAdditive();
+
+        if (wants(commandLine, "fm"))
+            benchmarkFm();
+
+        if (wants(commandLine, "convolution"))
+            benchmarkConvolution();
+
+        auto allPassed = true;
+
+        if (wants(commandLine, "fdn"))
+            allPassed = benchmarkAlgorithmicReverb() && allPassed;
+
+        return allPassed ? 0 : 1;
+    }
+
+private:
+    //==============================================================================
+    /** An empty filter after --benchmark runs everything, otherwise only the named ones. */
+    static bool wants(const String& commandLine, const String& name)
+    {
+        auto filter = commandLine.fromFirstOccurrenceOf("--benchmark", false, false).trim()
+                                 .upToFirstOccurrenceOf(" ", false, false);
+
+        return filter.isEmpty() || filter.startsWith("-") || filter.containsIgnoreCase(name);
+    }
+
+    struct Timing
+    {
+        double wallMs = 0.0, cpuMs = 0.0;
+    };
+
+    template <typename Function>
+    static Timing measure(Function&& function)
+    {
+        auto startTicks = Time::getHighResolutionTicks();
+        auto startClock = std::clock();
+
+        function();
+
+        Timing timing;
+        timing.wallMs = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - startTicks) * 1000.0;
+        timing.cpuMs = 1000.0 * (double)(std::clock() - startClock) / CLOCKS_PER_SEC;
+        return timing;
+    }
+
+    static void report(const String& name, const Timing& timing, double secondsOfAudio)
+    {
+        std::cout << "  " << name.paddedRight(' ', 44)
+                  << String(timing.wallMs, 1).paddedLeft(' ', 9) << " ms wall"
+                  << String(timing.cpuMs, 1).paddedLeft(' ', 9) << " ms cpu"
+                  << String(secondsOfAudio * 1000.0 / jmax(0.001, timing.wallMs), 1).paddedLeft(' ', 9) << "x realtime"
+                  << std::endl;
+    }
+
+    /** How much audio a benchmark renders, and in blocks of what size. */
+    struct Benchmark
+    {
+        double sampleRate = 48000.0, seconds = 10.0;
+        int blockSize = SynthEngine::processingQuantum;
+
+        int getNumBlocks() const noexcept    { return (int)(seconds * sampleRate) / blockSize; }
+
+        /** Calls renderBlock(int blockIndex) for every block, and reports how long they took. */
+        template <typename RenderBlock>
+        Timing run(const String& name, RenderBlock&& renderBlock) const
+        {
+            auto numBlocks = getNumBlocks();
+
+            auto timing = measure([&]
+            {
+                for (int block = 0; block < numBlocks; ++block)
+                    renderBlock(block);
+            });
+
+            report(name, timing, seconds);
+            return timing;
+        }
+
+        /** The process CPU time as a share of the audio's duration, which is
+            immune to preemption, unlike the wall-clock time.
+        */
+        double getPercentOfCore(const Timing& timing) const noexcept
+        {
+            return 100.0 * timing.cpuMs / (seconds * 1000.0);
+        }
+
+        String describeShareOfCore(const Timing& timing) const
+        {
+            return String(getPercentOfCore(timing), 3) + "% of one core";
+        }
+    };
+
+    /** White noise from -1 to 1, drawn channel by channel. */
+    static void fillWithNoise(AudioBuffer<float>& buffer, Random& random)
+    {
+        for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+            for (int i = 0; i < buffer.getNumSamples(); ++i)
+                buffer.setSample(ch, i, random.nextFloat() * 2.0f - 1.0f);
+    }
+
+    //==============================================================================
+    /** Compares rendering straight at the device's (irregular) block sizes with
+        rendering in fixed quanta through the FixedBlockAdapter.
+    */
+    static void benchmarkBlockSizes()
+    {
+        constexpr double sampleRate = 48000.0;
+        constexpr double seconds = 20.0;
+        constexpr int numVoices = 32;
+        constexpr int maxDeviceBlockSize = 1024;
+
+        // Something like what a USB device with a drifting clock hands over
+        const int deviceBlockSizes[] = { 441, 512, 128, 1024, 97, 256, 480, 333 };
+
+        std::cout << "\nFixed quantum (" << SynthEngine::processingQuantum << " samples) vs device-sized blocks, "
+                  << numVoices << " sine voices:" << std::endl;
+
+        for (auto useQuantum : { false, true })
+        {
+            SynthEngine synth;
+
+            for (int i = 0; i < numVoices; ++i)
+                synth.addVoice(new SineWaveVoice());
+
+            synth.addSound(new SineWaveSound());
+            synth.prepare(sampleRate, useQuantum ? SynthEngine::processingQuantum : maxDeviceBlockSize);
+
+            FixedBlockAdapter adapter;
+            adapter.prepare(2, maxDeviceBlockSize, SynthEngine::processingQuantum);
+
+            AudioBuffer<float> deviceBuffer(2, maxDeviceBlockSize);
+            MidiBuffer midi;
+
+            auto timing = measure([&]
+            {
+                auto totalSamples = (int64)(seconds * sampleRate);
+                size_t blockIndex = 0;
+
+                for (int64 position = 0; position < totalSamples;)
+                {
+                    auto numSamples = deviceBlockSizes[blockIndex++ % numElementsInArray(deviceBlockSizes)];
+
+                    midi.clear();
+
+                    if (position == 0)
+                        for (int i = 0; i < numVoices; ++i)
+                            midi.addEvent(MidiMessage::noteOn(1, 36 + i, 0.5f), i);
+
+                    if (useQuantum)
+                    {
+                        adapter.process(deviceBuffer, 0, numSamples, midi,
+                                        [&](AudioBuffer<float>& quantum, const MidiBuffer& quantumMidi)
+                                        {
+                                            synth.renderNextBlock(quantum, quantumMidi, 0, quantum.getNumSamples());
+                                        });
+                    }
+                    else
+                    {
+                        deviceBuffer.clear(0, numSamples);
+                        synth.renderNextBlock(deviceBuffer, midi, 0, numSamples);
+                    }
+
+                    position += numSamples;
+                }
+            });
+
+            report(useQuantum ? "fixed quantum + adapter" : "device-sized blocks", timing, seconds);
+        }
+    }
+
+    //==============================================================================
+    /** Renders 64 voices spread around the outputs, for stereo and for 8- and
+        16-channel rings, to show what the panning stage costs as outputs are added.
+    */
+    static void benchmarkSpatialOutput()
+    {
+        const Benchmark benchmark { 48000.0, 20.0 };
+        const auto blockSize = benchmark.blockSize;
+        constexpr int numVoices = 64;
+
+        std::cout << "\nSpatial output, " << numVoices << " sine voices spread across the outputs:" << std::endl;
+
+        for (auto numChannels : { 2, 8, 16 })
+        {
+            SynthEngine synth;
+
+            for (int i = 0; i < numVoices; ++i)
+                synth.addVoice(new SineWaveVoice());
+
+            synth.addSound(new SineWaveSound());
+            synth.setStereoSpread(1.0f);
+            synth.setSurroundPanning(true);
+            synth.prepare(benchmark.sampleRate, blockSize);
+
+            AudioBuffer<float> buffer(numChannels, blockSize);
+            MidiBuffer midi;
+
+            benchmark.run(String(numChannels) + " output channels", [&](int block)
+            {
+                midi.clear();
+
+                if (block == 0)
+                    for (int i = 0; i < numVoices; ++i)
+                        midi.addEvent(MidiMessage::noteOn(1 + i % 16, 32 + i, 0.5f), 0);
+
+                buffer.clear();
+                synth.renderNextBlock(buffer, midi, 0, blockSize);
+            });
+        }
+    }
+
+    //==============================================================================
+    /** Filters 32 voices' worth of noise one voice at a time with a plain scalar
+        SVF, then VoiceFilter::numLanes at a time with the VoiceFilter, and then
+        times the whole engine with its voice filter off and on.
+    */
+    static void benchmarkVoiceFilters()
+    {
+        const Benchmark benchmark { 48000.0, 20.0 };
+        const auto sampleRate = benchmark.sampleRate;
+        const auto blockSize = benchmark.blockSize;
+        constexpr int numVoices = 32;
+
+        std::cout << "\nVoice filters, " << numVoices << " voices, " << VoiceFilter::numLanes << " SIMD lanes:" << std::endl;
+
+        Random random(1234);
+        AudioBuffer<float> voices(numVoices, blockSize);
+        fillWithNoise(voices, random);
+
+        {
+            // The same trapezoidal SVF as the VoiceFilter, as it would be written for one voice
+            struct ScalarState { float ic1 = 0.0f, ic2 = 0.0f; };
+            std::vector<ScalarState> states((size_t)numVoices);
+
+            benchmark.run("scalar, one voice at a time", [&](int)
+            {
+                for (int v = 0; v < numVoices; ++v)
+                {
+                    auto g = std::tan(MathConstants<float>::pi * (1000.0f + 50.0f * (float)v) / (float)sampleRate);
+                    auto k = 1.0f / 0.707f;
+                    auto a1 = 1.0f / (1.0f + g * (g + k)), a2 = g * a1, a3 = g * a2;
+                    auto& s = states[(size_t)v];
+                    auto* data = voices.getWritePointer(v);
+
+                    for (int i = 0; i < blockSize; ++i)
+                    {
+                        auto v3 = data[i] - s.ic2;
+                        auto v1 = a1 * s.ic1 + a2 * v3;
+                        auto v2 = s.ic2 + a2 * s.ic1 + a3 * v3;
+                        s.ic1 = 2.0f * v1 - s.ic1;
+                        s.ic2 = 2.0f * v2 - s.ic2;
+                        data[i] = v2;
+                    }
+                }
+            });
+        }
+
+        {
+            VoiceFilter filter;
+            filter.prepare(sampleRate);
+            filter.setMode(VoiceFilter::Mode::lowpass);
+
+            VoiceFilter::Workspace workspace;
+            workspace.prepare(blockSize);
+
+            std::vector<VoiceFilter::State> states((size_t)numVoices);
+            std::vector<VoiceFilter::State*> statePointers;
+            std::vector<int> notes;
+
+            for (int v = 0; v < numVoices; ++v)
+            {
+                statePointers.push_back(&states[(size_t)v]);
+                notes.push_back(36 + v);
+            }
+
+            benchmark.run("VoiceFilter, a register of voices at a time", [&](int)
+            {
+                for (int first = 0; first < numVoices; first += VoiceFilter::numLanes)
+                    filter.process(VoiceFilter::Mode::lowpass, voices.getArrayOfWritePointers() + first,
+                                   statePointers.data() + first, notes.data() + first,
+                                   jmin(VoiceFilter::numLanes, numVoices - first), blockSize, workspace);
+            });
+        }
+
+        for (auto mode : { VoiceFilter::Mode::off, VoiceFilter::Mode::lowpass })
+        {
+            SynthEngine synth;
+
+            for (int i = 0; i < numVoices; ++i)
+                synth.addVoice(new SineWaveVoice());
+
+            synth.addSound(new SineWaveSound());
+            synth.getVoiceFilter().setMode(mode);
+            synth.prepare(sampleRate, blockSize);
+
+            AudioBuffer<float> buffer(2, blockSize);
+            MidiBuffer midi;
+
+            benchmark.run(String("engine, ") + (mode == VoiceFilter::Mode::off ? "no filter" : "lowpass on every voice"), [&](int block)
+            {
+                midi.clear();
+
+                if (block == 0)
+                    for (int i = 0; i < numVoices; ++i)
+                        midi.addEvent(MidiMessage::noteOn(1, 36 + i, 0.5f), 0);
+
+                buffer.clear();
+                synth.renderNextBlock(buffer, midi, 0, blockSize);
+            });
+        }
+    }
+
+    //==============================================================================
+    /** Plays a high note on a single PolyBlepVoice with each waveform, at 1x, 2x
+        and 4x oversampling, and reports what the voice costs and how much
+        aliasing the analyzer finds in its output.
+    */
+    static void benchmarkOscillators()
+    {
+        const Benchmark benchmark {};
+        const auto sampleRate = benchmark.sampleRate;
+        const auto blockSize = benchmark.blockSize;
+        constexpr int midiNote = 96;   // about 2 kHz, where aliasing is easy to hear
+        const auto fundamentalHz = MidiMessage::getMidiNoteInHertz(midiNote);
+
+        std::cout << "\nBand-limited oscillators, one voice at MIDI note " << midiNote << ":" << std::endl;
+
+        auto waveformNames = PolyBlepSound::getWaveformNames();
+
+        for (int waveform = 0; waveform < waveformNames.size(); ++waveform)
+        {
+            for (auto factor : { 1, 2, 4 })
+            {
+                // A plain Synthesiser, so there's nothing but the voice to time
+                Synthesiser synth;
+                synth.addVoice(new PolyBlepVoice());
+                synth.addSound(new PolyBlepSound((PolyBlepOscillator::Waveform)waveform, factor));
+                synth.setCurrentPlaybackSampleRate(sampleRate);
+                synth.noteOn(1, midiNote, 1.0f);
+
+                AudioBuffer<float> buffer(1, blockSize);
+                MidiBuffer noMidi;
+
+                auto name = waveformNames[waveform] + (factor > 1 ? ", " + String(factor) + "x oversampled" : String());
+
+                auto timing = benchmark.run(name, [&](int)
+                {
+                    buffer.clear();
+                    synth.renderNextBlock(buffer, noMidi, 0, blockSize);
+                });
+
+                // By now the envelope has long since reached its sustain level
+                AudioBuffer<float> analysed(1, FFTAnalyzer::getAnalysisSize());
+                analysed.clear();
+                synth.renderNextBlock(analysed, noMidi, 0, analysed.getNumSamples());
+
+                std::cout << "    " << benchmark.describeShareOfCore(timing) << ", aliasing "
+                          << String(FFTAnalyzer::measureAliasing(analysed.getReadPointer(0), sampleRate, fundamentalHz), 1)
+                          << " dB" << std::endl;
+            }
+        }
+    }
+
+    //==============================================================================
+    /** What the AdditiveVoice is measured against: one oscillator per partial,
+        each a two-multiply recursive sine (y[n] = 2 cos w y[n - 1] - y[n - 2]),
+        which is about as cheap as a time-domain oscillator gets.
+    */
+    struct OscillatorBank
+    {
+        OscillatorBank(const AdditiveSound& sound, double fundamentalHz, double sampleRate)
+        {
+            for (auto& partial : sound.partials)
+            {
+                auto w = MathConstants<double>::twoPi * fundamentalHz * partial.ratio / sampleRate;
+
+                if (w >= MathConstants<double>::pi)
+                    break;
+
+                coefficients.push_back((float)(2.0 * std::cos(w)));
+                current.push_back(partial.amplitude * (float)std::sin(partial.phase));
+                previous.push_back(partial.amplitude * (float)std::sin(partial.phase - w));
+            }
+        }
+
+        void render(float* output, int numSamples) noexcept
+        {
+            auto numOscillators = coefficients.size();
+
+            for (int i = 0; i < numSamples; ++i)
+            {
+                auto sum = 0.0f;
+
+                for (size_t j = 0; j < numOscillators; ++j)
+                {
+                    auto next = coefficients[j] * current[j] - previous[j];
+                    previous[j] = current[j];
+                    current[j] = next;
+                    sum += next;
+                }
+
+                output[i] = sum;
+            }
+        }
+
+        size_t getNumOscillators() const noexcept    { return coefficients.size(); }
+
+        std::vector<float> coefficients, current, previous;
+    };
+
+    /** Times one AdditiveVoice against an OscillatorBank with the same partials.
+        The note is low enough that all of them are below Nyquist, so both
+        really do play every one.
+    */
+    static void benchmarkAdditive()
+    {
+        const Benchmark benchmark {};
+        const auto sampleRate = benchmark.sampleRate;
+        const auto blockSize = benchmark.blockSize;
+        constexpr int midiNote = 12;   // about 16 Hz, so 1024 harmonics reach 16.7 kHz
+        const auto fundamentalHz = MidiMessage::getMidiNoteInHertz(midiNote);
+
+        std::cout << "\nAdditive organ drone, one voice at MIDI note " << midiNote
+                  << ", inverse FFT vs oscillator bank:" << std::endl;
+
+        for (auto numPartials : { 64, 256, 1024 })
+        {
+            ReferenceCountedObjectPtr<AdditiveSound> sound = new AdditiveSound(AdditiveSound::Preset::organ, numPartials);
+
+            Synthesiser synth;
+            synth.addVoice(new AdditiveVoice());
+            synth.addSound(sound);
+            synth.setCurrentPlaybackSampleRate(sampleRate);
+            synth.noteOn(1, midiNote, 1.0f);
+
+            AudioBuffer<float> buffer(1, blockSize);
+            MidiBuffer noMidi;
+
+            auto name = String(numPartials) + " partials, ";
+
+            auto fftTiming = benchmark.run(name + "inverse FFT", [&](int)
+            {
+                buffer.clear();
+                synth.renderNextBlock(buffer, noMidi, 0, blockSize);
+            });
+
+            OscillatorBank bank(*sound, fundamentalHz, sampleRate);
+            jassert((int)bank.getNumOscillators() == numPartials);
+
+            auto bankTiming = benchmark.run(name + "oscillator bank", [&](int)
+            {
+                bank.render(buffer.getWritePointer(0), blockSize);
+            });
+
+            std::cout << "    " << String(benchmark.getPercentOfCore(fftTiming), 3) << "% vs "
+                      << benchmark.describeShareOfCore(bankTiming) << std::endl;
+        }
+    }
+
+    //==============================================================================
+    /** Times sixteen FmVoices in each algorithm against sixteen SineWaveVoices.
+        The FM patch is the organ's, whose operators all sustain, so every
+        operator is working for the whole run whatever the routing.
+    */
+    static void benchmarkFm()
+    {
+        const Benchmark benchmark {};
+        constexpr int numVoices = 16;
+
+        std::cout << "\nFour-operator FM vs the sine voice, " << numVoices << " voices:" << std::endl;
+
+        auto time = [&](const String& name, Synthesiser& synth)
+        {
+            synth.setCurrentPlaybackSampleRate(benchmark.sampleRate);
+
+            for (int i = 0; i < numVoices; ++i)
+                synth.noteOn(1, 48 + i, 1.0f);
+
+            AudioBuffer<float> buffer(1, benchmark.blockSize);
+            MidiBuffer noMidi;
+
+            benchmark.run(name, [&](int)
+            {
+                buffer.clear();
+                synth.renderNextBlock(buffer, noMidi, 0, benchmark.blockSize);
+            });
+        };
+
+        {
+            Synthesiser synth;
+
+            for (int i = 0; i < numVoices; ++i)
+                synth.addVoice(new SineWaveVoice());
+
+            synth.addSound(new SineWaveSound());
+            time("Sine", synth);
+        }
+
+        auto organ = FmSound::getPresetNames().indexOf("Organ");
+
+        for (int algorithm = 0; algorithm < FmSound::numAlgorithms; ++algorithm)
+        {
+            auto patch = FmSound::getPreset(organ);
+            patch.algorithm = algorithm;
+
+            Synthesiser synth;
+
+            for (int i = 0; i < numVoices; ++i)
+                synth.addVoice(new FmVoice());
+
+            synth.addSound(new FmSound(patch));
+            time("FM, algorithm " + String(algorithm + 1), synth);
+        }
+    }
+
+    //==============================================================================
+    /** Convolves stereo noise with decaying-noise IRs of increasing length: with
+        uniform quantum-sized partitions, with the reverb's non-uniform split done
+        entirely on the calling thread, and with its tail on the worker, where
+        only the audio thread's share is timed. Offline the worker can't keep up
+        with a loop running many times faster than realtime, so its late blocks
+        are shown but don't reflect live behaviour.
+    */
+    static void benchmarkConvolution()
+    {
+        const Benchmark benchmark { 48000.0, 10.0, ConvolutionReverb::blockSize };
+        const auto blockSize = benchmark.blockSize;
+
+        std::cout << "\nConvolution, stereo, " << blockSize << "-sample blocks:" << std::endl;
+
+        Random random(1234);
+        AudioBuffer<float> input(2, blockSize), buffer(2, blockSize);
+        fillWithNoise(input, random);
+
+        for (auto irSeconds : { 0.1, 0.5, 1.0, 2.0, 4.0, 8.0 })
+        {
+            AudioBuffer<float> ir(2, (int)(irSeconds * benchmark.sampleRate));
+            fillWithNoise(ir, random);
+
+            for (int ch = 0; ch < 2; ++ch)
+                for (int i = 0; i < ir.getNumSamples(); ++i)
+                    ir.getWritePointer(ch)[i] *= std::exp(-6.9f * (float)i / (float)ir.getNumSamples());
+
+            auto irName = String(irSeconds, 1) + " s IR, ";
+
+            {
+                std::array<PartitionedConvolver, 2> convolvers;
+
+                for (int ch = 0; ch < 2; ++ch)
+                    convolvers[(size_t)ch].prepare(ir.getReadPointer(ch), 0, ir.getNumSamples(), blockSize);
+
+                benchmark.run(irName + "uniform partitions", [&](int)
+                {
+                    for (int ch = 0; ch < 2; ++ch)
+                        convolvers[(size_t)ch].processBlock(input.getReadPointer(ch), buffer.getWritePointer(ch));
+                });
+            }
+
+            for (auto useWorker : { false, true })
+            {
+                ConvolutionReverb reverb;
+                reverb.setBackgroundProcessing(useWorker);
+                reverb.prepare(benchmark.sampleRate);
+                reverb.setImpulseResponse(ir, benchmark.sampleRate);
+
+                benchmark.run(irName + (useWorker ? "audio thread, tail on worker" : "non-uniform, all inline"), [&](int)
+                {
+                    buffer.makeCopyOf(input, true);
+                    reverb.process(buffer);
+                });
+
+                if (useWorker)
+                    std::cout << "    (" << (int64)reverb.getStatistics().lateTailBlocks << " tail blocks late)" << std::endl;
+            }
+        }
+    }
+
+    //==============================================================================
+    /** Times the FdnReverb on stereo noise in quantum-sized blocks, and checks it
+        against its budget of 2% of one core at 48 kHz. Returns false (and so a
+        non-zero exit code) if it goes over.
+    */
+    static bool benchmarkAlgorithmicReverb()
+    {
+        const Benchmark benchmark { 48000.0, 20.0 };
+        constexpr double budgetPercent = 2.0;
+
+        std::cout << "\nAlgorithmic reverb, " << FdnReverb::numLines << " lines, stereo, "
+                  << benchmark.blockSize << "-sample blocks:" << std::endl;
+
+        Random random(1234);
+        AudioBuffer<float> input(2, benchmark.blockSize), buffer(2, benchmark.blockSize);
+        fillWithNoise(input, random);
+
+        FdnReverb reverb;
+        reverb.prepare(benchmark.sampleRate);
+        reverb.setEnabled(true);
+
+        auto timing = benchmark.run("FDN reverb", [&](int)
+        {
+            buffer.makeCopyOf(input, true);
+            reverb.process(buffer);
+        });
+
+        auto passed = benchmark.getPercentOfCore(timing) < budgetPercent;
+
+        std::cout << "    " << benchmark.describeShareOfCore(timing) << " (budget " << String(budgetPercent, 1) << "%): "
+                  << (passed ? "PASS" : "FAIL") << std::endl;
+
+        return passed;
+    }
+};
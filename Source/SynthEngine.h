@@ -0,0 +1,1142 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "ParallelVoiceRenderer.h"
+#include "LatencyMonitor.h"
+#include "VoiceAllocator.h"
+#include "VoicePanner.h"
+#include "VoiceFilter.h"
+
+//==============================================================================
+/** The demo's synthesiser.
+
+    It behaves like a plain juce::Synthesiser, but only ever visits the voices
+    that are sounding: a compact list of them is kept up to date as notes start
+    and finish, so an idle synth costs next to nothing. Each voice is rendered
+    into a scratch buffer first so its level can be measured, and a released
+    voice whose output stays below the silence threshold for a whole block is
+    stopped instead of being left to fade out inaudibly.
+
+    It can also render its voices on a pool of real-time worker threads. Each
+    thread renders its share of the active voices into its own scratch buffer,
+    and the scratch buffers are summed into the output before renderVoices()
+    returns. If the workers miss their deadline a couple of times in a row, the
+    engine drops back to serial rendering for a second before trying again.
+
+    Each MIDI channel is a part, which can have a sound of its own and a number
+    of voices reserved for it. All parts share the one active list, so the cost
+    of rendering depends on how many voices are sounding, not on how many parts
+    are in use.
+
+    Voices are allocated by a VoiceAllocator rather than by scanning them all,
+    so note-ons and note-offs take the same time however many voices there are.
+    A stolen voice is faded out over a few milliseconds by StolenVoiceFades
+    while the new note starts.
+
+    Voices render in mono and are panned as they're mixed in: the part's pan
+    (MIDI CC 10) plus an offset that spreads notes across the outputs by pitch
+    is turned into per-channel gains once per block by a VoicePanner.
+
+    Optionally, the voices can be split into stems, by kind of voice or by
+    part. Each voice is then panned into its stem's bus rather than straight
+    into the output, and the buses are added into the output once at the end,
+    so the mix comes out the same and the stems can be picked up separately.
+    The buses are allocated up front, per worker thread when rendering in
+    parallel, and only stereo (or mono) output is split.
+
+    Voices are rendered in groups as wide as a SIMD register, so that a
+    VoiceFilter can run on the whole group at once before each voice is
+    measured and panned. A stolen voice's fade-out goes through its filter too.
+*/
+class SynthEngine final : public Synthesiser,
+                          private ParallelVoiceRenderer::Task
+{
+public:
+    struct Statistics
+    {
+        uint64 parallelBlocks = 0, serialBlocks = 0, deadlineMisses = 0, culledVoices = 0, stolenVoices = 0;
+        int numActiveVoices = 0;
+    };
+
+    /** The block size the engine is normally driven with (see FixedBlockAdapter).
+        Blocks of exactly this size take a fixed-length measuring path, and at
+        this size the scratch buffers are small enough to stay in L1.
+    */
+    static constexpr int processingQuantum = 64;
+
+    /** One part per MIDI channel. */
+    static constexpr int numParts = 16;
+
+    /** How the voices are split into stems, if they are. */
+    enum class StemLayout
+    {
+        none,
+        byVoiceType,    // one stem for each kind of voice, e.g. sine and sampler
+        byPart          // one stem for each MIDI channel
+    };
+
+    static constexpr int maxStems = numParts;
+    static constexpr int maxStemChannels = 2;
+
+    SynthEngine() = default;
+
+    ~SynthEngine() override
+    {
+        renderer->stopWorkers();
+    }
+
+    //==============================================================================
+    /** These hide their Synthesiser counterparts so that the per-voice bookkeeping
+        is resized on the message thread rather than in the audio callback.
+    */
+    SynthesiserVoice* addVoice(SynthesiserVoice* newVoice)
+    {
+        const ScopedLock sl(lock);
+
+        auto* voice = Synthesiser::addVoice(newVoice);
+        slots.push_back({ voice });
+        activeVoices.reserve(slots.size());
+        assignVoicesToParts();
+        return voice;
+    }
+
+    void removeVoice(int index)
+    {
+        const ScopedLock sl(lock);
+
+        Synthesiser::removeVoice(index);
+        rebuildSlots();
+    }
+
+    void clearVoices()
+    {
+        const ScopedLock sl(lock);
+
+        Synthesiser::clearVoices();
+        rebuildSlots();
+    }
+
+    //==============================================================================
+    /** Gives a MIDI channel (1-16) a sound of its own. Notes on that channel then
+        play only this sound. With nullptr, the channel goes back to playing the
+        engine's shared sounds.
+    */
+    void setPartSound(int midiChannel, SynthesiserSound::Ptr sound)
+    {
+        if (!isPositiveAndBelow(midiChannel - 1, numParts))
+            return;
+
+        const ScopedLock sl(lock);
+
+        parts[(size_t)midiChannel - 1].sound = sound;
+        assignVoicesToParts();
+    }
+
+    SynthesiserSound::Ptr getPartSound(int midiChannel) const
+    {
+        const ScopedLock sl(lock);
+        return isPositiveAndBelow(midiChannel - 1, numParts) ? parts[(size_t)midiChannel - 1].sound : nullptr;
+    }
+
+    /** Sets voices aside for one MIDI channel. A part with reserved voices only
+        ever plays on those, stealing among them when they're all busy. Parts
+        with none share whichever voices nobody has reserved.
+    */
+    void setPartVoiceReservation(int midiChannel, int numVoices)
+    {
+        if (!isPositiveAndBelow(midiChannel - 1, numParts))
+            return;
+
+        const ScopedLock sl(lock);
+
+        parts[(size_t)midiChannel - 1].reservedVoices = jmax(0, numVoices);
+        assignVoicesToParts();
+    }
+
+    int getPartVoiceReservation(int midiChannel) const
+    {
+        const ScopedLock sl(lock);
+        return isPositiveAndBelow(midiChannel - 1, numParts) ? parts[(size_t)midiChannel - 1].reservedVoices : 0;
+    }
+
+    /** How many voices a part actually got, which is fewer than it asked for if
+        there weren't enough voices able to play its sound.
+    */
+    int getNumReservedVoices(int midiChannel) const
+    {
+        const ScopedLock sl(lock);
+
+        auto part = midiChannel - 1;
+        return (int)std::count_if(slots.begin(), slots.end(), [part](const VoiceSlot& slot) { return slot.part == part; });
+    }
+
+    /** Allocates the scratch space for a given block size, and (re)starts the
+        worker threads if parallel rendering is switched on.
+    */
+    void prepare(double sampleRate, int maximumBlockSize)
+    {
+        {
+            const ScopedLock sl(lock);
+
+            setCurrentPlaybackSampleRate(sampleRate);
+            cullWindowSamples = jmax(32, maximumBlockSize);
+            stolenFades.prepare(sampleRate);
+            voiceFilter.prepare(sampleRate);
+        }
+
+        rebuildRenderer(jmax(maximumBlockSize, 1), parallelRendering);
+    }
+
+    //==============================================================================
+    /** Call this on the message thread. The workers are started and stopped
+        without holding the render lock, so the audio thread never waits for them.
+    */
+    void setParallelRenderingEnabled(bool shouldBeEnabled, int numWorkerThreads = getDefaultNumWorkers())
+    {
+        {
+            const ScopedLock sl(lock);
+
+            parallelRendering = shouldBeEnabled;
+            numWorkers = jmax(1, numWorkerThreads);
+        }
+
+        if (getSampleRate() > 0.0)
+            rebuildRenderer(maxBlockSize, shouldBeEnabled);
+    }
+
+    bool isParallelRenderingEnabled() const noexcept    { return parallelRendering; }
+
+    /** The filter every voice goes through. Its settings can be changed from any thread. */
+    VoiceFilter& getVoiceFilter() noexcept    { return voiceFilter; }
+
+    /** How far notes are spread across the outputs by pitch: 0 puts every note
+        of a part at the part's pan position, 1 spreads the keyboard from hard
+        left to hard right around it.
+    */
+    void setStereoSpread(float newSpread) noexcept
+    {
+        stereoSpread.store(jlimit(0.0f, 1.0f, newSpread), std::memory_order_relaxed);
+    }
+
+    float getStereoSpread() const noexcept    { return stereoSpread.load(std::memory_order_relaxed); }
+
+    /** Pans voices around a ring of however many outputs there are (see VoicePanner).
+        It's off by default, which keeps the voices on the first two outputs
+        whatever the device has, so only switch it on for a speaker ring.
+    */
+    void setSurroundPanning(bool shouldPanAroundRing) noexcept
+    {
+        surroundPanning.store(shouldPanAroundRing, std::memory_order_relaxed);
+    }
+
+    bool isSurroundPanning() const noexcept    { return surroundPanning.load(std::memory_order_relaxed); }
+
+    /** Sets a channel's pan, from -1 (left) to 1 (right). MIDI CC 10 does the same. */
+    void setPartPan(int midiChannel, float pan) noexcept
+    {
+        if (isPositiveAndBelow(midiChannel - 1, numParts))
+            parts[(size_t)midiChannel - 1].pan.store(jlimit(-1.0f, 1.0f, pan), std::memory_order_relaxed);
+    }
+
+    float getPartPan(int midiChannel) const noexcept
+    {
+        return isPositiveAndBelow(midiChannel - 1, numParts) ? parts[(size_t)midiChannel - 1].pan.load(std::memory_order_relaxed) : 0.0f;
+    }
+
+    //==============================================================================
+    /** Starts or stops rendering stems. Their buses are allocated here (and in
+        prepare()) with no lock held, never on the audio thread, and swapped in
+        under the lock.
+    */
+    void setStemLayout(StemLayout newLayout)
+    {
+        for (;;)
+        {
+            int blockSize = 0;
+            size_t numThreads = 0;
+
+            {
+                const ScopedLock sl(lock);
+                blockSize = maxBlockSize;
+                numThreads = threadScratch.size();
+            }
+
+            AudioBuffer<float> newStemBuses;
+            std::vector<ThreadScratch> newScratch(numThreads);
+            allocateStems(newStemBuses, newScratch, newLayout, blockSize);
+
+            const ScopedLock sl(lock);
+
+            // If the renderer was rebuilt meanwhile, these are the wrong size, so go round again
+            if (blockSize != maxBlockSize || numThreads != threadScratch.size())
+                continue;
+
+            stemLayout.store(newLayout);
+            std::swap(stemBuses, newStemBuses);
+
+            for (size_t i = 0; i < numThreads; ++i)
+                std::swap(threadScratch[i].stemBuses, newScratch[i].stemBuses);
+
+            return;
+        }
+    }
+
+    StemLayout getStemLayout() const noexcept    { return stemLayout.load(); }
+
+    int getNumStems() const noexcept
+    {
+        switch (stemLayout.load())
+        {
+            case StemLayout::byVoiceType:  return jlimit(1, maxStems, (int)voiceClasses.size());
+            case StemLayout::byPart:       return numParts;
+            case StemLayout::none:
+            default:                       return 0;
+        }
+    }
+
+    /** A channel of a stem, with its samples at the same positions as in the buffer
+        given to the last renderNextBlock(). Call this on the audio thread, after
+        rendering. Returns nullptr if there's no such stem.
+    */
+    const float* getStemReadPointer(int stem, int channel) const noexcept
+    {
+        if (!isPositiveAndBelow(stem, getNumStems()) || !isPositiveAndBelow(channel, maxStemChannels) || stemBuses.getNumChannels() == 0)
+            return nullptr;
+
+        return stemBuses.getReadPointer(stem * maxStemChannels + channel);
+    }
+
+    //==============================================================================
+    /** Released voices quieter than this for a whole block get stopped. */
+    void setSilenceThreshold(float decibels) noexcept
+    {
+        silenceThreshold.store(Decibels::decibelsToGain(decibels, -200.0f), std::memory_order_relaxed);
+    }
+
+    float getSilenceThreshold() const noexcept
+    {
+        return Decibels::gainToDecibels(silenceThreshold.load(std::memory_order_relaxed), -200.0f);
+    }
+
+    static int getDefaultNumWorkers()
+    {
+        return jlimit(1, 3, SystemStats::getNumCpus() - 1);
+    }
+
+    /** Voices started by note-ons from a MIDI device will report their first sound to this. */
+    void setLatencyMonitor(LatencyMonitor* monitorToUse)
+    {
+        const ScopedLock sl(lock);
+        latencyMonitor = monitorToUse;
+    }
+
+    Statistics getStatistics() const noexcept
+    {
+        Statistics stats;
+        stats.parallelBlocks = parallelBlocks.load(std::memory_order_relaxed);
+        stats.serialBlocks = serialBlocks.load(std::memory_order_relaxed);
+        stats.deadlineMisses = deadlineMisses.load(std::memory_order_relaxed);
+        stats.culledVoices = culledVoices.load(std::memory_order_relaxed);
+        stats.stolenVoices = stolenVoices.load(std::memory_order_relaxed);
+        stats.numActiveVoices = numActiveVoicesForDisplay.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    //==============================================================================
+    /** Does the same as Synthesiser::noteOn(), but plays the channel's own sound
+        if it has one, allocates from the channel's voice pool, and puts the voice
+        it starts on the active list.
+    */
+    void noteOn(int midiChannel, int midiNoteNumber, float velocity) override
+    {
+        const ScopedLock sl(lock);
+
+        auto arrivalTime = latencyMonitor != nullptr ? latencyMonitor->takeArrivalTime(midiChannel, midiNoteNumber) : 0.0;
+        auto partIndex = jlimit(0, numParts - 1, midiChannel - 1);
+
+        if (auto* partSound = parts[(size_t)partIndex].sound.get())
+        {
+            if (partSound->appliesToNote(midiNoteNumber))
+                startNoteForPart(partSound, partIndex, midiChannel, midiNoteNumber, velocity, arrivalTime);
+
+            return;
+        }
+
+        for (auto* sound : sounds)
+            if (sound->appliesToNote(midiNoteNumber) && sound->appliesToChannel(midiChannel))
+                startNoteForPart(sound, partIndex, midiChannel, midiNoteNumber, velocity, arrivalTime);
+    }
+
+    /** Does the same as Synthesiser::noteOff(), but only visits the voices playing the note. */
+    void noteOff(int midiChannel, int midiNoteNumber, float velocity, bool allowTailOff) override
+    {
+        const ScopedLock sl(lock);
+
+        allocator.forEachVoiceOnNote(midiChannel, midiNoteNumber, [&](int index)
+        {
+            auto* voice = slots[(size_t)index].voice;
+
+            if (voice->getCurrentlyPlayingNote() != midiNoteNumber || !voice->isPlayingChannel(midiChannel))
+                return;
+
+            // A part's own sound plays on its channel whether it claims to or not (see noteOn())
+            auto* sound = voice->getCurrentlyPlayingSound().get();
+
+            if (sound == nullptr || !sound->appliesToNote(midiNoteNumber))
+                return;
+
+            voice->setKeyDown(false);
+
+            if (!(voice->isSustainPedalDown() || voice->isSostenutoPedalDown()))
+            {
+                stopVoice(voice, velocity, allowTailOff);
+                allocator.noteReleased(index);
+            }
+        });
+    }
+
+protected:
+    //==============================================================================
+    void handleController(int midiChannel, int controllerNumber, int controllerValue) override
+    {
+        if (controllerNumber == 10)
+            setPartPan(midiChannel, jlimit(-1.0f, 1.0f, (float)(controllerValue - 64) / 63.0f));
+
+        if (isPositiveAndBelow(midiChannel - 1, numParts))
+        {
+            auto& part = parts[(size_t)midiChannel - 1];
+
+            for (size_t i = 0; i < channelControllers.size(); ++i)
+                if (controllerNumber == channelControllers[i])
+                    part.controllerValues[i] = controllerValue;
+
+            if (controllerNumber == 121)   // reset all controllers, which leaves the volume alone
+                part.controllerValues[0] = -1;
+        }
+
+        Synthesiser::handleController(midiChannel, controllerNumber, controllerValue);
+    }
+
+    void renderVoices(AudioBuffer<float>& outputAudio, int startSample, int numSamples) override
+    {
+        panner.setNumChannels(isSurroundPanning() ? outputAudio.getNumChannels()
+                                                  : jmin(2, outputAudio.getNumChannels()));
+
+        auto hasStems = hasStemBuses(startSample, numSamples);
+
+        // The stems only hold this block's voices, even if they can't be split this time
+        if (hasStems)
+            clearStems(stemBuses, startSample, numSamples);
+
+        renderingStems = hasStems && canMeasureVoices(outputAudio, numSamples)
+                           && outputAudio.getNumChannels() <= maxStemChannels;
+
+        // A stolen voice's tail goes wherever the voice itself would have gone
+        if (renderingStems)
+            stolenFades.mixIntoStems(startSample, numSamples, [this, &outputAudio](int stem)
+            {
+                return AudioBuffer<float>(stemBuses.getArrayOfWritePointers() + stem * maxStemChannels,
+                                          outputAudio.getNumChannels(), stemBuses.getNumSamples());
+            });
+        else
+            stolenFades.mixInto(outputAudio, startSample, numSamples);
+
+        auto numActive = (int)activeVoices.size();
+
+        if (numActive == 0)
+        {
+            if (renderingStems)
+                mixStemsInto(outputAudio, startSample, numSamples);
+
+            return;
+        }
+
+        currentFilterMode = voiceFilter.getMode();
+
+        if (!canMeasureVoices(outputAudio, numSamples))
+        {
+            // Not prepared for a block this size, so render without the level checks (or the filter)
+            serialBlocks.fetch_add(1, std::memory_order_relaxed);
+
+            for (auto index : activeVoices)
+                slots[(size_t)index].voice->renderNextBlock(outputAudio, startSample, numSamples);
+        }
+        else if (numActive < minVoicesForParallel || !shouldRenderInParallel(numSamples))
+        {
+            serialBlocks.fetch_add(1, std::memory_order_relaxed);
+            renderVoiceGroups(activeVoices.data(), numActive, threadScratch.front(), outputAudio, stemBuses,
+                              startSample, startSample, numSamples);
+        }
+        else
+        {
+            renderInParallel(outputAudio, startSample, numSamples);
+        }
+
+        if (renderingStems)
+            mixStemsInto(outputAudio, startSample, numSamples);
+
+        retireFinishedVoices();
+    }
+
+    using Synthesiser::renderVoices;
+
+private:
+    //==============================================================================
+    struct VoiceSlot
+    {
+        SynthesiserVoice* voice = nullptr;
+        int silentSamples = 0;
+        bool isActive = false;
+        double noteArrivalTime = 0.0;   // non-zero until a measured note makes its first sound
+        int part = -1;                  // the part this voice is reserved for, or -1 if it's shared
+        int voiceClass = 0;             // index into voiceClasses
+        int midiChannel = 1, midiNote = 60;
+        VoiceFilter::State filterState;
+    };
+
+    /** The controllers a voice is caught up with when it starts a note: the mod wheel,
+        volume, and brightness (which moves through a wavetable).
+    */
+    static constexpr std::array<int, 3> channelControllers { 1, 7, 74 };
+
+    struct Part
+    {
+        SynthesiserSound::Ptr sound;    // nullptr to use the engine's shared sounds
+        int reservedVoices = 0;
+        std::atomic<float> pan { 0.0f };
+        std::array<int, channelControllers.size()> controllerValues { -1, -1, -1 };   // -1 until one arrives
+    };
+
+    //==============================================================================
+    void startNoteForPart(SynthesiserSound* sound, int partIndex, int midiChannel, int midiNoteNumber,
+                          float velocity, double arrivalTime)
+    {
+        // If hitting a note that's still ringing, stop it first (it could be
+        // still playing because of the sustain or sostenuto pedal).
+        allocator.forEachVoiceOnNote(midiChannel, midiNoteNumber, [this, midiChannel, midiNoteNumber](int index)
+        {
+            auto* voice = slots[(size_t)index].voice;
+
+            if (voice->getCurrentlyPlayingNote() == midiNoteNumber && voice->isPlayingChannel(midiChannel))
+            {
+                voice->stopNote(1.0f, true);
+                allocator.noteReleased(index);
+            }
+        });
+
+        auto wasStolen = false;
+        auto slotIndex = findVoiceForPart(sound, partIndex, wasStolen);
+
+        if (slotIndex < 0)
+            return;
+
+        auto* voice = slots[(size_t)slotIndex].voice;
+
+        auto& slot = slots[(size_t)slotIndex];
+
+        if (wasStolen && voice->isVoiceActive())
+        {
+            float gains[VoicePanner::maxChannels];
+            panner.getGains(getPan(slot), gains);
+
+            stolenFades.capture(*voice, gains, panner.getNumChannels(), getStemIndex(slot), [this, &slot](float* tail, int numSamples)
+            {
+                filterStolenTail(slot, tail, numSamples);
+            });
+            stolenVoices.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        slot.midiChannel = midiChannel;
+        slot.midiNote = midiNoteNumber;
+
+        startVoice(voice, sound, midiChannel, midiNoteNumber, velocity);
+
+        // A voice only hears the controllers that move while it's playing the channel
+        auto& part = parts[(size_t)partIndex];
+
+        for (size_t i = 0; i < channelControllers.size(); ++i)
+            if (part.controllerValues[i] >= 0)
+                voice->controllerMoved(channelControllers[i], part.controllerValues[i]);
+
+        allocator.noteStarted(slotIndex, midiChannel, midiNoteNumber);
+        markActive(slotIndex, arrivalTime);
+    }
+
+    /** Picks a voice from the part's own pool, or the shared one if it has none:
+        a free voice of a kind that can play the sound if there is one, otherwise
+        (if stealing is on) the voice released longest ago, or failing that the
+        oldest held voice.
+    */
+    int findVoiceForPart(SynthesiserSound* sound, int partIndex, bool& wasStolen)
+    {
+        auto partPool = parts[(size_t)partIndex].reservedVoices > 0 ? partIndex : -1;
+        auto victim = -1;
+
+        for (int c = 0; c < (int)voiceClasses.size(); ++c)
+        {
+            if (!voiceClasses[(size_t)c]->canPlaySound(sound))
+                continue;
+
+            auto pool = getPoolIndex(partPool, c);
+            auto freeVoice = allocator.takeFreeVoice(pool);
+
+            if (freeVoice >= 0)
+            {
+                wasStolen = false;
+                return freeVoice;
+            }
+
+            auto candidate = allocator.findVoiceToSteal(pool);
+
+            if (candidate >= 0 && (victim < 0 || isBetterToSteal(candidate, victim)))
+                victim = candidate;
+        }
+
+        wasStolen = victim >= 0;
+        return isNoteStealingEnabled() ? victim : -1;
+    }
+
+    bool isBetterToSteal(int candidate, int current) const
+    {
+        auto candidateReleased = allocator.isReleased(candidate);
+
+        if (candidateReleased != allocator.isReleased(current))
+            return candidateReleased;
+
+        return slots[(size_t)candidate].voice->wasStartedBefore(*slots[(size_t)current].voice);
+    }
+
+    int getPoolIndex(int partPool, int voiceClass) const noexcept
+    {
+        return (partPool + 1) * (int)voiceClasses.size() + voiceClass;
+    }
+
+    /** Hands each part with a reservation the first voices that can play its sound. */
+    void assignVoicesToParts()
+    {
+        for (auto& slot : slots)
+            slot.part = -1;
+
+        for (int p = 0; p < numParts; ++p)
+        {
+            auto& part = parts[(size_t)p];
+            auto needed = part.reservedVoices;
+
+            for (auto& slot : slots)
+            {
+                if (needed == 0)
+                    break;
+
+                if (slot.part < 0 && (part.sound == nullptr || slot.voice->canPlaySound(part.sound.get())))
+                {
+                    slot.part = p;
+                    --needed;
+                }
+            }
+        }
+
+        resetAllocator();
+    }
+
+    /** Gives every combination of part and kind of voice its own pool, so that a
+        free voice is always one that can play the sound.
+    */
+    void resetAllocator()
+    {
+        voiceClasses.clear();
+
+        for (auto& slot : slots)
+        {
+            auto sameClass = [&slot](const SynthesiserVoice* v) { return typeid(*v) == typeid(*slot.voice); };
+            auto existing = std::find_if(voiceClasses.begin(), voiceClasses.end(), sameClass);
+            slot.voiceClass = (int)std::distance(voiceClasses.begin(), existing);
+
+            if (existing == voiceClasses.end())
+                voiceClasses.push_back(slot.voice);
+        }
+
+        std::vector<int> poolOfVoice;
+
+        for (auto& slot : slots)
+            poolOfVoice.push_back(getPoolIndex(slot.part, slot.voiceClass));
+
+        allocator.reset(poolOfVoice, (numParts + 1) * jmax(1, (int)voiceClasses.size()));
+
+        // Voices that are already sounding carry on, and can be stolen
+        for (int i = 0; i < (int)slots.size(); ++i)
+        {
+            auto* voice = slots[(size_t)i].voice;
+
+            if (!voice->isVoiceActive())
+                continue;
+
+            auto channel = 1;
+
+            while (channel < 16 && !voice->isPlayingChannel(channel))
+                ++channel;
+
+            allocator.noteStarted(i, channel, voice->getCurrentlyPlayingNote());
+
+            if (voice->isPlayingButReleased())
+                allocator.noteReleased(i);
+        }
+    }
+
+    struct alignas(64) ThreadScratch
+    {
+        AudioBuffer<float> buffer, voiceBuffer, stemBuses;
+        VoiceFilter::Workspace filterWorkspace;
+        uint32 stamp = 0;
+    };
+
+    //==============================================================================
+    bool hasStemBuses(int startSample, int numSamples) const noexcept
+    {
+        return stemLayout.load() != StemLayout::none
+            && stemBuses.getNumChannels() > 0
+            && startSample + numSamples <= stemBuses.getNumSamples();
+    }
+
+    int getStemIndex(const VoiceSlot& slot) const noexcept
+    {
+        if (stemLayout.load() == StemLayout::byPart)
+            return jlimit(0, numParts - 1, slot.midiChannel - 1);
+
+        return jmin(slot.voiceClass, maxStems - 1);
+    }
+
+    /** A view of the bus for a voice's stem, with as many channels as the output. */
+    AudioBuffer<float> getStemBus(AudioBuffer<float>& buses, const VoiceSlot& slot, int numChannels) const noexcept
+    {
+        return AudioBuffer<float>(buses.getArrayOfWritePointers() + getStemIndex(slot) * maxStemChannels,
+                                  numChannels, buses.getNumSamples());
+    }
+
+    void clearStems(AudioBuffer<float>& buses, int startSample, int numSamples) const noexcept
+    {
+        for (int ch = 0; ch < getNumStems() * maxStemChannels; ++ch)
+            FloatVectorOperations::clear(buses.getWritePointer(ch, startSample), numSamples);
+    }
+
+    /** The one place the voices reach the output when they're split into stems. */
+    void mixStemsInto(AudioBuffer<float>& outputAudio, int startSample, int numSamples) const noexcept
+    {
+        for (int stem = 0; stem < getNumStems(); ++stem)
+            for (int ch = 0; ch < outputAudio.getNumChannels(); ++ch)
+                FloatVectorOperations::add(outputAudio.getWritePointer(ch, startSample),
+                                           stemBuses.getReadPointer(stem * maxStemChannels + ch, startSample),
+                                           numSamples);
+    }
+
+    //==============================================================================
+    /** Renders the given slots a group at a time. Each voice is mixed into the
+        output, or into its stem's bus in buses if the stems are being split.
+    */
+    void renderVoiceGroups(const int* slotIndices, int numVoices, ThreadScratch& scratch, AudioBuffer<float>& output,
+                           AudioBuffer<float>& buses, int startSample, int blockOffset, int numSamples)
+    {
+        for (int first = 0; first < numVoices; first += VoiceFilter::numLanes)
+            renderVoiceGroup(slotIndices + first, jmin(VoiceFilter::numLanes, numVoices - first), scratch,
+                             output, buses, startSample, blockOffset, numSamples);
+    }
+
+    /** Renders up to VoiceFilter::numLanes voices, each on its own in mono,
+        filters them together, then measures each one and pans it into its
+        target. blockOffset is where the sub-block starts within the block being rendered.
+    */
+    void renderVoiceGroup(const int* slotIndices, int numVoices, ThreadScratch& scratch, AudioBuffer<float>& output,
+                          AudioBuffer<float>& buses, int startSample, int blockOffset, int numSamples)
+    {
+        float* channels[VoiceFilter::numLanes];
+        VoiceFilter::State* states[VoiceFilter::numLanes];
+        int midiNotes[VoiceFilter::numLanes];
+
+        for (int i = 0; i < numVoices; ++i)
+        {
+            auto& slot = slots[(size_t)slotIndices[i]];
+            channels[i] = scratch.voiceBuffer.getWritePointer(i);
+            states[i] = &slot.filterState;
+            midiNotes[i] = slot.midiNote;
+
+            AudioBuffer<float> voiceOutput(channels + i, 1, numSamples);
+            voiceOutput.clear();
+            slot.voice->renderNextBlock(voiceOutput, 0, numSamples);
+        }
+
+        voiceFilter.process(currentFilterMode, channels, states, midiNotes, numVoices, numSamples, scratch.filterWorkspace);
+
+        for (int i = 0; i < numVoices; ++i)
+        {
+            auto& slot = slots[(size_t)slotIndices[i]];
+            AudioBuffer<float> voiceOutput(channels + i, 1, numSamples);
+
+            if (renderingStems)
+            {
+                auto bus = getStemBus(buses, slot, output.getNumChannels());
+                mixVoice(slot, voiceOutput, bus, startSample, blockOffset);
+            }
+            else
+            {
+                mixVoice(slot, voiceOutput, output, startSample, blockOffset);
+            }
+        }
+    }
+
+    /** Measures a voice's output and pans it into the target. */
+    void mixVoice(VoiceSlot& slot, const AudioBuffer<float>& voiceOutput, AudioBuffer<float>& target,
+                  int startSample, int blockOffset)
+    {
+        auto numSamples = voiceOutput.getNumSamples();
+        auto* mono = voiceOutput.getReadPointer(0);
+        auto peak = numSamples == processingQuantum ? measurePeak<processingQuantum>(mono, numSamples)
+                                                    : measurePeak<0>(mono, numSamples);
+
+        if (peak > 0.0f)
+        {
+            float gains[VoicePanner::maxChannels];
+            panner.getGains(getPan(slot), gains);
+
+            for (int ch = 0; ch < jmin(target.getNumChannels(), panner.getNumChannels()); ++ch)
+                if (gains[ch] != 0.0f)
+                    FloatVectorOperations::addWithMultiply(target.getWritePointer(ch, startSample), mono, gains[ch], numSamples);
+        }
+
+        if (peak < silenceThreshold.load(std::memory_order_relaxed))
+            slot.silentSamples += numSamples;
+        else
+            slot.silentSamples = 0;
+
+        if (slot.noteArrivalTime > 0.0 && peak > 0.0f && latencyMonitor != nullptr)
+        {
+            latencyMonitor->voiceSounded(slot.noteArrivalTime, blockOffset + findFirstNonZeroSample(voiceOutput));
+            slot.noteArrivalTime = 0.0;
+        }
+    }
+
+    /** Runs a stolen voice's tail through its filter, on the audio thread, a workspace-full at a time. */
+    void filterStolenTail(VoiceSlot& slot, float* tail, int numSamples)
+    {
+        auto mode = voiceFilter.getMode();
+
+        if (mode == VoiceFilter::Mode::off || threadScratch.empty() || threadScratch.front().filterWorkspace.samples.empty())
+            return;
+
+        auto& workspace = threadScratch.front().filterWorkspace;
+
+        auto* state = &slot.filterState;
+
+        for (int start = 0; start < numSamples; start += (int)workspace.samples.size())
+        {
+            auto* chunk = tail + start;
+            voiceFilter.process(mode, &chunk, &state, &slot.midiNote, 1,
+                                jmin((int)workspace.samples.size(), numSamples - start), workspace);
+        }
+    }
+
+    static int findFirstNonZeroSample(const AudioBuffer<float>& buffer) noexcept
+    {
+        auto first = buffer.getNumSamples();
+
+        for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+        {
+            auto* data = buffer.getReadPointer(ch);
+
+            for (int i = 0; i < first; ++i)
+            {
+                if (data[i] != 0.0f)
+                {
+                    first = i;
+                    break;
+                }
+            }
+        }
+
+        return first;
+    }
+
+    /** With a non-zero fixedSize the trip count is known at compile time. */
+    template <int fixedSize>
+    static float measurePeak(const float* source, int numSamples) noexcept
+    {
+        auto n = fixedSize > 0 ? fixedSize : numSamples;
+        auto peak = 0.0f;
+
+        for (int i = 0; i < n; ++i)
+            peak = jmax(peak, std::abs(source[i]));
+
+        return peak;
+    }
+
+    /** The part's pan, plus the note's offset from the middle of the keyboard scaled by the spread. */
+    float getPan(const VoiceSlot& slot) const noexcept
+    {
+        auto offset = (float)(slot.midiNote - 64) / 64.0f * stereoSpread.load(std::memory_order_relaxed);
+        return jlimit(-1.0f, 1.0f, getPartPan(slot.midiChannel) + offset);
+    }
+
+    /** Drops voices that have finished from the active list, and stops released
+        ones that have been inaudible for long enough.
+    */
+    void retireFinishedVoices()
+    {
+        for (auto i = (int)activeVoices.size(); --i >= 0;)
+        {
+            auto& slot = slots[(size_t)activeVoices[(size_t)i]];
+
+            if (slot.voice->isVoiceActive()
+                 && slot.silentSamples >= cullWindowSamples
+                 && slot.voice->isPlayingButReleased())
+            {
+                slot.voice->stopNote(0.0f, false);
+                culledVoices.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (slot.voice->isPlayingButReleased())
+            {
+                // Picks up voices let go by the sustain pedal, which noteOff() doesn't see
+                allocator.noteReleased(activeVoices[(size_t)i]);
+            }
+
+            if (!slot.voice->isVoiceActive())
+            {
+                allocator.voiceFinished(activeVoices[(size_t)i]);
+                slot.isActive = false;
+                activeVoices[(size_t)i] = activeVoices.back();
+                activeVoices.pop_back();
+            }
+        }
+
+        numActiveVoicesForDisplay.store((int)activeVoices.size(), std::memory_order_relaxed);
+    }
+
+    void markActive(int slotIndex, double noteArrivalTime = 0.0)
+    {
+        if (!isPositiveAndBelow(slotIndex, (int)slots.size()))
+            return;
+
+        auto& slot = slots[(size_t)slotIndex];
+        slot.silentSamples = 0;
+        slot.noteArrivalTime = noteArrivalTime;
+        slot.filterState.reset();
+
+        if (!slot.isActive)
+        {
+            slot.isActive = true;
+            activeVoices.push_back(slotIndex); // never reallocates, see addVoice()
+        }
+    }
+
+    void rebuildSlots()
+    {
+        slots.clear();
+        activeVoices.clear();
+
+        for (auto* voice : voices)
+            slots.push_back({ voice });
+
+        for (int i = 0; i < (int)slots.size(); ++i)
+            if (slots[(size_t)i].voice->isVoiceActive())
+                markActive(i);
+
+        activeVoices.reserve(slots.size());
+        assignVoicesToParts();
+    }
+
+    //==============================================================================
+    void renderInParallel(AudioBuffer<float>& outputAudio, int startSample, int numSamples)
+    {
+        // A couple of jobs per thread evens out voices that are cheaper than others
+        auto numActive = (int)activeVoices.size();
+        auto numThreads = renderer->getNumThreads();
+        voicesPerJob = jmax(1, (numActive + numThreads * 2 - 1) / (numThreads * 2));
+
+        // Jobs of whole groups, so no filter runs with lanes to spare that another job could have filled
+        if (currentFilterMode != VoiceFilter::Mode::off)
+            voicesPerJob = (voicesPerJob + VoiceFilter::numLanes - 1) / VoiceFilter::numLanes * VoiceFilter::numLanes;
+
+        auto numJobs = (numActive + voicesPerJob - 1) / voicesPerJob;
+
+        currentStartSample = startSample;
+        currentNumSamples = numSamples;
+        currentNumChannels = outputAudio.getNumChannels();
+        ++runStamp;
+
+        auto blockMs = 1000.0 * numSamples / getSampleRate();
+
+        if (renderer->run(*this, numJobs, blockMs * deadlineFraction))
+        {
+            consecutiveMisses = 0;
+        }
+        else
+        {
+            deadlineMisses.fetch_add(1, std::memory_order_relaxed);
+
+            if (++consecutiveMisses >= maxConsecutiveMisses)
+            {
+                serialSamplesRemaining = (int)getSampleRate();
+                consecutiveMisses = 0;
+            }
+        }
+
+        parallelBlocks.fetch_add(1, std::memory_order_relaxed);
+
+        for (auto& scratch : threadScratch)
+        {
+            if (scratch.stamp != runStamp)
+                continue;
+
+            if (renderingStems)
+            {
+                for (int stem = 0; stem < getNumStems(); ++stem)
+                    for (int ch = 0; ch < currentNumChannels; ++ch)
+                        FloatVectorOperations::add(stemBuses.getWritePointer(stem * maxStemChannels + ch, startSample),
+                                                   scratch.stemBuses.getReadPointer(stem * maxStemChannels + ch),
+                                                   numSamples);
+
+                continue;
+            }
+
+            for (int ch = 0; ch < currentNumChannels; ++ch)
+                FloatVectorOperations::add(outputAudio.getWritePointer(ch, startSample),
+                                           scratch.buffer.getReadPointer(ch),
+                                           numSamples);
+        }
+    }
+
+    void renderJob(int jobIndex, int threadIndex) override
+    {
+        auto& scratch = threadScratch[(size_t)threadIndex];
+
+        // The first job a thread takes on in each run clears its scratch buffer
+        if (scratch.stamp != runStamp)
+        {
+            if (renderingStems)
+                clearStems(scratch.stemBuses, 0, currentNumSamples);
+            else
+                for (int ch = 0; ch < currentNumChannels; ++ch)
+                    FloatVectorOperations::clear(scratch.buffer.getWritePointer(ch), currentNumSamples);
+
+            scratch.stamp = runStamp;
+        }
+
+        AudioBuffer<float> target(scratch.buffer.getArrayOfWritePointers(), currentNumChannels, currentNumSamples);
+
+        // Each slot belongs to exactly one job, so its silence counter isn't shared
+        auto first = jobIndex * voicesPerJob;
+        auto last = jmin(first + voicesPerJob, (int)activeVoices.size());
+
+        if (first < last)
+            renderVoiceGroups(activeVoices.data() + first, last - first, scratch, target, scratch.stemBuses,
+                              0, currentStartSample, currentNumSamples);
+    }
+
+    bool canMeasureVoices(const AudioBuffer<float>& outputAudio, int numSamples) const noexcept
+    {
+        return !threadScratch.empty()
+            && numSamples <= maxBlockSize
+            && outputAudio.getNumChannels() <= maxScratchChannels;
+    }
+
+    bool shouldRenderInParallel(int numSamples)
+    {
+        if (!parallelRendering || !renderer->hasWorkers())
+            return false;
+
+        if (serialSamplesRemaining > 0)
+        {
+            serialSamplesRemaining -= numSamples;
+            return false;
+        }
+
+        return (int)threadScratch.size() >= renderer->getNumThreads();
+    }
+
+    /** Starts a new renderer's workers and allocates their scratch space with no
+        lock held, then swaps them in under the lock, which only takes a moment.
+        The old workers are stopped once the audio thread can no longer reach them.
+    */
+    void rebuildRenderer(int blockSize, bool withWorkers)
+    {
+        auto newRenderer = std::make_unique<ParallelVoiceRenderer>();
+
+        if (withWorkers)
+            newRenderer->startWorkers(numWorkers, blockSize, getSampleRate());
+
+        std::vector<ThreadScratch> newScratch((size_t)newRenderer->getNumThreads());
+
+        for (auto& scratch : newScratch)
+        {
+            scratch.buffer.setSize(maxScratchChannels, blockSize);
+            scratch.voiceBuffer.setSize(VoiceFilter::numLanes, blockSize);
+            scratch.filterWorkspace.prepare(blockSize);
+        }
+
+        AudioBuffer<float> newStemBuses;
+        allocateStems(newStemBuses, newScratch, stemLayout.load(), blockSize);
+
+        {
+            const ScopedLock sl(lock);
+
+            std::swap(renderer, newRenderer);
+            std::swap(threadScratch, newScratch);
+            std::swap(stemBuses, newStemBuses);
+            maxBlockSize = blockSize;
+            runStamp = 0;
+        }
+
+        newRenderer->stopWorkers();
+    }
+
+    /** Every thread gets a full set of buses, so the workers never share one. */
+    static void allocateStems(AudioBuffer<float>& buses, std::vector<ThreadScratch>& scratchToUse,
+                              StemLayout layout, int blockSize)
+    {
+        auto numChannels = layout != StemLayout::none ? maxStems * maxStemChannels : 0;
+        auto numSamples = numChannels > 0 ? blockSize : 0;
+
+        buses.setSize(numChannels, numSamples);
+        buses.clear();
+
+        for (auto& scratch : scratchToUse)
+            scratch.stemBuses.setSize(numChannels, numSamples);
+    }
+
+    //==============================================================================
+    static constexpr int maxScratchChannels = VoicePanner::maxChannels;
+    static constexpr int minVoicesForParallel = 4;
+    static constexpr int maxConsecutiveMisses = 2;
+    static constexpr double deadlineFraction = 0.5;
+
+    std::unique_ptr<ParallelVoiceRenderer> renderer { std::make_unique<ParallelVoiceRenderer>() };
+    std::vector<ThreadScratch> threadScratch;
+    std::vector<VoiceSlot> slots;       // parallel to the voices array
+    std::vector<int> activeVoices;      // indices into slots, in no particular order
+    std::array<Part, numParts> parts;
+    std::vector<SynthesiserVoice*> voiceClasses;   // one voice of each type
+    VoiceAllocator allocator;
+    StolenVoiceFades stolenFades;
+    AudioBuffer<float> stemBuses;       // the whole block's stems, summed over the threads
+    std::atomic<StemLayout> stemLayout { StemLayout::none };
+
+    int maxBlockSize = 4096, numWorkers = getDefaultNumWorkers();
+    int cullWindowSamples = 4096;
+    bool parallelRendering = false;
+    std::atomic<float> silenceThreshold { Decibels::decibelsToGain(-96.0f) };
+    std::atomic<float> stereoSpread { 0.0f };
+    std::atomic<bool> surroundPanning { false };
+    VoicePanner panner;
+    VoiceFilter voiceFilter;
+    LatencyMonitor* latencyMonitor = nullptr;
+
+    // Only touched on the audio thread, or read by the workers during a run
+    int voicesPerJob = 1;
+    int currentStartSample = 0, currentNumSamples = 0, currentNumChannels = 0;
+    bool renderingStems = false;
+    VoiceFilter::Mode currentFilterMode = VoiceFilter::Mode::off;
+    uint32 runStamp = 0;
+    int consecutiveMisses = 0, serialSamplesRemaining = 0;
+
+    std::atomic<uint64> parallelBlocks { 0 }, serialBlocks { 0 }, deadlineMisses { 0 }, culledVoices { 0 }, stolenVoices { 0 };
+    std::atomic<int> numActiveVoicesForDisplay { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SynthEngine)
+};
@@ -0,0 +1,407 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "VoicePanner.h"
+
+//==============================================================================
+/** Keeps track of which voices are free, held and released, so that a voice can
+    be found for a new note in constant time however many voices there are.
+
+    Voices are identified by index, and each one belongs to a single pool. Every
+    pool has a stack of free voices and two lists of busy ones, held and
+    released, each kept in the order the voices joined it. A note takes a free
+    voice if there is one, otherwise it steals the voice that was released
+    longest ago, which has had the most time to decay and so is also the quietest
+    in practice, and only then the oldest held voice. As in juce::Synthesiser,
+    the voices playing a pool's lowest and highest held notes, usually the bass
+    line and the melody, are passed over for that while there's any other held
+    voice to take. Busy voices are also
+    linked by the note they're playing, so a note-off or retrigger only visits
+    the voices on that note.
+
+    Nothing here allocates after reset(), so it's safe to use on the audio thread.
+*/
+class VoiceAllocator final
+{
+public:
+    VoiceAllocator()
+    {
+        noteHeads.fill(-1);
+    }
+
+    /** Starts again with every voice free. poolOfVoice gives the pool (0 to numPools - 1) of each voice. */
+    void reset(const std::vector<int>& poolOfVoice, int numPools)
+    {
+        voices.assign(poolOfVoice.size(), {});
+        pools.assign((size_t)jmax(1, numPools), {});
+
+        for (auto& pool : pools)
+            pool.freeVoices.reserve(poolOfVoice.size());
+
+        for (auto& head : noteHeads)
+            head = -1;
+
+        // Pushed in reverse, so that the lowest-numbered voices get used first
+        for (auto i = (int)poolOfVoice.size(); --i >= 0;)
+        {
+            voices[(size_t)i].pool = jlimit(0, (int)pools.size() - 1, poolOfVoice[(size_t)i]);
+            pools[(size_t)voices[(size_t)i].pool].freeVoices.push_back(i);
+        }
+    }
+
+    //==============================================================================
+    /** Takes a free voice from a pool, or returns -1. */
+    int takeFreeVoice(int poolIndex) noexcept
+    {
+        auto& freeVoices = pools[(size_t)poolIndex].freeVoices;
+
+        if (freeVoices.empty())
+            return -1;
+
+        auto voice = freeVoices.back();
+        freeVoices.pop_back();
+        voices[(size_t)voice].state = busy;
+        return voice;
+    }
+
+    /** The voice in a pool that should be stolen first, or -1 if the pool has none busy. */
+    int findVoiceToSteal(int poolIndex) const noexcept
+    {
+        auto& pool = pools[(size_t)poolIndex];
+
+        if (pool.released.first >= 0)
+            return pool.released.first;
+
+        auto lowestNote = pool.findHeldNote(0, 1), highestNote = pool.findHeldNote(127, -1);
+        auto lowestVoice = -1, highestVoice = -1;
+
+        // Only one voice is kept back for each end, so this never looks past the third
+        for (auto voice = pool.held.first; voice >= 0; voice = voices[(size_t)voice].next)
+        {
+            auto note = voices[(size_t)voice].heldNote;
+
+            if (lowestVoice < 0 && note >= 0 && note == lowestNote)
+                lowestVoice = voice;
+            else if (highestVoice < 0 && note >= 0 && note == highestNote)
+                highestVoice = voice;
+            else
+                return voice;
+        }
+
+        // Only the lowest and highest notes are held, and the melody matters more
+        return lowestVoice >= 0 ? lowestVoice : highestVoice;
+    }
+
+    bool isReleased(int voice) const noexcept    { return voices[(size_t)voice].list == List::released; }
+
+    //==============================================================================
+    /** A voice has started a note, either from free or by being stolen. */
+    void noteStarted(int voice, int midiChannel, int midiNoteNumber) noexcept
+    {
+        auto& v = voices[(size_t)voice];
+
+        if (v.state == idle)
+            removeFromFreeStack(voice);
+
+        unlinkFromNote(voice);
+        v.state = busy;
+
+        if (isPositiveAndBelow(midiChannel - 1, 16) && isPositiveAndBelow(midiNoteNumber, 128))
+        {
+            v.noteKey = (midiChannel - 1) * 128 + midiNoteNumber;
+            v.nextOnNote = noteHeads[(size_t)v.noteKey];
+            v.previousOnNote = -1;
+
+            if (v.nextOnNote >= 0)
+                voices[(size_t)v.nextOnNote].previousOnNote = voice;
+
+            noteHeads[(size_t)v.noteKey] = voice;
+        }
+
+        // After the note's known, so that it's counted as held
+        moveToList(voice, List::held);
+    }
+
+    /** A held voice has had its key (and any pedal holding it) let go. */
+    void noteReleased(int voice) noexcept
+    {
+        if (voices[(size_t)voice].list == List::held)
+            moveToList(voice, List::released);
+    }
+
+    /** A voice has gone silent and can be used again. */
+    void voiceFinished(int voice) noexcept
+    {
+        auto& v = voices[(size_t)voice];
+
+        if (v.state == idle)
+            return;
+
+        unlinkFromNote(voice);
+        moveToList(voice, List::none);
+        v.state = idle;
+        pools[(size_t)v.pool].freeVoices.push_back(voice); // never reallocates, see reset()
+    }
+
+    /** Calls fn(voiceIndex) for every busy voice that was started on this note. fn may
+        release or finish the voice it's given.
+    */
+    template <typename Function>
+    void forEachVoiceOnNote(int midiChannel, int midiNoteNumber, Function&& fn)
+    {
+        if (!isPositiveAndBelow(midiChannel - 1, 16) || !isPositiveAndBelow(midiNoteNumber, 128))
+            return;
+
+        for (auto voice = noteHeads[(size_t)((midiChannel - 1) * 128 + midiNoteNumber)]; voice >= 0;)
+        {
+            auto next = voices[(size_t)voice].nextOnNote;
+            fn(voice);
+            voice = next;
+        }
+    }
+
+private:
+    //==============================================================================
+    enum class List { none, held, released };
+    enum State { idle, busy };
+
+    struct Links
+    {
+        int first = -1, last = -1;
+    };
+
+    struct Voice
+    {
+        int pool = 0;
+        State state = idle;
+        List list = List::none;
+        int previous = -1, next = -1;                  // within the pool's held or released list
+        int noteKey = -1, previousOnNote = -1, nextOnNote = -1;
+        int heldNote = -1;                             // the note counted in the pool's heldNotes, if any
+    };
+
+    struct Pool
+    {
+        std::vector<int> freeVoices;
+        Links held, released;
+        std::array<uint16, 128> heldNotes {};          // how many held voices are on each note
+
+        /** The first note with a held voice, searching from one end. Returns -1 if there are none. */
+        int findHeldNote(int start, int step) const noexcept
+        {
+            for (auto note = start; isPositiveAndBelow(note, 128); note += step)
+                if (heldNotes[(size_t)note] > 0)
+                    return note;
+
+            return -1;
+        }
+    };
+
+    Links* getLinks(const Voice& v) noexcept
+    {
+        auto& pool = pools[(size_t)v.pool];
+
+        switch (v.list)
+        {
+            case List::held:      return &pool.held;
+            case List::released:  return &pool.released;
+            case List::none:
+            default:              return nullptr;
+        }
+    }
+
+    void moveToList(int voice, List newList) noexcept
+    {
+        auto& v = voices[(size_t)voice];
+
+        if (auto* links = getLinks(v))
+        {
+            (v.previous >= 0 ? voices[(size_t)v.previous].next : links->first) = v.next;
+            (v.next >= 0 ? voices[(size_t)v.next].previous : links->last) = v.previous;
+        }
+
+        auto& heldNotes = pools[(size_t)v.pool].heldNotes;
+
+        if (v.heldNote >= 0)
+            --heldNotes[(size_t)v.heldNote];
+
+        v.heldNote = (newList == List::held && v.noteKey >= 0) ? v.noteKey % 128 : -1;
+
+        if (v.heldNote >= 0)
+            ++heldNotes[(size_t)v.heldNote];
+
+        v.list = newList;
+        v.previous = v.next = -1;
+
+        if (auto* links = getLinks(v))
+        {
+            // Appended, so each list stays oldest-first
+            v.previous = links->last;
+            (links->last >= 0 ? voices[(size_t)links->last].next : links->first) = voice;
+            links->last = voice;
+        }
+    }
+
+    void unlinkFromNote(int voice) noexcept
+    {
+        auto& v = voices[(size_t)voice];
+
+        if (v.noteKey < 0)
+            return;
+
+        (v.previousOnNote >= 0 ? voices[(size_t)v.previousOnNote].nextOnNote : noteHeads[(size_t)v.noteKey]) = v.nextOnNote;
+
+        if (v.nextOnNote >= 0)
+            voices[(size_t)v.nextOnNote].previousOnNote = v.previousOnNote;
+
+        v.noteKey = v.previousOnNote = v.nextOnNote = -1;
+    }
+
+    /** Only needed when a voice that was started outside the allocator turns out to be free. */
+    void removeFromFreeStack(int voice) noexcept
+    {
+        auto& freeVoices = pools[(size_t)voices[(size_t)voice].pool].freeVoices;
+        auto it = std::find(freeVoices.begin(), freeVoices.end(), voice);
+
+        if (it != freeVoices.end())
+        {
+            *it = freeVoices.back();
+            freeVoices.pop_back();
+        }
+    }
+
+    std::vector<Voice> voices;
+    std::vector<Pool> pools;
+    std::array<int, 16 * 128> noteHeads;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(VoiceAllocator)
+};
+
+//==============================================================================
+/** Fades out stolen voices instead of cutting them off.
+
+    Just before a voice is taken over by a new note, its next few milliseconds
+    are rendered ahead into one of a fixed set of buffers and multiplied by a
+    fade-out curve. That tail is then mixed into the output over the following
+    blocks, so it fades out while the new note starts on the same voice. If
+    every buffer is busy, as can happen during a flood of notes, the voice is
+    cut off as before.
+*/
+class StolenVoiceFades final
+{
+public:
+    static constexpr int maxFades = 16;
+
+    StolenVoiceFades() = default;
+
+    void prepare(double sampleRate)
+    {
+        fadeLength = jlimit(32, 512, roundToInt(sampleRate * 0.003));
+        numActive = 0;
+
+        curve.resize((size_t)fadeLength);
+
+        for (int i = 0; i < fadeLength; ++i)
+            curve[(size_t)i] = 0.5f * (1.0f + std::cos(MathConstants<float>::pi * (float)(i + 1) / (float)fadeLength));
+
+        for (auto& fade : fades)
+        {
+            fade.buffer.setSize(1, fadeLength);
+            fade.remaining = 0;
+        }
+    }
+
+    /** Renders a voice's tail in mono, ready to be faded out and mixed into each
+        output channel with the gains given. Returns false if there was no room for it.
+    */
+    bool capture(SynthesiserVoice& voice, const float* gains, int numGains) noexcept
+    {
+        return capture(voice, gains, numGains, 0, [](float*, int) {});
+    }
+
+    /** The same, but with processTail(float* samples, int numSamples) called on the
+        tail before it's faded, to put it through whatever the voice's output normally
+        goes through, and with the stem the voice was playing into (see mixIntoStems()).
+    */
+    template <typename TailProcessor>
+    bool capture(SynthesiserVoice& voice, const float* gains, int numGains, int stem, TailProcessor&& processTail) noexcept
+    {
+        auto* fade = std::find_if(fades.begin(), fades.end(), [](const Fade& f) { return f.remaining == 0; });
+
+        if (fade == fades.end() || fadeLength == 0)
+            return false;
+
+        fade->buffer.clear();
+        voice.renderNextBlock(fade->buffer, 0, fadeLength);
+        processTail(fade->buffer.getWritePointer(0), fadeLength);
+
+        FloatVectorOperations::multiply(fade->buffer.getWritePointer(0), curve.data(), fadeLength);
+
+        fade->numGains = jmin(numGains, (int)fade->gains.size());
+        std::copy(gains, gains + fade->numGains, fade->gains.begin());
+        fade->stem = stem;
+        fade->position = 0;
+        fade->remaining = fadeLength;
+        ++numActive;
+        return true;
+    }
+
+    bool isEmpty() const noexcept    { return numActive == 0; }
+
+    void mixInto(AudioBuffer<float>& output, int startSample, int numSamples) noexcept
+    {
+        mix(startSample, numSamples, [&output](int) -> AudioBuffer<float>& { return output; });
+    }
+
+    /** Mixes each tail into its own stem instead, where getStemBus(int stem) returns
+        a buffer (or a view of one) to add that stem's tails to.
+    */
+    template <typename StemBusGetter>
+    void mixIntoStems(int startSample, int numSamples, StemBusGetter&& getStemBus) noexcept
+    {
+        mix(startSample, numSamples, getStemBus);
+    }
+
+private:
+    template <typename TargetGetter>
+    void mix(int startSample, int numSamples, TargetGetter&& getTarget) noexcept
+    {
+        if (numActive == 0)
+            return;
+
+        for (auto& fade : fades)
+        {
+            if (fade.remaining == 0)
+                continue;
+
+            auto&& output = getTarget(fade.stem);
+            auto n = jmin(numSamples, fade.remaining);
+            auto numChannels = jmin(output.getNumChannels(), fade.numGains);
+
+            for (int ch = 0; ch < numChannels; ++ch)
+                if (fade.gains[(size_t)ch] != 0.0f)
+                    FloatVectorOperations::addWithMultiply(output.getWritePointer(ch, startSample),
+                                                           fade.buffer.getReadPointer(0, fade.position),
+                                                           fade.gains[(size_t)ch], n);
+
+            fade.position += n;
+            fade.remaining -= n;
+
+            if (fade.remaining == 0)
+                --numActive;
+        }
+    }
+
+    struct Fade
+    {
+        AudioBuffer<float> buffer;
+        std::array<float, VoicePanner::maxChannels> gains {};
+        int numGains = 0, stem = 0, position = 0, remaining = 0;
+    };
+
+    std::array<Fade, maxFades> fades;
+    std::vector<float> curve;
+    int fadeLength = 0, numActive = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(StolenVoiceFades)
+};
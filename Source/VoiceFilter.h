@@ -0,0 +1,206 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include <juce_dsp/juce_dsp.h>
+
+//==============================================================================
+/** A resonant state-variable filter on every voice, run on several voices at
+    once, one voice per SIMD lane (four with SSE or NEON).
+
+    The engine renders a group of voices into separate mono buffers and hands
+    them over together. They're interleaved so that each sample of every voice
+    in the group sits in one register, run through the filter side by side, and
+    split back out. The filter is the trapezoidal (zero-delay feedback) SVF,
+    whose two states per voice live in the voice's State between blocks, and
+    whose low, band and high outputs are blended by the same three gains for
+    every mode.
+
+    A voice's cutoff follows the setting and, by the key tracking amount, its
+    note. The cutoff and resonance glide towards their targets once per block,
+    on a log scale for the cutoff, so the coefficients only have to be worked
+    out once per voice per block.
+*/
+class VoiceFilter final
+{
+public:
+    enum class Mode { off, lowpass, bandpass, highpass };
+
+    using Lanes = dsp::SIMDRegister<float>;
+    static constexpr int numLanes = (int)Lanes::SIMDNumElements;
+
+    /** What the filter remembers about one voice. */
+    struct State
+    {
+        float ic1 = 0.0f, ic2 = 0.0f;
+        float cutoff = 0.0f, resonance = 0.0f;   // the smoothed values, with 0 meaning start at the targets
+
+        void reset() noexcept    { *this = {}; }
+    };
+
+    /** Room to interleave a group's samples. The engine gives each rendering thread its own. */
+    struct Workspace
+    {
+        void prepare(int maxBlockSize)    { samples.resize((size_t)maxBlockSize); }
+
+        std::vector<Lanes> samples;
+    };
+
+    VoiceFilter() = default;
+
+    void prepare(double newSampleRate) noexcept
+    {
+        sampleRate = newSampleRate;
+    }
+
+    //==============================================================================
+    /** The settings can be changed from any thread. */
+    void setMode(Mode newMode) noexcept              { mode.store(newMode, std::memory_order_relaxed); }
+    Mode getMode() const noexcept                    { return mode.load(std::memory_order_relaxed); }
+    bool isEnabled() const noexcept                  { return getMode() != Mode::off; }
+
+    /** The cutoff for middle C, in Hz. */
+    void setCutoff(float hz) noexcept                { cutoff.store(jlimit(minCutoffHz, 20000.0f, hz), std::memory_order_relaxed); }
+    float getCutoff() const noexcept                 { return cutoff.load(std::memory_order_relaxed); }
+
+    /** The filter's Q, from 0.5 (no peak at all) upwards. */
+    void setResonance(float q) noexcept              { resonance.store(jlimit(0.5f, 20.0f, q), std::memory_order_relaxed); }
+    float getResonance() const noexcept              { return resonance.load(std::memory_order_relaxed); }
+
+    /** How far the cutoff follows the note: 1 moves it an octave per octave. */
+    void setKeyTracking(float amount) noexcept       { keyTracking.store(jlimit(0.0f, 1.0f, amount), std::memory_order_relaxed); }
+    float getKeyTracking() const noexcept            { return keyTracking.load(std::memory_order_relaxed); }
+
+    //==============================================================================
+    /** Filters up to numLanes voices in place. channels[i] holds numSamples of
+        voice i, which has the given state and is playing midiNotes[i]. The group
+        has to be rendered with the same settings throughout, so read the mode
+        once and pass it in.
+    */
+    void process(Mode modeToUse, float* const* channels, State* const* states, const int* midiNotes,
+                 int numVoices, int numSamples, Workspace& workspace) const noexcept
+    {
+        jassert(isPositiveAndNotGreaterThan(numVoices, numLanes));
+        jassert(numSamples <= (int)workspace.samples.size());
+
+        if (modeToUse == Mode::off || numVoices == 0)
+            return;
+
+        LaneArray coefficients {};
+        auto* c = reinterpret_cast<float*>(coefficients.data());
+        auto glide = 1.0f - std::exp(-(float)numSamples / (float)(smoothingSeconds * sampleRate));
+
+        for (int lane = 0; lane < numLanes; ++lane)
+        {
+            // Spare lanes are given a harmless filter and silence
+            State spare;
+            auto& state = lane < numVoices ? *states[lane] : spare;
+            auto note = lane < numVoices ? midiNotes[lane] : 60;
+
+            updateSmoothedValues(state, note, glide);
+            setLaneCoefficients(c, lane, modeToUse, state);
+        }
+
+        auto a1 = coefficients[a1Index], a2 = coefficients[a2Index], a3 = coefficients[a3Index];
+        auto m0 = coefficients[m0Index], m1 = coefficients[m1Index], m2 = coefficients[m2Index];
+        auto ic1 = coefficients[ic1Index], ic2 = coefficients[ic2Index];
+
+        auto* lanes = workspace.samples.data();
+        interleave(lanes, channels, numVoices, numSamples);
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto v0 = lanes[i];
+            auto v3 = v0 - ic2;
+            auto v1 = a1 * ic1 + a2 * v3;
+            auto v2 = ic2 + a2 * ic1 + a3 * v3;
+
+            ic1 = v1 + v1 - ic1;
+            ic2 = v2 + v2 - ic2;
+
+            lanes[i] = m0 * v0 + m1 * v1 + m2 * v2;
+        }
+
+        deinterleave(lanes, channels, numVoices, numSamples);
+
+        for (int lane = 0; lane < numVoices; ++lane)
+        {
+            states[lane]->ic1 = ic1.get((size_t)lane);
+            states[lane]->ic2 = ic2.get((size_t)lane);
+        }
+    }
+
+private:
+    //==============================================================================
+    enum CoefficientIndex { a1Index, a2Index, a3Index, m0Index, m1Index, m2Index, ic1Index, ic2Index, numCoefficients };
+
+    using LaneArray = std::array<Lanes, numCoefficients>;
+
+    void updateSmoothedValues(State& state, int midiNote, float glide) const noexcept
+    {
+        auto targetCutoff = getCutoff() * std::exp2(getKeyTracking() * (float)(midiNote - 60) / 12.0f);
+        targetCutoff = jlimit(minCutoffHz, (float)(sampleRate * 0.45), targetCutoff);
+        auto targetResonance = getResonance();
+
+        if (state.cutoff <= 0.0f)
+        {
+            state.cutoff = targetCutoff;
+            state.resonance = targetResonance;
+            return;
+        }
+
+        state.cutoff *= std::pow(targetCutoff / state.cutoff, glide);
+        state.resonance += (targetResonance - state.resonance) * glide;
+    }
+
+    /** Fills a lane of each coefficient register (the array is laid out register by register). */
+    void setLaneCoefficients(float* c, int lane, Mode modeToUse, const State& state) const noexcept
+    {
+        auto g = std::tan(MathConstants<float>::pi * state.cutoff / (float)sampleRate);
+        auto k = 1.0f / state.resonance;
+        auto a1 = 1.0f / (1.0f + g * (g + k));
+
+        auto set = [c, lane](CoefficientIndex index, float value) { c[index * numLanes + lane] = value; };
+
+        set(a1Index, a1);
+        set(a2Index, g * a1);
+        set(a3Index, g * g * a1);
+        set(m0Index, modeToUse == Mode::highpass ? 1.0f : 0.0f);
+        set(m1Index, modeToUse == Mode::highpass ? -k : (modeToUse == Mode::bandpass ? 1.0f : 0.0f));
+        set(m2Index, modeToUse == Mode::highpass ? -1.0f : (modeToUse == Mode::lowpass ? 1.0f : 0.0f));
+        set(ic1Index, state.ic1);
+        set(ic2Index, state.ic2);
+    }
+
+    static void interleave(Lanes* lanes, const float* const* channels, int numVoices, int numSamples) noexcept
+    {
+        auto* samples = reinterpret_cast<float*>(lanes);
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            for (int lane = 0; lane < numVoices; ++lane)
+                samples[i * numLanes + lane] = channels[lane][i];
+
+            for (int lane = numVoices; lane < numLanes; ++lane)
+                samples[i * numLanes + lane] = 0.0f;
+        }
+    }
+
+    static void deinterleave(const Lanes* lanes, float* const* channels, int numVoices, int numSamples) noexcept
+    {
+        auto* samples = reinterpret_cast<const float*>(lanes);
+
+        for (int lane = 0; lane < numVoices; ++lane)
+            for (int i = 0; i < numSamples; ++i)
+                channels[lane][i] = samples[i * numLanes + lane];
+    }
+
+    //==============================================================================
+    static constexpr float minCutoffHz = 20.0f;
+    static constexpr double smoothingSeconds = 0.01;
+
+    double sampleRate = 44100.0;
+    std::atomic<Mode> mode { Mode::off };
+    std::atomic<float> cutoff { 2000.0f }, resonance { 0.707f }, keyTracking { 0.5f };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(VoiceFilter)
+};
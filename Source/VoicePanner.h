@@ -0,0 +1,130 @@
+#pragma once
+
+#include "DemoUtilities.h"
+
+//==============================================================================
+/** Works out how much of a voice goes to each output channel.
+
+    Voices render in mono, and the engine mixes each one into the outputs with
+    a gain per channel that's computed once per block from the voice's pan
+    position, so the per-sample work is a multiply-add per channel.
+
+    A pan of -1 is hard left and +1 hard right, with a constant-power law in
+    between. With a single output channel everything goes to it at unity gain.
+
+    Given more than two outputs, which the engine only does when surround
+    panning is switched on (see SynthEngine::setSurroundPanning()), the
+    speakers are taken to be evenly spaced around a ring, clockwise from
+    channel 1 straight ahead, and the pan becomes an angle: 0 is ahead, and
+    -1 and +1 both point straight behind. The gains come from 2D vector base
+    amplitude panning (VBAP) between the two speakers either side of that
+    angle, normalised to constant power. At most two channels get a non-zero
+    gain, so mixing a voice costs the same however many outputs there are.
+*/
+class VoicePanner final
+{
+public:
+    /** The most output channels a voice can be mixed into. */
+    static constexpr int maxChannels = 16;
+
+    VoicePanner() = default;
+
+    /** Doesn't allocate, so it's safe to call from the audio thread whenever the output changes. */
+    void setNumChannels(int newNumChannels) noexcept
+    {
+        newNumChannels = jlimit(1, maxChannels, newNumChannels);
+
+        if (newNumChannels == numChannels)
+            return;
+
+        numChannels = newNumChannels;
+
+        if (numChannels > 2)
+            buildRing();
+    }
+
+    int getNumChannels() const noexcept    { return numChannels; }
+
+    /** Fills gains[0 .. getNumChannels() - 1] for a pan position. */
+    void getGains(float pan, float* gains) const noexcept
+    {
+        std::fill(gains, gains + numChannels, 0.0f);
+
+        if (numChannels == 1)
+        {
+            gains[0] = 1.0f;
+            return;
+        }
+
+        if (numChannels > 2)
+        {
+            getRingGains(jlimit(-1.0f, 1.0f, pan) * MathConstants<float>::pi, gains);
+            return;
+        }
+
+        auto angle = (jlimit(-1.0f, 1.0f, pan) + 1.0f) * MathConstants<float>::pi * 0.25f;
+        gains[0] = std::cos(angle);
+        gains[1] = std::sin(angle);
+    }
+
+private:
+    //==============================================================================
+    /** The inverse of the matrix whose rows are the unit vectors of a pair of
+        adjacent speakers (x to the right, y ahead).
+    */
+    struct PairInverse
+    {
+        float m00 = 1.0f, m01 = 0.0f, m10 = 0.0f, m11 = 1.0f;
+    };
+
+    void buildRing() noexcept
+    {
+        auto spacing = MathConstants<float>::twoPi / (float)numChannels;
+
+        for (int i = 0; i < numChannels; ++i)
+        {
+            auto a1 = spacing * (float)i;
+            auto a2 = spacing * (float)(i + 1);
+
+            auto x1 = std::sin(a1), y1 = std::cos(a1);
+            auto x2 = std::sin(a2), y2 = std::cos(a2);
+            auto det = x1 * y2 - x2 * y1;
+
+            auto& inverse = pairInverses[(size_t)i];
+            inverse.m00 = y2 / det;
+            inverse.m01 = -y1 / det;
+            inverse.m10 = -x2 / det;
+            inverse.m11 = x1 / det;
+        }
+    }
+
+    void getRingGains(float azimuth, float* gains) const noexcept
+    {
+        auto spacing = MathConstants<float>::twoPi / (float)numChannels;
+
+        if (azimuth < 0.0f)
+            azimuth += MathConstants<float>::twoPi;
+
+        // The speakers are evenly spaced, so the pair either side is found directly
+        auto first = jlimit(0, numChannels - 1, (int)(azimuth / spacing));
+        auto second = (first + 1) % numChannels;
+        auto& inverse = pairInverses[(size_t)first];
+
+        auto x = std::sin(azimuth), y = std::cos(azimuth);
+        auto g1 = jmax(0.0f, x * inverse.m00 + y * inverse.m10);
+        auto g2 = jmax(0.0f, x * inverse.m01 + y * inverse.m11);
+        auto norm = std::sqrt(g1 * g1 + g2 * g2);
+
+        if (norm <= 0.0f)
+        {
+            gains[first] = 1.0f;
+            return;
+        }
+
+        gains[first] = g1 / norm;
+        gains[second] = g2 / norm;
+    }
+
+    int numChannels = 2;
+    std::array<PairInverse, maxChannels> pairInverses;
+};
@@ -0,0 +1,447 @@
+#pragma once
+
+#include "DemoUtilities.h"
+#include "SmoothedParameter.h"
+#include <juce_dsp/juce_dsp.h>
+
+//==============================================================================
+/** A set of single-cycle waveforms (its frames, or table positions), each kept
+    as a mipmap of octave-spaced band-limited copies.
+
+    The copies are made up front with an FFT: level 0 keeps every harmonic the
+    table can hold, and each level after it keeps half as many as the one
+    before, so a voice can always pick a level with nothing above Nyquist for
+    the pitch it's playing. Every copy has a guard sample on the end, so
+    interpolated reads never have to wrap.
+*/
+class Wavetable final : public ReferenceCountedObject
+{
+public:
+    using Ptr = ReferenceCountedObjectPtr<Wavetable>;
+
+    static constexpr int tableOrder = 11;
+    static constexpr int tableSize = 1 << tableOrder;
+    static constexpr int numLevels = tableOrder;      // down to a single harmonic
+    static constexpr int maxFrames = 256;
+
+    //==============================================================================
+    /** Builds a table from single cycles of tableSize samples laid end to end,
+        as in a wavetable file. Returns nullptr if there isn't a whole cycle.
+    */
+    static Ptr createFromCycles(const String& name, const float* cycles, int numSamples)
+    {
+        auto numFrames = jmin(maxFrames, numSamples / tableSize);
+
+        if (numFrames == 0)
+            return nullptr;
+
+        Ptr table = new Wavetable(name, numFrames);
+
+        for (int frame = 0; frame < numFrames; ++frame)
+            table->buildMipmaps(frame, cycles + frame * tableSize, tableSize / 2);
+
+        table->normalise();
+        return table;
+    }
+
+    /** Reads a file of single cycles (see createFromCycles()), mixed down to mono. */
+    static Ptr loadFromFile(const File& file, AudioFormatManager& formatManager)
+    {
+        std::unique_ptr<AudioFormatReader> reader(formatManager.createReaderFor(file));
+
+        if (reader == nullptr)
+            return nullptr;
+
+        auto length = (int)jmin(reader->lengthInSamples, (int64)(maxFrames * tableSize));
+        AudioBuffer<float> cycles(1, length);
+        reader->read(&cycles, 0, length, 0, true, false);
+
+        return createFromCycles(file.getFullPathName(), cycles.getReadPointer(0), length);
+    }
+
+    /** Takes numFrames cycles, evenly spaced, out of a recording of a note at a
+        known pitch, so that scanning the table plays back how its tone changes.
+        Each cycle is resampled to the table's length, and only the harmonics the
+        recording actually had at its own sample rate are kept.
+    */
+    static Ptr extractFromRecording(const String& name, const float* samples, int numSamples,
+                                    double sampleRate, double fundamentalHz, int numFrames)
+    {
+        auto cycleLength = sampleRate / fundamentalHz;
+        numFrames = jlimit(1, maxFrames, numFrames);
+
+        if (cycleLength < 2.0 || numSamples < (int)cycleLength + 4)
+            return nullptr;
+
+        Ptr table = new Wavetable(name, numFrames);
+        std::vector<float> cycle((size_t)tableSize);
+        // The cubic reads need a sample before each cycle and two after it
+        auto firstStart = 1.0, lastStart = (double)numSamples - cycleLength - 3.0;
+        auto harmonics = jlimit(1, tableSize / 2, (int)(cycleLength / 2.0));
+
+        for (int frame = 0; frame < numFrames; ++frame)
+        {
+            auto start = numFrames > 1 ? firstStart + (lastStart - firstStart) * frame / (numFrames - 1) : firstStart;
+
+            for (int i = 0; i < tableSize; ++i)
+                cycle[(size_t)i] = readCubic(samples, start + cycleLength * i / tableSize);
+
+            table->buildMipmaps(frame, cycle.data(), harmonics);
+        }
+
+        table->normalise();
+        return table;
+    }
+
+    //==============================================================================
+    const String& getName() const noexcept    { return name; }
+    int getNumFrames() const noexcept         { return numFrames; }
+
+    size_t getSizeInBytes() const noexcept    { return data.size() * sizeof(float); }
+
+    /** The level with no harmonics above Nyquist at this many cycles per sample. */
+    static int getLevelFor(float cyclesPerSample) noexcept
+    {
+        auto level = 0;
+
+        while (level < numLevels - 1 && (float)((tableSize / 2) >> level) * cyclesPerSample > 0.5f)
+            ++level;
+
+        return level;
+    }
+
+    /** tableSize + 1 samples, the last a copy of the first. */
+    const float* getCycle(int frame, int level) const noexcept
+    {
+        jassert(isPositiveAndBelow(frame, numFrames) && isPositiveAndBelow(level, numLevels));
+        return data.data() + ((size_t)frame * numLevels + (size_t)level) * (size_t)stride;
+    }
+
+private:
+    static constexpr int stride = tableSize + 1;
+
+    Wavetable(const String& tableName, int frames)
+        : name(tableName), numFrames(frames), data((size_t)frames * numLevels * stride, 0.0f)
+    {
+    }
+
+    float* getWritableCycle(int frame, int level) noexcept
+    {
+        return const_cast<float*>(getCycle(frame, level));
+    }
+
+    /** Fills in every level of a frame from one cycle, keeping at most maxHarmonics at level 0. */
+    void buildMipmaps(int frame, const float* cycle, int maxHarmonics)
+    {
+        dsp::FFT fft(tableOrder);
+        std::vector<float> spectrum((size_t)tableSize * 2, 0.0f), bins((size_t)tableSize * 2);
+
+        std::copy(cycle, cycle + tableSize, spectrum.begin());
+        fft.performRealOnlyForwardTransform(spectrum.data(), true);
+
+        for (int level = 0; level < numLevels; ++level)
+        {
+            // Keeps harmonics 1 to the limit (each as a re/im pair), and drops DC
+            auto limit = jmin(maxHarmonics, (tableSize / 2) >> level);
+            std::fill(bins.begin(), bins.end(), 0.0f);
+            std::copy(spectrum.begin() + 2, spectrum.begin() + 2 * (limit + 1), bins.begin() + 2);
+
+            fft.performRealOnlyInverseTransform(bins.data());
+
+            auto* dest = getWritableCycle(frame, level);
+            std::copy(bins.begin(), bins.begin() + tableSize, dest);
+            dest[tableSize] = dest[0];
+        }
+    }
+
+    /** Scales the whole table, keeping the frames' levels relative to each other. */
+    void normalise() noexcept
+    {
+        auto peak = FloatVectorOperations::findMaximum(data.data(), (int)data.size());
+        auto trough = FloatVectorOperations::findMinimum(data.data(), (int)data.size());
+        auto scale = jmax(peak, -trough);
+
+        if (scale > 0.0f)
+            FloatVectorOperations::multiply(data.data(), 1.0f / scale, (int)data.size());
+    }
+
+    static float readCubic(const float* samples, double position) noexcept
+    {
+        auto index = jmax(1, (int)position);
+        auto t = (float)(position - index);
+        auto y0 = samples[index - 1], y1 = samples[index], y2 = samples[index + 1], y3 = samples[index + 2];
+
+        // Catmull-Rom
+        return y1 + 0.5f * t * (y2 - y0 + t * (2.0f * y0 - 5.0f * y1 + 4.0f * y2 - y3 + t * (3.0f * (y1 - y2) + y3 - y0)));
+    }
+
+    const String name;
+    const int numFrames;
+    std::vector<float> data;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Wavetable)
+};
+
+//==============================================================================
+/** Shares wavetables between sounds, so each one is only built and held once.
+
+    Voices never hold the last reference to a table: the cache keeps one until
+    collectGarbage() finds nothing else does, so a table is never freed on the
+    audio thread. Call everything here from the message thread.
+*/
+class WavetableCache final
+{
+public:
+    WavetableCache() = default;
+
+    /** Returns the table for a key, calling create() to build it if it isn't already here. */
+    template <typename CreateFunction>
+    Wavetable::Ptr getOrCreate(const String& key, CreateFunction&& create)
+    {
+        if (auto existing = keys.indexOf(key); existing >= 0)
+            return tables[existing];
+
+        Wavetable::Ptr table = create();
+
+        if (table != nullptr)
+        {
+            keys.add(key);
+            tables.add(table);
+        }
+
+        return table;
+    }
+
+    /** Forgets the tables nothing else refers to any more. */
+    void collectGarbage()
+    {
+        for (int i = tables.size(); --i >= 0;)
+        {
+            if (tables.getObjectPointerUnchecked(i)->getReferenceCount() == 1)
+            {
+                tables.remove(i);
+                keys.remove(i);
+            }
+        }
+    }
+
+    int getNumTables() const noexcept    { return tables.size(); }
+
+    size_t getSizeInBytes() const noexcept
+    {
+        size_t total = 0;
+
+        for (auto* table : tables)
+            total += table->getSizeInBytes();
+
+        return total;
+    }
+
+private:
+    StringArray keys;                            // parallel to tables
+    ReferenceCountedArray<Wavetable> tables;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WavetableCache)
+};
+
+//==============================================================================
+/** The sound for the WavetableVoice: which table it plays. */
+struct WavetableSound final : public SynthesiserSound
+{
+    explicit WavetableSound(Wavetable::Ptr tableToUse)
+        : table(std::move(tableToUse))
+    {
+        jassert(table != nullptr);
+    }
+
+    bool appliesToNote(int /*midiNoteNumber*/) override    { return true; }
+    bool appliesToChannel(int /*midiChannel*/) override    { return true; }
+
+    const Wavetable::Ptr table;
+    ADSR::Parameters envelope { 0.005f, 0.2f, 0.7f, 0.3f };
+};
+
+//==============================================================================
+/** A voice that plays a Wavetable, scanning through its frames with MIDI CC 74
+    (brightness, or timbre on MPE controllers).
+
+    The mipmap level is chosen once per chunk from the highest pitch in it. The
+    table position glides, so the pair of frames either side of it is found
+    for every sample, as it's read, and crossfaded between. The phases are
+    accumulated in order, then the table is read at all of them in one pass and
+    the interpolation and crossfade are done with vector operations over the chunk.
+*/
+class WavetableVoice final : public SynthesiserVoice
+{
+public:
+    /** The controller that moves through the table's frames. */
+    static constexpr int positionController = 74;
+
+    WavetableVoice() = default;
+
+    bool canPlaySound(SynthesiserSound* sound) override
+    {
+        return dynamic_cast<WavetableSound*>(sound) != nullptr;
+    }
+
+    void startNote(int midiNoteNumber, float velocity, SynthesiserSound* sound, int currentPitchWheelPosition) override
+    {
+        auto* wavetableSound = dynamic_cast<WavetableSound*>(sound);
+
+        if (wavetableSound == nullptr)
+            return;
+
+        table = wavetableSound->table.get();
+        phase = 0.0;
+        cyclesPerSample = (float)(MidiMessage::getMidiNoteInHertz(midiNoteNumber) / getSampleRate());
+        level = velocity * 0.15f;
+
+        position.prepare(getSampleRate(), 0.02);
+        position.setCurrentAndTargetValue(0.0f);
+        positionSnapPending = true;
+
+        adsr.setSampleRate(getSampleRate());
+        adsr.setParameters(wavetableSound->envelope);
+        adsr.noteOn();
+
+        controls.prepare(getSampleRate());
+        controls.startNote(currentPitchWheelPosition);
+    }
+
+    void stopNote(float /*velocity*/, bool allowTailOff) override
+    {
+        if (allowTailOff)
+        {
+            adsr.noteOff();
+        }
+        else
+        {
+            adsr.reset();
+            clearCurrentNote();
+            table = nullptr;
+        }
+    }
+
+    void pitchWheelMoved(int newValue) override    { controls.pitchWheelMoved(newValue); }
+
+    void controllerMoved(int controllerNumber, int newValue) override
+    {
+        if (controllerNumber == positionController)
+            position.setTargetValue((float)jlimit(0, 127, newValue) / 127.0f);
+
+        controls.controllerMoved(controllerNumber, newValue);
+    }
+
+    void renderNextBlock(AudioBuffer<float>& outputBuffer, int startSample, int numSamples) override
+    {
+        // In chunks, so the controls can hand over their smoothed values in fixed-size arrays
+        while (numSamples > 0 && table != nullptr && isVoiceActive())
+        {
+            auto chunk = jmin(numSamples, VoiceControls::maxChunkSize);
+            auto* pitch = controls.getNextPitchMultipliers(chunk);
+            auto* gains = controls.getNextGains(chunk);
+
+            renderChunk(outputBuffer, startSample, chunk, pitch, gains);
+            startSample += chunk;
+            numSamples -= chunk;
+        }
+    }
+
+    using SynthesiserVoice::renderNextBlock;
+
+private:
+    static constexpr int maxChunkSize = VoiceControls::maxChunkSize;
+    using ChunkArray = std::array<float, maxChunkSize>;
+
+    void renderChunk(AudioBuffer<float>& outputBuffer, int startSample, int numSamples,
+                     const float* pitch, const float* gains)
+    {
+        // A controller sent before the note's first chunk is jumped to, like the VoiceControls do
+        if (std::exchange(positionSnapPending, false))
+            position.skipToTarget();
+
+        auto* increments = scratch[0].data();
+        FloatVectorOperations::copyWithMultiply(increments, pitch, cyclesPerSample, numSamples);
+
+        auto mipLevel = Wavetable::getLevelFor(FloatVectorOperations::findMaximum(increments, numSamples));
+
+        // Where each sample is in the table, in frames
+        auto lastFrame = table->getNumFrames() - 1;
+        auto* positions = position.getNextValues(numSamples);
+        auto* crossfade = scratch[1].data();
+        FloatVectorOperations::copyWithMultiply(crossfade, positions, (float)lastFrame, numSamples);
+
+        // The only serial part: each phase depends on the one before
+        auto* fractions = scratch[2].data();
+        std::array<int, maxChunkSize> indices;
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto index = (int)phase;
+            indices[(size_t)i] = index;
+            fractions[i] = (float)(phase - index);
+
+            phase += increments[i] * (double)Wavetable::tableSize;
+
+            if (phase >= (double)Wavetable::tableSize)
+                phase -= (double)Wavetable::tableSize;
+        }
+
+        auto* a0 = scratch[3].data();
+        auto* a1 = scratch[4].data();
+        auto* b0 = scratch[5].data();
+        auto* b1 = scratch[6].data();
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            // The frames either side of this sample's position, and how far it is between them
+            auto frameA = jlimit(0, jmax(0, lastFrame - 1), (int)crossfade[i]);
+            auto frameB = jmin(lastFrame, frameA + 1);
+            crossfade[i] = jlimit(0.0f, 1.0f, crossfade[i] - (float)frameA);
+
+            auto* cycleA = table->getCycle(frameA, mipLevel);
+            auto* cycleB = table->getCycle(frameB, mipLevel);
+            auto index = indices[(size_t)i];
+            a0[i] = cycleA[index];
+            a1[i] = cycleA[index + 1];
+            b0[i] = cycleB[index];
+            b1[i] = cycleB[index + 1];
+        }
+
+        // a = a0 + (a1 - a0) * fraction, the same for b, then out = a + (b - a) * crossfade
+        FloatVectorOperations::subtract(a1, a0, numSamples);
+        FloatVectorOperations::addWithMultiply(a0, a1, fractions, numSamples);
+        FloatVectorOperations::subtract(b1, b0, numSamples);
+        FloatVectorOperations::addWithMultiply(b0, b1, fractions, numSamples);
+        FloatVectorOperations::subtract(b0, a0, numSamples);
+        FloatVectorOperations::addWithMultiply(a0, b0, crossfade, numSamples);
+
+        auto* mono = a0;
+        FloatVectorOperations::multiply(mono, gains, numSamples);
+        FloatVectorOperations::multiply(mono, level, numSamples);
+
+        AudioBuffer<float> chunk(&mono, 1, numSamples);
+        adsr.applyEnvelopeToBuffer(chunk, 0, numSamples);
+
+        for (auto ch = outputBuffer.getNumChannels(); --ch >= 0;)
+            FloatVectorOperations::add(outputBuffer.getWritePointer(ch, startSample), mono, numSamples);
+
+        if (!adsr.isActive())
+        {
+            clearCurrentNote();
+            table = nullptr;
+        }
+    }
+
+    // The sound, which the synth holds while this plays it, keeps the table alive
+    const Wavetable* table = nullptr;
+    double phase = 0.0;
+    float cyclesPerSample = 0.0f, level = 0.0f;
+    SmoothedParameter position { SmoothedParameter::Ramp::linear, 0.0f };
+    bool positionSnapPending = false;
+    std::array<ChunkArray, 7> scratch {};
+    ADSR adsr;
+    VoiceControls controls;
+
+    JUCE_LEAK_DETECTOR(WavetableVoice)
+};